@@ -7,6 +7,7 @@ DISABLE_WARNINGS_PUSH()
 #include <glm/vec3.hpp>
 DISABLE_WARNINGS_POP()
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <span>
 #include <vector>
@@ -28,7 +29,9 @@ struct Material {
 	// if (material.kdTexture) {
 	//   material.kdTexture->getTexel(...);
 	// }
-	std::optional<Image> kdTexture;
+	//
+	// Shared by handle: copies of the material (and the sub meshes of a file that use the same image) share the pixels.
+	std::shared_ptr<const Image> kdTexture;
 };
 
 struct Mesh {
@@ -14,6 +14,7 @@ DISABLE_WARNINGS_POP()
 #include <cassert>
 #include <exception>
 #include <iostream>
+#include <map>
 #include <numeric>
 #include <span>
 #include <stack>
@@ -71,6 +72,7 @@ std::vector<Mesh> loadMesh(const std::filesystem::path& file, bool centerAndNorm
 	}
 
 	std::vector<Mesh> out;
+	std::map<std::filesystem::path, std::shared_ptr<const Image>> textures; // Every image is loaded once per file
 
 	std::stack<std::tuple<aiNode*, glm::mat4>> stack;
 	stack.push({ pAssimpScene->mRootNode, assimpMatrix(pAssimpScene->mRootNode->mTransformation) });
@@ -130,7 +132,10 @@ std::vector<Mesh> loadMesh(const std::filesystem::path& file, bool centerAndNorm
 				std::filesystem::path textureBasePath = std::filesystem::absolute(file).parent_path();
 				std::filesystem::path absoluteTexturePath = textureBasePath / std::filesystem::path(relativeTexturePath.C_Str());
 				try {
-					mesh.material.kdTexture = Image(absoluteTexturePath);
+					std::shared_ptr<const Image>& texture = textures[absoluteTexturePath];
+					if (!texture)
+						texture = std::make_shared<const Image>(absoluteTexturePath);
+					mesh.material.kdTexture = texture;
 				}
 				catch (const std::exception&) {
 					// Failed to load image.
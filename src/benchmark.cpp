@@ -0,0 +1,871 @@
+#include "benchmark.h"
+#include "bounding_volume_hierarchy.h"
+#include "bvh_statistics.h"
+#include "light_bvh.h"
+#include "ray_tracing.h"
+#include "scene.h"
+#include "wide_bvh.h"
+// Suppress warnings in third-party code.
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/geometric.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/trigonometric.hpp>
+DISABLE_WARNINGS_POP()
+#include <tbb/global_control.h>
+#include <tbb/info.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <numbers>
+#include <optional>
+#include <random>
+#include <vector>
+
+using benchmark_clock = std::chrono::high_resolution_clock;
+
+// A resolution x resolution grid of rays from (0, 0, -3) through the square from (-1, -1, 0) to (1, 1, 0), the camera
+// used by most of the benchmarks below.
+static std::vector<Ray> makeRayGrid(int resolution)
+{
+    const glm::vec3 origin { 0.0f, 0.0f, -3.0f };
+    const float halfResolution = float(resolution) / 2.0f;
+    std::vector<Ray> rays;
+    for (int y = 0; y < resolution; y++) {
+        for (int x = 0; x < resolution; x++) {
+            const glm::vec3 target { float(x) / halfResolution - 1.0f, float(y) / halfResolution - 1.0f, 0.0f };
+            rays.push_back(Ray { origin, glm::normalize(target - origin) });
+        }
+    }
+    return rays;
+}
+
+// Shortest time of a few runs of f, so that a single hiccup does not show up in the result.
+template <typename F>
+static benchmark_clock::duration bestOf(int repetitions, F&& f)
+{
+    benchmark_clock::duration best = benchmark_clock::duration::max();
+    for (int repetition = 0; repetition < repetitions; repetition++) {
+        const auto start = benchmark_clock::now();
+        f();
+        best = std::min(best, benchmark_clock::now() - start);
+    }
+    return best;
+}
+
+static float milliseconds(benchmark_clock::duration duration)
+{
+    return std::chrono::duration<float, std::milli>(duration).count();
+}
+
+static float nanosecondsPerRay(benchmark_clock::duration duration, size_t numRays)
+{
+    return std::chrono::duration<float, std::nano>(duration).count() / float(numRays);
+}
+
+// Best of three runs of closest hit queries, in nanoseconds per ray.
+static float timeClosestHits(const BoundingVolumeHierarchy& bvh, const std::vector<Ray>& rays, size_t& numHits)
+{
+    const benchmark_clock::duration duration = bestOf(3, [&]() {
+        numHits = 0;
+        for (Ray ray : rays) {
+            HitInfo hitInfo;
+            numHits += bvh.intersect(ray, hitInfo);
+        }
+    });
+    return nanosecondsPerRay(duration, rays.size());
+}
+
+// Best of three runs of the same rays as shadow rays cut off at t = 3, in nanoseconds per ray.
+static float timeShadowRays(const BoundingVolumeHierarchy& bvh, const std::vector<Ray>& rays, size_t& numOccluded)
+{
+    const benchmark_clock::duration duration = bestOf(3, [&]() {
+        numOccluded = 0;
+        for (const Ray& ray : rays)
+            numOccluded += bvh.occluded(ray.origin, ray.direction, 3.0f);
+    });
+    return nanosecondsPerRay(duration, rays.size());
+}
+
+void runBenchmarks(const std::filesystem::path& dataDir)
+{
+    benchmarkBoxTests();
+    benchmarkTriangleTests(dataDir);
+    benchmarkLeafPackets(dataDir);
+    benchmarkRayPackets(dataDir);
+    benchmarkDeferredHits(dataDir);
+    benchmarkBvhBuild(dataDir);
+    benchmarkBvhLayouts(dataDir);
+    benchmarkCompressedNodes(dataDir);
+    benchmarkSpatialSplits(dataDir);
+    benchmarkLinearBuild(dataDir);
+    benchmarkTreeletOptimization(dataDir);
+    benchmarkBvhRefit(dataDir);
+    benchmarkInstancing(dataDir);
+    benchmarkShapes();
+    benchmarkLightSelection();
+}
+
+void benchmarkBoxTests()
+{
+    // Random rays from around the unit cube towards random boxes inside it. Most tests miss, like most box tests during traversal.
+    constexpr size_t numRays = 4096;
+    constexpr size_t numBoxes = 256;
+    std::mt19937 rng { 1234 };
+    std::uniform_real_distribution<float> distribution { -1.0f, 1.0f };
+    const auto randomPoint = [&]() { return glm::vec3(distribution(rng), distribution(rng), distribution(rng)); };
+
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < numRays; i++) {
+        const glm::vec3 origin = 3.0f * randomPoint();
+        rays.push_back(Ray { origin, glm::normalize(0.5f * randomPoint() - origin) });
+    }
+    std::vector<AxisAlignedBox> boxes;
+    for (size_t i = 0; i < numBoxes; i++) {
+        const glm::vec3 corner = randomPoint();
+        boxes.push_back(AxisAlignedBox { corner, corner + 0.5f * glm::abs(randomPoint()) });
+    }
+
+    const auto report = [](const char* name, benchmark_clock::duration duration, size_t numHits) {
+        const float seconds = std::chrono::duration<float>(duration).count();
+        std::cout << name << ": " << float(numRays * numBoxes) / seconds / 1e6f << " million box tests per second ("
+                  << float(numHits) / float(numRays * numBoxes) * 100.0f << "% hit)" << std::endl;
+    };
+
+    // Original kernel: 12 ray/triangle tests per box.
+    size_t numHits = 0;
+    auto start = benchmark_clock::now();
+    for (const Ray& ray : rays) {
+        for (const AxisAlignedBox& box : boxes) {
+            Ray copy = ray;
+            numHits += intersectRayWithBoxTriangles(box, copy);
+        }
+    }
+    report("Box test (12 triangles)", benchmark_clock::now() - start, numHits);
+
+    // Slab test with the inverse direction computed once per ray, as done during BVH traversal.
+    numHits = 0;
+    start = benchmark_clock::now();
+    for (const Ray& ray : rays) {
+        const RayInverse rayInverse { ray };
+        for (const AxisAlignedBox& box : boxes) {
+            float tEntry, tExit;
+            numHits += intersectRayWithBox(box.lower, box.upper, rayInverse, ray.t, tEntry, tExit);
+        }
+    }
+    report("Box test (slab)", benchmark_clock::now() - start, numHits);
+}
+
+// Closed sphere with jittered vertices: the triangles around a vertex all use the same index, so there is no seam and
+// every ray from inside has to hit it.
+static Mesh makeClosedSphere(uint32_t numRings, uint32_t numSegments)
+{
+    std::mt19937 rng { 4321 };
+    std::uniform_real_distribution<float> jitter { 0.95f, 1.05f };
+    Mesh mesh;
+    mesh.material.kd = glm::vec3(0.8f);
+    mesh.vertices.push_back(Vertex { glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), glm::vec2(0.0f) });
+    for (uint32_t ring = 1; ring < numRings; ring++) {
+        const float theta = std::numbers::pi_v<float> * float(ring) / float(numRings);
+        for (uint32_t segment = 0; segment < numSegments; segment++) {
+            const float phi = 2.0f * std::numbers::pi_v<float> * float(segment) / float(numSegments);
+            const glm::vec3 normal { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) };
+            mesh.vertices.push_back(Vertex { jitter(rng) * normal, normal, glm::vec2(0.0f) });
+        }
+    }
+    const uint32_t bottom = uint32_t(mesh.vertices.size());
+    mesh.vertices.push_back(Vertex { glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec2(0.0f) });
+
+    const auto vertexIndex = [&](uint32_t ring, uint32_t segment) { return 1 + (ring - 1) * numSegments + segment % numSegments; };
+    for (uint32_t segment = 0; segment < numSegments; segment++) {
+        mesh.triangles.push_back(glm::uvec3(0, vertexIndex(1, segment), vertexIndex(1, segment + 1)));
+        mesh.triangles.push_back(glm::uvec3(bottom, vertexIndex(numRings - 1, segment + 1), vertexIndex(numRings - 1, segment)));
+        for (uint32_t ring = 1; ring + 1 < numRings; ring++) {
+            mesh.triangles.push_back(glm::uvec3(vertexIndex(ring, segment), vertexIndex(ring + 1, segment), vertexIndex(ring, segment + 1)));
+            mesh.triangles.push_back(glm::uvec3(vertexIndex(ring, segment + 1), vertexIndex(ring + 1, segment), vertexIndex(ring + 1, segment + 1)));
+        }
+    }
+    return mesh;
+}
+
+void benchmarkTriangleTests(const std::filesystem::path& dataDir)
+{
+    constexpr std::array tests { std::pair { TriangleTest::Original, "original" }, std::pair { TriangleTest::Precomputed, "precomputed" }, std::pair { TriangleTest::Watertight, "watertight" } };
+
+    // Raw kernels: random rays from around the unit cube towards random triangles inside it.
+    {
+        std::mt19937 rng { 1234 };
+        std::uniform_real_distribution<float> distribution { -1.0f, 1.0f };
+        const auto randomPoint = [&]() { return glm::vec3(distribution(rng), distribution(rng), distribution(rng)); };
+        std::vector<Ray> rays;
+        for (size_t i = 0; i < 4096; i++) {
+            const glm::vec3 origin = 3.0f * randomPoint();
+            rays.push_back(Ray { origin, glm::normalize(0.5f * randomPoint() - origin) });
+        }
+        std::vector<glm::mat3> triangles;
+        std::vector<TriangleRecord> records;
+        for (size_t i = 0; i < 256; i++) {
+            const glm::vec3 v0 = randomPoint();
+            triangles.push_back(glm::mat3(v0, v0 + 0.5f * randomPoint(), v0 + 0.5f * randomPoint()));
+            records.push_back(makeTriangleRecord(triangles.back()[0], triangles.back()[1], triangles.back()[2]));
+        }
+
+        for (const auto& [test, name] : tests) {
+            size_t numHits = 0;
+            const auto start = benchmark_clock::now();
+            for (const Ray& ray : rays) {
+                const WatertightRay watertightRay { ray };
+                for (size_t i = 0; i < triangles.size(); i++) {
+                    TriangleHit hit;
+                    HitInfo hitInfo;
+                    Ray copy = ray;
+                    if (test == TriangleTest::Original)
+                        numHits += intersectRayWithTriangle(triangles[i][0], triangles[i][1], triangles[i][2], copy, hitInfo);
+                    else if (test == TriangleTest::Precomputed)
+                        numHits += intersectRayWithTriangle(records[i], ray, hit);
+                    else
+                        numHits += intersectRayWithTriangle(triangles[i][0], triangles[i][1], triangles[i][2], watertightRay, ray.t, hit);
+                }
+            }
+            const float seconds = std::chrono::duration<float>(benchmark_clock::now() - start).count();
+            std::cout << "Triangle test " << name << ": " << float(rays.size() * triangles.size()) / seconds / 1e6f << " million tests per second ("
+                      << float(numHits) / float(rays.size() * triangles.size()) * 100.0f << "% hit)" << std::endl;
+        }
+    }
+
+    // Whole traversal: the same grid of rays as benchmarkBvhLayouts.
+    const std::vector<Ray> rays = makeRayGrid(256);
+    for (const auto& [sceneType, sceneName] : { std::pair { Teapot, "teapot" }, std::pair { CornellBox, "Cornell box" } }) {
+        Scene scene = loadScene(sceneType, dataDir);
+        for (const auto& [test, name] : tests) {
+            BvhSettings settings {};
+            settings.triangleTest = test;
+            const BoundingVolumeHierarchy bvh { &scene, settings };
+            size_t numHits = 0;
+            const float bestClosest = timeClosestHits(bvh, rays, numHits);
+            std::cout << "Triangle test " << name << " (" << sceneName << "): " << bestClosest << " ns per closest hit ray (" << numHits << " hits)" << std::endl;
+        }
+    }
+
+    // Leaks: rays from points inside a closed mesh through random points on its edges. Every one of them has to hit.
+    Scene sphere;
+    sphere.meshes.push_back(makeClosedSphere(64, 128));
+    std::mt19937 rng { 5678 };
+    std::uniform_real_distribution<float> distribution { 0.0f, 1.0f };
+    std::vector<Ray> edgeRays;
+    for (const glm::uvec3& triangle : sphere.meshes[0].triangles) {
+        for (int edge = 0; edge < 3; edge++) {
+            const glm::vec3 start = sphere.meshes[0].vertices[triangle[edge]].position;
+            const glm::vec3 end = sphere.meshes[0].vertices[triangle[(edge + 1) % 3]].position;
+            const glm::vec3 origin = 0.3f * glm::vec3(distribution(rng), distribution(rng), distribution(rng)) - 0.15f;
+            edgeRays.push_back(Ray { origin, glm::normalize((start + distribution(rng) * (end - start)) - origin) });
+        }
+    }
+    for (const auto& [test, name] : tests) {
+        BvhSettings settings {};
+        settings.triangleTest = test;
+        const BoundingVolumeHierarchy bvh { &sphere, settings };
+        size_t numMisses = 0;
+        for (Ray ray : edgeRays) {
+            HitInfo hitInfo;
+            numMisses += !bvh.intersect(ray, hitInfo);
+        }
+        std::cout << "Triangle test " << name << " (closed sphere): " << numMisses << " of " << edgeRays.size() << " rays through edges leak" << std::endl;
+    }
+}
+
+void benchmarkDeferredHits(const std::filesystem::path& dataDir)
+{
+    const std::vector<Ray> rays = makeRayGrid(256);
+
+    Scene scene = loadScene(Teapot, dataDir);
+    for (bool textured : { false, true }) {
+        for (uint32_t materialId : scene.meshMaterialIds)
+            scene.materials[materialId].kdTexture = textured ? std::make_shared<const Image>(dataDir / "default.png") : nullptr;
+        for (const auto& [test, name] : { std::pair { TriangleTest::Original, "original" }, std::pair { TriangleTest::Precomputed, "precomputed" } }) {
+            for (int leafSize : { 4, 16, 64 }) {
+                BvhSettings settings {};
+                settings.triangleTest = test;
+                settings.maxLeafSize = leafSize;
+                const BoundingVolumeHierarchy bvh { &scene, settings };
+                size_t numHits = 0;
+                const float bestNanoseconds = timeClosestHits(bvh, rays, numHits);
+                std::cout << "Deferred hits (" << (textured ? "textured" : "untextured") << " teapot, " << name << " test, leaves of up to " << leafSize
+                          << " triangles): " << bestNanoseconds << " ns per ray" << std::endl;
+            }
+        }
+    }
+}
+
+void benchmarkRayPackets(const std::filesystem::path& dataDir)
+{
+    // Pinhole camera at (0, 0, -3) looking at the unit square around the origin, with one light above the camera.
+    constexpr int resolution = 512;
+    const glm::vec3 origin { 0.0f, 0.0f, -3.0f };
+    const glm::vec3 lightPosition { 0.5f, 2.0f, -2.0f };
+    const auto cameraRay = [&](int x, int y) {
+        const glm::vec3 target { float(x) / (resolution / 2) - 1.0f, float(y) / (resolution / 2) - 1.0f, 0.0f };
+        return Ray { origin, glm::normalize(target - origin) };
+    };
+    const auto shadowRay = [&](const Ray& ray) {
+        const glm::vec3 vertexPos = ray.origin + ray.t * ray.direction;
+        Ray shadow { vertexPos, glm::normalize(lightPosition - vertexPos) };
+        shadow.origin = vertexPos + 0.0001f * shadow.direction;
+        shadow.t = glm::length(lightPosition - shadow.origin);
+        return shadow;
+    };
+
+    for (const auto& [sceneType, sceneName] : { std::pair { CornellBox, "Cornell box" }, std::pair { Monkey, "monkey" }, std::pair { Teapot, "teapot" }, std::pair { InstancedTeapots, "instanced teapots" }, std::pair { ManyShapes, "spheres and boxes" } }) {
+        Scene scene = loadScene(sceneType, dataDir);
+        // Ray by ray with the binary layout first, as the reference for the hits.
+        std::vector<float> referenceT(resolution * resolution);
+        std::vector<bool> referenceOccluded(resolution * resolution);
+        // Packets always traverse the binary nodes, so the binary layout is the fair reference for the visited nodes.
+        for (BvhLayout layout : { BvhLayout::Binary, BvhLayout::WidestSupported }) {
+            BvhSettings settings {};
+            settings.layout = layout;
+            const BoundingVolumeHierarchy bvh { &scene, settings };
+
+            for (int packetSize : { 1, 2, 4, 8 }) {
+                if (packetSize > 1 && layout != BvhLayout::Binary)
+                    continue; // Same traversal as with the binary layout
+                size_t numDifferences = 0;
+                const benchmark_clock::duration duration = bestOf(3, [&]() {
+                    BoundingVolumeHierarchy::resetTraversalStatistics();
+                    numDifferences = 0;
+                    for (int tileY = 0; tileY < resolution; tileY += packetSize) {
+                        for (int tileX = 0; tileX < resolution; tileX += packetSize) {
+                            std::array<Ray, MaxPacketSize> rays, shadowRays;
+                            std::array<HitInfo, MaxPacketSize> hitInfos;
+                            std::array<bool, MaxPacketSize> hits, occluded;
+                            std::array<size_t, MaxPacketSize> pixels, shadowRayPixels;
+                            size_t numRays = 0, numShadowRays = 0;
+                            for (int y = tileY; y < tileY + packetSize; y++) {
+                                for (int x = tileX; x < tileX + packetSize; x++) {
+                                    pixels[numRays] = size_t(y) * resolution + size_t(x);
+                                    rays[numRays++] = cameraRay(x, y);
+                                }
+                            }
+                            if (packetSize == 1)
+                                hits[0] = bvh.intersect(rays[0], hitInfos[0]);
+                            else
+                                bvh.intersectPacket(std::span(rays.data(), numRays), std::span(hitInfos.data(), numRays), std::span(hits.data(), numRays));
+                            for (size_t i = 0; i < numRays; i++) {
+                                if (hits[i]) {
+                                    shadowRayPixels[numShadowRays] = pixels[i];
+                                    shadowRays[numShadowRays++] = shadowRay(rays[i]);
+                                }
+                            }
+                            if (packetSize == 1) {
+                                for (size_t i = 0; i < numShadowRays; i++)
+                                    occluded[i] = bvh.occluded(shadowRays[i].origin, shadowRays[i].direction, shadowRays[i].t);
+                            } else {
+                                bvh.occludedPacket(std::span(shadowRays.data(), numShadowRays), std::span(occluded.data(), numShadowRays));
+                            }
+
+                            for (size_t i = 0; i < numRays; i++) {
+                                const float t = hits[i] ? rays[i].t : std::numeric_limits<float>::max();
+                                if (packetSize == 1 && layout == BvhLayout::Binary)
+                                    referenceT[pixels[i]] = t;
+                                else
+                                    numDifferences += t != referenceT[pixels[i]];
+                            }
+                            for (size_t i = 0; i < numShadowRays; i++) {
+                                if (packetSize == 1 && layout == BvhLayout::Binary)
+                                    referenceOccluded[shadowRayPixels[i]] = occluded[i];
+                                else
+                                    numDifferences += occluded[i] != referenceOccluded[shadowRayPixels[i]];
+                            }
+                        }
+                    }
+                });
+                const float bestNanoseconds = nanosecondsPerRay(duration, size_t(resolution * resolution));
+                const TraversalStatistics statistics = BoundingVolumeHierarchy::traversalStatistics();
+                const TraversalStatistics::Counters& primary = statistics.rays[size_t(RayKind::Primary)];
+                const TraversalStatistics::Counters& shadow = statistics.rays[size_t(RayKind::Shadow)];
+                std::cout << "Ray packets " << packetSize << "x" << packetSize << " (" << (layout == BvhLayout::Binary ? "binary" : "widest") << " layout, " << sceneName << "): "
+                          << bestNanoseconds << " ns per pixel, " << float(primary.nodesVisited) / float(primary.numRays) << " nodes visited per camera ray, "
+                          << float(shadow.nodesVisited) / float(std::max<uint64_t>(shadow.numRays, 1)) << " per shadow ray, " << numDifferences << " differences" << std::endl;
+            }
+        }
+    }
+}
+
+void benchmarkBvhBuild(const std::filesystem::path& dataDir)
+{
+    const int maxThreads = tbb::info::default_concurrency();
+    for (SceneType sceneType : { Monkey, Teapot }) {
+        Scene scene = loadScene(sceneType, dataDir);
+        size_t numTriangles = 0;
+        for (const auto& mesh : scene.meshes)
+            numTriangles += mesh.triangles.size();
+
+        for (BvhBuilder builder : { BvhBuilder::Median, BvhBuilder::BinnedSAH, BvhBuilder::SpatialSplitSAH, BvhBuilder::Linear }) {
+            BvhSettings settings {};
+            settings.builder = builder;
+            constexpr std::array builderNames { "median", "binned SAH", "spatial splits", "linear" };
+            std::cout << "BVH build (" << builderNames[size_t(builder)] << ", " << numTriangles << " triangles):";
+            for (int numThreads = 1; numThreads <= maxThreads; numThreads++) {
+                tbb::global_control threadLimit { tbb::global_control::max_allowed_parallelism, size_t(numThreads) };
+                const benchmark_clock::duration bestBuild = bestOf(5, [&]() { BoundingVolumeHierarchy bvh { &scene, settings }; });
+                std::cout << "  " << numThreads << " thread" << (numThreads > 1 ? "s " : " ") << milliseconds(bestBuild) << " ms";
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+void benchmarkBvhLayouts(const std::filesystem::path& dataDir)
+{
+    // A grid of rays from in front of the scene for closest hits, and the same rays cut off halfway as shadow rays.
+    const std::vector<Ray> rays = makeRayGrid(256);
+
+    std::vector<std::pair<BvhLayout, const char*>> layouts { { BvhLayout::Binary, "binary" }, { BvhLayout::Wide4, "4-wide" } };
+    if (cpuSupportsAvx2())
+        layouts.push_back({ BvhLayout::Wide8, "8-wide" });
+    for (const auto& [sceneType, sceneName] : { std::pair { Monkey, "monkey" }, std::pair { Teapot, "teapot" }, std::pair { InstancedTeapots, "instanced teapots" } }) {
+        Scene scene = loadScene(sceneType, dataDir);
+        for (const auto& [layout, name] : layouts) {
+            BvhSettings settings {};
+            settings.layout = layout;
+            const BoundingVolumeHierarchy bvh { &scene, settings };
+
+            size_t numHits = 0, numOccluded = 0;
+            const float bestClosest = timeClosestHits(bvh, rays, numHits);
+            const float bestOccluded = timeShadowRays(bvh, rays, numOccluded);
+            std::cout << "BVH layout " << name << " (" << sceneName << "): " << bestClosest << " ns per closest hit ray (" << numHits << " hits), "
+                      << bestOccluded << " ns per shadow ray (" << numOccluded << " occluded)" << std::endl;
+        }
+    }
+}
+
+// Sphere with small bumps, tessellated into 2 * numRings * numSegments triangles.
+static Mesh makeBumpySphere(uint32_t numRings, uint32_t numSegments)
+{
+    Mesh mesh;
+    mesh.material.kd = glm::vec3(0.8f);
+    for (uint32_t ring = 0; ring <= numRings; ring++) {
+        const float theta = std::numbers::pi_v<float> * float(ring) / float(numRings);
+        for (uint32_t segment = 0; segment <= numSegments; segment++) {
+            const float phi = 2.0f * std::numbers::pi_v<float> * float(segment) / float(numSegments);
+            const glm::vec3 normal { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) };
+            const float radius = 1.0f + 0.02f * std::sin(60.0f * theta) * std::sin(60.0f * phi);
+            mesh.vertices.push_back(Vertex { radius * normal, normal, glm::vec2(0.0f) });
+        }
+    }
+    for (uint32_t ring = 0; ring < numRings; ring++) {
+        for (uint32_t segment = 0; segment < numSegments; segment++) {
+            const uint32_t first = ring * (numSegments + 1) + segment;
+            const uint32_t below = first + numSegments + 1;
+            mesh.triangles.push_back(glm::uvec3(first, below, first + 1));
+            mesh.triangles.push_back(glm::uvec3(first + 1, below, below + 1));
+        }
+    }
+    return mesh;
+}
+
+void benchmarkLeafPackets(const std::filesystem::path& dataDir)
+{
+    std::vector<std::pair<TriangleTest, const char*>> packetTests { { TriangleTest::Precomputed4, "4 per test" } };
+    if (cpuSupportsAvx2())
+        packetTests.push_back({ TriangleTest::Precomputed8, "8 per test" });
+
+    // Camera-like rays from in front of the scene, with some of them starting inside the larger scenes.
+    const std::vector<Ray> rays = makeRayGrid(256);
+
+    // The packets have to find exactly the same hits as the scalar test, on every scene that comes with the project.
+    for (SceneType sceneType : { SingleTriangle, Cube, CornellBox, CornellBoxParallelogramLight, Monkey, Teapot, Spheres, Custom, InstancedTeapots, ManyShapes }) {
+        Scene scene = loadScene(sceneType, dataDir);
+        BvhSettings settings {};
+        settings.triangleTest = TriangleTest::Precomputed;
+        const BoundingVolumeHierarchy scalar { &scene, settings };
+        for (const auto& [test, name] : packetTests) {
+            settings.triangleTest = test;
+            const BoundingVolumeHierarchy packets { &scene, settings };
+            size_t numHits = 0, numDifferent = 0;
+            for (const Ray& ray : rays) {
+                Ray scalarRay = ray, packetRay = ray;
+                HitInfo scalarHit, packetHit;
+                const bool hit = scalar.intersect(scalarRay, scalarHit);
+                numHits += hit;
+                if (hit != packets.intersect(packetRay, packetHit) || scalarRay.t != packetRay.t || scalarHit.normal != packetHit.normal)
+                    numDifferent++;
+            }
+            std::cout << "Leaf packets " << name << " (scene " << int(sceneType) << "): " << numDifferent << " of " << numHits << " hits differ from the scalar test" << std::endl;
+        }
+    }
+
+    Scene sphere;
+    sphere.meshes.push_back(makeBumpySphere(256, 512));
+    Scene teapot = loadScene(Teapot, dataDir);
+    for (const auto& [pScene, sceneName] : { std::pair { &teapot, "teapot" }, std::pair { &sphere, "bumpy sphere" } }) {
+        for (int maxLeafSize : { 4, 8 }) {
+            std::cout << "Leaf packets (" << sceneName << ", max leaf size " << maxLeafSize << "):";
+            std::vector<std::pair<TriangleTest, const char*>> tests { { TriangleTest::Precomputed, "scalar" } };
+            tests.insert(tests.end(), packetTests.begin(), packetTests.end());
+            for (const auto& [test, name] : tests) {
+                BvhSettings settings {};
+                settings.maxLeafSize = maxLeafSize;
+                settings.triangleTest = test;
+                const BoundingVolumeHierarchy bvh { pScene, settings };
+                size_t numHits = 0, numOccluded = 0;
+                const float bestClosest = timeClosestHits(bvh, rays, numHits);
+                const float bestOccluded = timeShadowRays(bvh, rays, numOccluded);
+                std::cout << "  " << name << " " << bestClosest << " / " << bestOccluded << " ns";
+            }
+            std::cout << " per closest hit / shadow ray" << std::endl;
+        }
+    }
+}
+
+void benchmarkCompressedNodes(const std::filesystem::path& dataDir)
+{
+    // Random rays from around the scene through random points inside it, so that consecutive rays share few nodes.
+    std::mt19937 rng { 1234 };
+    std::uniform_real_distribution<float> distribution { -1.0f, 1.0f };
+    const auto randomPoint = [&]() { return glm::vec3(distribution(rng), distribution(rng), distribution(rng)); };
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < 65536; i++) {
+        const glm::vec3 origin = 3.0f * glm::normalize(randomPoint());
+        rays.push_back(Ray { origin, glm::normalize(0.8f * randomPoint() - origin) });
+    }
+
+    Scene largeScene;
+    largeScene.meshes.push_back(makeBumpySphere(512, 1024));
+    std::vector<std::pair<BvhLayout, const char*>> layouts { { BvhLayout::Wide4, "4-wide" }, { BvhLayout::Wide4Compressed, "4-wide compressed" } };
+    if (cpuSupportsAvx2()) {
+        layouts.push_back({ BvhLayout::Wide8, "8-wide" });
+        layouts.push_back({ BvhLayout::Wide8Compressed, "8-wide compressed" });
+    }
+    Scene teapot = loadScene(Teapot, dataDir);
+    for (const auto& [pScene, sceneName] : { std::pair { &teapot, "teapot" }, std::pair { &largeScene, "bumpy sphere" } }) {
+        size_t numTriangles = 0;
+        for (const auto& mesh : pScene->meshes)
+            numTriangles += mesh.triangles.size();
+        for (const auto& [layout, name] : layouts) {
+            BvhSettings settings {};
+            settings.layout = layout;
+            const BoundingVolumeHierarchy bvh { pScene, settings };
+            // The nodes that the traversal reads, and everything that stays in memory: the binary nodes are kept next to
+            // the wide ones for refitting, ray packets and drawing, so compression shrinks the first but not the second
+            // by as much.
+            size_t traversedBytes = 0;
+            for (const BoundingVolumeHierarchy::MeshBvh& meshBvh : bvh.meshBvhs) {
+                traversedBytes += meshBvh.wideNodes4.size() * sizeof(BoundingVolumeHierarchy::WideNode<4>) + meshBvh.wideNodes8.size() * sizeof(BoundingVolumeHierarchy::WideNode<8>)
+                    + meshBvh.compressedNodes4.size() * sizeof(BoundingVolumeHierarchy::CompressedWideNode<4>) + meshBvh.compressedNodes8.size() * sizeof(BoundingVolumeHierarchy::CompressedWideNode<8>);
+            }
+            const BvhStatistics statistics = computeBvhStatistics(bvh);
+            size_t residentBytes = statistics.topLevel.nodeBytes + statistics.shapes.nodeBytes;
+            for (const BvhTreeStatistics& meshStatistics : statistics.meshes)
+                residentBytes += meshStatistics.nodeBytes;
+
+            size_t numHits = 0, numOccluded = 0;
+            const float bestClosest = timeClosestHits(bvh, rays, numHits);
+            const float bestOccluded = timeShadowRays(bvh, rays, numOccluded);
+            std::cout << "BVH nodes " << name << " (" << sceneName << ", " << numTriangles << " triangles): " << float(traversedBytes) / 1e6f << " MB traversed, "
+                      << float(residentBytes) / 1e6f << " MB resident, " << bestClosest
+                      << " ns per closest hit ray (" << numHits << " hits), " << bestOccluded << " ns per shadow ray" << std::endl;
+        }
+    }
+}
+
+void benchmarkSpatialSplits(const std::filesystem::path& dataDir)
+{
+    // Rotating the monkey by 45 degrees around two axes turns its mostly axis aligned quads into long diagonal triangles.
+    Scene rotatedMonkey = loadScene(Monkey, dataDir);
+    const glm::mat4 rotation = glm::rotate(glm::rotate(glm::mat4(1.0f), glm::radians(45.0f), glm::vec3(0, 1, 0)), glm::radians(45.0f), glm::vec3(1, 0, 0));
+    for (auto& mesh : rotatedMonkey.meshes) {
+        for (Vertex& vertex : mesh.vertices)
+            vertex.position = glm::vec3(rotation * glm::vec4(vertex.position, 1.0f));
+    }
+
+    const std::vector<Ray> rays = makeRayGrid(256);
+
+    std::vector<std::pair<Scene, const char*>> scenes;
+    scenes.emplace_back(loadScene(CornellBox, dataDir), "Cornell box");
+    scenes.emplace_back(std::move(rotatedMonkey), "rotated monkey");
+    scenes.emplace_back(loadScene(Teapot, dataDir), "teapot");
+    for (auto& [scene, name] : scenes) {
+        size_t numTriangles = 0;
+        for (const auto& mesh : scene.meshes)
+            numTriangles += mesh.triangles.size();
+
+        for (BvhBuilder builder : { BvhBuilder::BinnedSAH, BvhBuilder::SpatialSplitSAH }) {
+            BvhSettings settings {};
+            settings.builder = builder;
+            const auto buildStart = benchmark_clock::now();
+            const BoundingVolumeHierarchy bvh { &scene, settings };
+            const float buildMilliseconds = milliseconds(benchmark_clock::now() - buildStart);
+            size_t numReferences = 0;
+            for (const BoundingVolumeHierarchy::MeshBvh& meshBvh : bvh.meshBvhs)
+                numReferences += meshBvh.triangles.size();
+
+            size_t numHits = 0;
+            const float bestNanoseconds = timeClosestHits(bvh, rays, numHits);
+            std::cout << "BVH " << (builder == BvhBuilder::BinnedSAH ? "binned SAH" : "spatial splits") << " (" << name << "): build " << buildMilliseconds << " ms, "
+                      << numReferences << " references to " << numTriangles << " triangles, SAH cost " << bvh.sahCost() << ", " << bestNanoseconds << " ns per ray" << std::endl;
+        }
+    }
+}
+
+void benchmarkLinearBuild(const std::filesystem::path& dataDir)
+{
+    const std::vector<Ray> rays = makeRayGrid(256);
+
+    for (const auto& [sceneType, sceneName] : { std::pair { Cube, "cube" }, std::pair { CornellBox, "Cornell box" }, std::pair { Monkey, "monkey" }, std::pair { Teapot, "teapot" }, std::pair { InstancedTeapots, "instanced teapots" } }) {
+        Scene scene = loadScene(sceneType, dataDir);
+        for (BvhBuilder builder : { BvhBuilder::BinnedSAH, BvhBuilder::Linear }) {
+            BvhSettings settings {};
+            settings.builder = builder;
+            // Best of a few rebuilds, like in benchmarkBvhBuild but with all threads.
+            std::optional<BoundingVolumeHierarchy> bvh;
+            const float bestMilliseconds = milliseconds(bestOf(5, [&]() { bvh.emplace(&scene, settings); }));
+            size_t numHits = 0;
+            const float bestNanoseconds = timeClosestHits(*bvh, rays, numHits);
+            std::cout << "BVH rebuild " << (builder == BvhBuilder::BinnedSAH ? "binned SAH" : "linear") << " (" << sceneName << "): " << bestMilliseconds << " ms, SAH cost "
+                      << bvh->sahCost() << ", " << bestNanoseconds << " ns per ray" << std::endl;
+        }
+    }
+}
+
+void benchmarkTreeletOptimization(const std::filesystem::path& dataDir)
+{
+    const std::vector<Ray> rays = makeRayGrid(256);
+
+    Scene monkey = loadScene(Monkey, dataDir);
+    Scene teapot = loadScene(Teapot, dataDir);
+    Scene bumpySphere;
+    bumpySphere.meshes.push_back(makeBumpySphere(256, 512));
+    for (const auto& [pScene, sceneName] : { std::pair { &monkey, "monkey" }, std::pair { &teapot, "teapot" }, std::pair { &bumpySphere, "bumpy sphere" } }) {
+        for (BvhBuilder builder : { BvhBuilder::BinnedSAH, BvhBuilder::Linear }) {
+            for (bool optimize : { false, true }) {
+                // The binary layout, so that the visited nodes are comparable to the SAH cost.
+                BvhSettings settings {};
+                settings.builder = builder;
+                settings.layout = BvhLayout::Binary;
+                settings.optimizeTreelets = optimize;
+                std::optional<BoundingVolumeHierarchy> bvh;
+                const float bestMilliseconds = milliseconds(bestOf(3, [&]() { bvh.emplace(pScene, settings); }));
+                // All three runs are counted, which does not change the average per ray.
+                BoundingVolumeHierarchy::resetTraversalStatistics();
+                size_t numHits = 0;
+                const float bestNanoseconds = timeClosestHits(*bvh, rays, numHits);
+                const TraversalStatistics::Counters counters = BoundingVolumeHierarchy::traversalStatistics().rays[size_t(RayKind::Primary)];
+                std::cout << "BVH treelets " << (optimize ? "optimized" : "as built") << " (" << (builder == BvhBuilder::BinnedSAH ? "binned SAH" : "linear") << ", " << sceneName
+                          << "): build " << bestMilliseconds << " ms, SAH cost " << bvh->sahCost() << ", " << float(counters.nodesVisited) / float(counters.numRays)
+                          << " nodes visited per ray, " << bestNanoseconds << " ns per ray" << std::endl;
+            }
+        }
+    }
+}
+
+void benchmarkBvhRefit(const std::filesystem::path& dataDir)
+{
+    // Two animations of the teapot: a turntable (rigid rotation) and a twist around the vertical axis that increases every frame.
+    constexpr int numFrames = 24;
+    const auto turntable = [](const glm::vec3& position, int frame) {
+        const float angle = glm::radians(15.0f * float(frame));
+        return glm::vec3(std::cos(angle) * position.x + std::sin(angle) * position.z, position.y, -std::sin(angle) * position.x + std::cos(angle) * position.z);
+    };
+    const auto twist = [](const glm::vec3& position, int frame) {
+        const float angle = glm::radians(2.0f * float(frame)) * position.y * 4.0f;
+        return glm::vec3(std::cos(angle) * position.x + std::sin(angle) * position.z, position.y, -std::sin(angle) * position.x + std::cos(angle) * position.z);
+    };
+
+    // A grid of rays from in front of the teapot, traced after every update to include the cost of a degraded tree.
+    const std::vector<Ray> rays = makeRayGrid(128);
+
+    for (const auto& [name, animate] : { std::pair { "turntable", std::function<glm::vec3(const glm::vec3&, int)>(turntable) }, std::pair { "twist", std::function<glm::vec3(const glm::vec3&, int)>(twist) } }) {
+        // Rebuild every frame, refit every frame, or let update() pick.
+        for (int strategy = 0; strategy < 3; strategy++) {
+            Scene scene = loadScene(Teapot, dataDir);
+            const Scene original = scene;
+            BvhSettings settings {};
+            if (strategy == 1)
+                settings.rebuildCostRatio = std::numeric_limits<float>::infinity();
+            BoundingVolumeHierarchy bvh { &scene, settings };
+
+            benchmark_clock::duration updateTime {}, traceTime {};
+            int numRebuilds = 0;
+            float worstCostRatio = 1.0f;
+            for (int frame = 1; frame <= numFrames; frame++) {
+                for (size_t mesh = 0; mesh < scene.meshes.size(); mesh++) {
+                    for (size_t vertex = 0; vertex < scene.meshes[mesh].vertices.size(); vertex++)
+                        scene.meshes[mesh].vertices[vertex].position = animate(original.meshes[mesh].vertices[vertex].position, frame);
+                }
+
+                const auto updateStart = benchmark_clock::now();
+                if (strategy == 0) {
+                    bvh = BoundingVolumeHierarchy { &scene, settings };
+                    numRebuilds++;
+                } else {
+                    numRebuilds += bvh.update();
+                }
+                const auto traceStart = benchmark_clock::now();
+                for (Ray ray : rays) {
+                    HitInfo hitInfo;
+                    bvh.intersect(ray, hitInfo);
+                }
+                const auto traceEnd = benchmark_clock::now();
+                updateTime += traceStart - updateStart;
+                traceTime += traceEnd - traceStart;
+                worstCostRatio = std::max(worstCostRatio, bvh.sahCost() / BoundingVolumeHierarchy { &scene, settings }.sahCost());
+            }
+
+            constexpr std::array strategies { "rebuild", "refit", "update" };
+            std::cout << "BVH " << name << " (" << strategies[size_t(strategy)] << "): " << milliseconds(updateTime) / numFrames << " ms update + "
+                      << milliseconds(traceTime) / numFrames << " ms tracing per frame, " << numRebuilds << " rebuilds, worst SAH cost "
+                      << worstCostRatio << "x a fresh build" << std::endl;
+        }
+    }
+}
+
+void benchmarkShapes()
+{
+    const std::vector<Ray> rays = makeRayGrid(128);
+
+    for (size_t numShapes : { 16u, 256u, 4096u, 65536u }) {
+        // Random spheres and boxes in the unit cube, smaller as there are more of them so that they cover a similar area.
+        std::mt19937 rng { 1234 };
+        std::uniform_real_distribution<float> distribution { -1.0f, 1.0f };
+        const float size = 0.5f / std::cbrt(float(numShapes));
+        Scene scene;
+        const uint32_t materialId = addMaterial(scene, Material { glm::vec3(1.0f) });
+        for (size_t i = 0; i < numShapes; i++) {
+            const glm::vec3 center { distribution(rng), distribution(rng), distribution(rng) };
+            if (i % 4 == 0)
+                scene.boxes.push_back(Box { AxisAlignedBox { center - size, center + size }, materialId });
+            else
+                scene.spheres.push_back(Sphere { center, size, materialId });
+        }
+
+        // What intersect used to do: test every shape.
+        size_t numHits = 0;
+        const auto loopStart = benchmark_clock::now();
+        for (Ray ray : rays) {
+            HitInfo hitInfo;
+            bool hit = false;
+            for (const Sphere& sphere : scene.spheres)
+                hit |= intersectRayWithShape(sphere, ray, hitInfo);
+            for (const Box& box : scene.boxes)
+                hit |= intersectRayWithShape(box, ray, hitInfo);
+            numHits += hit;
+        }
+        const auto loopEnd = benchmark_clock::now();
+
+        const BoundingVolumeHierarchy bvh { &scene };
+        const auto built = benchmark_clock::now();
+        size_t numBvhHits = 0;
+        for (Ray ray : rays) {
+            HitInfo hitInfo;
+            numBvhHits += bvh.intersect(ray, hitInfo);
+        }
+        const auto traced = benchmark_clock::now();
+
+        std::cout << "BVH shapes (" << numShapes << " spheres and boxes): every shape " << nanosecondsPerRay(loopEnd - loopStart, rays.size())
+                  << " ns per ray (" << numHits << " hits), tree " << nanosecondsPerRay(traced - built, rays.size()) << " ns per ray ("
+                  << numBvhHits << " hits), build " << milliseconds(built - loopEnd) << " ms" << std::endl;
+    }
+}
+
+void benchmarkLightSelection()
+{
+    // Shading points with random normals around a cloud of point lights. Most of the power is in a few of the lights.
+    constexpr size_t numPoints = 4096;
+    constexpr size_t numPicks = 8;
+    std::mt19937 rng { 1234 };
+    std::uniform_real_distribution<float> distribution { -1.0f, 1.0f };
+    std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+    std::vector<std::pair<glm::vec3, glm::vec3>> shadingPoints;
+    for (size_t i = 0; i < numPoints; i++) {
+        const glm::vec3 normal { distribution(rng), distribution(rng), distribution(rng) };
+        shadingPoints.push_back({ 1.5f * glm::vec3(distribution(rng), distribution(rng), distribution(rng)), glm::normalize(normal) });
+    }
+
+    for (size_t numLights : { 16u, 256u, 4096u, 65536u }) {
+        std::vector<Light> lights;
+        for (size_t i = 0; i < numLights; i++) {
+            const float brightness = std::pow(unit(rng), 8.0f);
+            lights.push_back(PointLight { glm::vec3(distribution(rng), distribution(rng), distribution(rng)), brightness * glm::vec3(unit(rng), unit(rng), unit(rng)) });
+        }
+        // What a light adds at a point without shadows: its power times the cosine to the (two-sided) normal.
+        const auto contribution = [&](const std::pair<glm::vec3, glm::vec3>& shadingPoint, uint32_t lightIndex) {
+            const glm::vec3 toLight = glm::normalize(std::get<PointLight>(lights[lightIndex]).position - shadingPoint.first);
+            return lightPower(lights[lightIndex]) * std::abs(glm::dot(toLight, shadingPoint.second));
+        };
+
+        const auto start = benchmark_clock::now();
+        const LightBvh lightBvh { lights };
+        const auto built = benchmark_clock::now();
+
+        // The squared error of both estimates relative to the exact sum over all lights, with stratified numbers like shadeHit uses.
+        double bvhError = 0.0, uniformError = 0.0;
+        std::chrono::duration<float, std::nano> pickTime { 0.0f };
+        for (const auto& shadingPoint : shadingPoints) {
+            double exact = 0.0;
+            for (uint32_t lightIndex = 0; lightIndex < numLights; lightIndex++)
+                exact += double(contribution(shadingPoint, lightIndex));
+            const float rotation = unit(rng);
+            std::array<std::optional<LightBvh::Selection>, numPicks> selections;
+            const auto pickStart = benchmark_clock::now();
+            for (size_t pick = 0; pick < numPicks; pick++)
+                selections[pick] = lightBvh.sample(shadingPoint.first, shadingPoint.second, (float(pick) + rotation) / float(numPicks));
+            pickTime += benchmark_clock::now() - pickStart;
+            double bvhEstimate = 0.0, uniformEstimate = 0.0;
+            for (size_t pick = 0; pick < numPicks; pick++) {
+                if (selections[pick])
+                    bvhEstimate += double(contribution(shadingPoint, selections[pick]->lightIndex)) / (double(numPicks) * double(selections[pick]->probability));
+                const uint32_t uniformIndex = std::min(uint32_t((float(pick) + rotation) / float(numPicks) * float(numLights)), uint32_t(numLights - 1));
+                uniformEstimate += double(contribution(shadingPoint, uniformIndex)) * double(numLights) / double(numPicks);
+            }
+            bvhError += (bvhEstimate - exact) * (bvhEstimate - exact) / (exact * exact);
+            uniformError += (uniformEstimate - exact) * (uniformEstimate - exact) / (exact * exact);
+        }
+
+        std::cout << "Light selection (" << numLights << " point lights): build " << milliseconds(built - start) << " ms, "
+                  << pickTime.count() / float(numPoints * numPicks) << " ns per pick, relative RMS error of " << numPicks << " picks: light BVH "
+                  << std::sqrt(bvhError / numPoints) << ", uniform " << std::sqrt(uniformError / numPoints) << std::endl;
+    }
+}
+
+void benchmarkInstancing(const std::filesystem::path& dataDir)
+{
+    Scene scene = loadScene(InstancedTeapots, dataDir);
+    const auto start = benchmark_clock::now();
+    BoundingVolumeHierarchy bvh { &scene, BvhSettings {} };
+    const auto built = benchmark_clock::now();
+    bvh.rebuildTopLevel();
+    const auto rebuiltTopLevel = benchmark_clock::now();
+
+    // Bytes used by the tree of every mesh and by the triangle arrays that its leaves point into.
+    std::vector<size_t> meshBytes;
+    for (const BoundingVolumeHierarchy::MeshBvh& meshBvh : bvh.meshBvhs) {
+        meshBytes.push_back(meshBvh.nodes.size() * sizeof(BoundingVolumeHierarchy::Node)
+            + meshBvh.triangles.size() * (sizeof(glm::mat3) + sizeof(std::array<Vertex, 3>) + sizeof(int)));
+    }
+    size_t instancedBytes = bvh.nodes.size() * sizeof(BoundingVolumeHierarchy::Node) + bvh.instances.size() * sizeof(BoundingVolumeHierarchy::Instance);
+    size_t flattenedBytes = 0;
+    for (size_t bytes : meshBytes)
+        instancedBytes += bytes;
+    // Copying every instance into the scene would store the tree and the triangles once per instance.
+    for (const MeshInstance& instance : scene.instances)
+        flattenedBytes += meshBytes[instance.meshIndex];
+
+    // Rays from the camera position used by the other scenes, towards the grid.
+    const std::vector<Ray> rays = makeRayGrid(128);
+    size_t numHits = 0;
+    const auto traceStart = benchmark_clock::now();
+    for (Ray ray : rays) {
+        HitInfo hitInfo;
+        numHits += bvh.intersect(ray, hitInfo);
+    }
+    const auto traceEnd = benchmark_clock::now();
+
+    std::cout << "BVH instancing (" << scene.instances.size() << " instances): build " << milliseconds(built - start) << " ms, top level rebuild "
+              << milliseconds(rebuiltTopLevel - built) << " ms, " << float(instancedBytes) / 1e6f << " MB instead of " << float(flattenedBytes) / 1e6f
+              << " MB flattened, " << nanosecondsPerRay(traceEnd - traceStart, rays.size()) << " ns per ray (" << numHits << " hits)" << std::endl;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <filesystem>
+
+// Headless benchmarks, run with: FinalProject --benchmark
+// Results are printed to the console.
+void runBenchmarks(const std::filesystem::path& dataDir);
+
+// Measures how many ray/box tests per second the slab test and the original 12-triangle box test achieve.
+void benchmarkBoxTests();
+
+// Compares the speed of the original, precomputed and watertight triangle tests, and counts the rays that slip through
+// the edges of a closed mesh with each of them.
+void benchmarkTriangleTests(const std::filesystem::path& dataDir);
+
+// Checks that testing the triangles of a leaf in SIMD packets finds the same hits as the scalar test on every bundled
+// scene, and compares their speed for leaves of up to 4 and 8 triangles.
+void benchmarkLeafPackets(const std::filesystem::path& dataDir);
+
+// Measures the closest hit rays through the teapot with and without a texture, for several leaf sizes: the shading
+// attributes are only looked up for the final hit, so larger leaves and textures should barely add to the cost per ray.
+void benchmarkDeferredHits(const std::filesystem::path& dataDir);
+
+// Traces the camera rays of a 512x512 image and their shadow rays ray by ray and in packets of 2x2, 4x4 and 8x8 pixels:
+// checks that the packets find the same hits, and compares the speed and the visited nodes per ray.
+void benchmarkRayPackets(const std::filesystem::path& dataDir);
+
+// Measures how long building the BVH of the larger scenes takes with 1 up to the number of available threads.
+void benchmarkBvhBuild(const std::filesystem::path& dataDir);
+
+// Compares the ray tracing speed of the binary tree against the 4-wide and (if the CPU supports AVX2) 8-wide trees.
+void benchmarkBvhLayouts(const std::filesystem::path& dataDir);
+
+// Compares the wide layouts with and without quantized child boxes: node memory and tracing speed of random rays, on
+// the teapot and on a generated mesh whose tree does not fit in the L2 cache.
+void benchmarkCompressedNodes(const std::filesystem::path& dataDir);
+
+// Compares the binned SAH builder with and without spatial splits: build time, number of triangle references, SAH cost and tracing speed.
+void benchmarkSpatialSplits(const std::filesystem::path& dataDir);
+
+// Compares the rebuild time, SAH cost and tracing speed of the linear (Morton code) builder with the binned SAH builder on several scenes.
+void benchmarkLinearBuild(const std::filesystem::path& dataDir);
+
+// Compares the build time, SAH cost, visited nodes per ray and tracing speed with and without the treelet optimization pass.
+void benchmarkTreeletOptimization(const std::filesystem::path& dataDir);
+
+// Animates the teapot and compares rebuilding the BVH every frame against refitting it and against BoundingVolumeHierarchy::update.
+void benchmarkBvhRefit(const std::filesystem::path& dataDir);
+
+// Compares testing every sphere and box of a scene against traversing the tree over the shapes, for growing numbers of shapes.
+void benchmarkShapes();
+
+// Picks lights with the light BVH for growing numbers of lights: build time and cost per pick, and the error of the
+// estimated direct light at random shading points compared to picking the lights uniformly.
+void benchmarkLightSelection();
+
+// Builds the grid of instanced teapots and compares the memory of the two-level BVH against copying every teapot into the scene.
+void benchmarkInstancing(const std::filesystem::path& dataDir);
@@ -1,5 +1,8 @@
 #include "bounding_volume_hierarchy.h"
+#include "bvh_cache.h"
 #include "draw.h"
+#include "treelet_optimization.h"
+#include "wide_bvh.h"
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/mat4x4.hpp>
@@ -7,8 +10,14 @@
 #include <glm/vec4.hpp>
 #include <imgui.h>
 #include <nfd.h>
+#include <tbb/blocked_range.h>
 #include <tbb/blocked_range2d.h>
 #include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_scan.h>
+#include <algorithm>
+#include <bit>
 #include <chrono>
 #include <cstdlib>
 #include <filesystem>
@@ -19,6 +28,9 @@
 #include <framework/window.h>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <random>
 #include <string>
@@ -93,13 +105,16 @@ std::pair<std::vector<glm::vec3>, std::vector<std::vector<std::pair<glm::mat3, i
         triangles.push_back(tri.first);
     }
 
-    if(axis % 3 == 0) std::sort(triangles.begin(), triangles.end(), compareTrianglesX);
-    else if(axis % 3 == 1) std::sort(triangles.begin(), triangles.end(), compareTrianglesY);
-    else std::sort(triangles.begin(), triangles.end(), compareTrianglesZ);
-    glm::mat3 medianTriangle = triangles[triangles.size() / 2];
+    //Only the median is needed, so a selection (linear time) is enough instead of a full sort.
+    const auto median = triangles.begin() + std::ptrdiff_t(triangles.size() / 2);
+    if(axis % 3 == 0) std::nth_element(triangles.begin(), median, triangles.end(), compareTrianglesX);
+    else if(axis % 3 == 1) std::nth_element(triangles.begin(), median, triangles.end(), compareTrianglesY);
+    else std::nth_element(triangles.begin(), median, triangles.end(), compareTrianglesZ);
+    glm::mat3 medianTriangle = *median;
 
     glm::vec3 splittingVertex;
     std::vector<std::pair<glm::mat3, int>> firstAABBTrianglesAndIndices;
+    std::vector<std::pair<glm::mat3, int>> secondAABBTrianglesAndIndices; //Every triangle that does not go to the first AABB
     if(axis % 3 == 0) {
         if(medianTriangle[0].x > medianTriangle[1].x && medianTriangle[0].x > medianTriangle[2].x) {
             splittingVertex = medianTriangle[0];
@@ -113,6 +128,7 @@ std::pair<std::vector<glm::vec3>, std::vector<std::vector<std::pair<glm::mat3, i
             glm::vec3 v2 = triangleAndIndex.first[2];
 
             if(v0.x <= splittingVertex.x && v1.x <= splittingVertex.x && v2.x <= splittingVertex.x) firstAABBTrianglesAndIndices.push_back(triangleAndIndex);
+            else secondAABBTrianglesAndIndices.push_back(triangleAndIndex);
         }
     }
     else if(axis % 3 == 1) {
@@ -128,6 +144,7 @@ std::pair<std::vector<glm::vec3>, std::vector<std::vector<std::pair<glm::mat3, i
             glm::vec3 v2 = triangleAndIndex.first[2];
 
             if(v0.y >= splittingVertex.y && v1.y >= splittingVertex.y && v2.y >= splittingVertex.y) firstAABBTrianglesAndIndices.push_back(triangleAndIndex);
+            else secondAABBTrianglesAndIndices.push_back(triangleAndIndex);
         }
     } else {
         if(medianTriangle[0].z < medianTriangle[1].z && medianTriangle[0].z < medianTriangle[2].z) {
@@ -142,148 +159,1038 @@ std::pair<std::vector<glm::vec3>, std::vector<std::vector<std::pair<glm::mat3, i
             glm::vec3 v2 = triangleAndIndex.first[2];
 
             if(v0.z >= splittingVertex.z && v1.z >= splittingVertex.z && v2.z >= splittingVertex.z) firstAABBTrianglesAndIndices.push_back(triangleAndIndex);
+            else secondAABBTrianglesAndIndices.push_back(triangleAndIndex);
         }
     }
 
-    //Calculating triangles of the second AABB. This is done by subtracting the triangles in the first AABB from the total triangles.
-    std::vector<int> indiceListCurrentAABB; //Triangle indices of the current AABB (before splitting)
-    std::vector<int> indiceListFirstAABB; //Triangle indices of the first child AABB
-    for(std::pair<glm::mat3, int> triangleAndIndex : trianglesAndIndices) {
-        indiceListCurrentAABB.push_back(triangleAndIndex.second);
+    //Calculating the bounding boxes for the AABB
+    std::pair<glm::vec3, glm::vec3> leftAABB = calculateLowerUpper(firstAABBTrianglesAndIndices);
+    std::pair<glm::vec3, glm::vec3> rightAABB = calculateLowerUpper(secondAABBTrianglesAndIndices);
+
+    return std::pair(std::vector{leftAABB.first, leftAABB.second, rightAABB.first, rightAABB.second}, std::vector{firstAABBTrianglesAndIndices, secondAABBTrianglesAndIndices});
+}
+
+// Subtrees with at least this many triangles build their two children as parallel tasks. Smaller subtrees are
+// built serially, because the overhead of a task would outweigh the work.
+static constexpr size_t ParallelBuildThreshold = 4096;
+
+// Appends a subtree that was built into its own node vector. Inner node offsets in the subtree are relative to the
+// subtree, and leaf offsets are relative to triangleOffset.
+static void appendSubtree(std::vector<BoundingVolumeHierarchy::Node>& nodes, const std::vector<BoundingVolumeHierarchy::Node>& subtree, uint32_t triangleOffset) {
+    const uint32_t nodeOffset = uint32_t(nodes.size());
+    for(BoundingVolumeHierarchy::Node node : subtree) {
+        if(node.isLeaf()) node.offset += triangleOffset;
+        else node.offset += nodeOffset;
+        nodes.push_back(node);
     }
-    for(std::pair<glm::mat3, int> triangleAndIndex : firstAABBTrianglesAndIndices) {
-        indiceListFirstAABB.push_back(triangleAndIndex.second);
+}
+
+// Recursively builds the subtree over trianglesAndIndices. The node is appended before its children (see BoundingVolumeHierarchy::Node)
+// and the triangle indices of every leaf are appended to triangleOrder, so each leaf references one contiguous range.
+void fillNodeVector(int maxDepth, int currentLevel, glm::vec3 lower, glm::vec3 upper, std::vector<BoundingVolumeHierarchy::Node>& nodes, std::vector<std::pair<glm::mat3, int>> trianglesAndIndices, int axis, size_t maxLeafSize, int& deepestLevel, std::vector<int>& triangleOrder) {
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back(BoundingVolumeHierarchy::Node { lower, 0, upper, BoundingVolumeHierarchy::Node::InnerNode });
+    deepestLevel = std::max(deepestLevel, currentLevel);
+
+    const auto makeLeaf = [&]() {
+        nodes[nodeIndex].offset = uint32_t(triangleOrder.size());
+        nodes[nodeIndex].count = uint32_t(trianglesAndIndices.size());
+        for(std::pair<glm::mat3, int> pair : trianglesAndIndices) {
+            triangleOrder.push_back(pair.second);
+        }
+    };
+
+    if(currentLevel == maxDepth || trianglesAndIndices.size() <= std::max<size_t>(maxLeafSize, 1)) { //Base case -> leaf nodes.
+        makeLeaf();
+        return;
     }
 
-    std::vector<int> indiceListSecondAABB;
-    std::set_difference(indiceListCurrentAABB.begin(), indiceListCurrentAABB.end(), indiceListFirstAABB.begin(), indiceListFirstAABB.end(), std::inserter(indiceListSecondAABB, indiceListSecondAABB.begin()));
+    //Splitting criterion is in the assignment description. Axis is an integer -> if 0 we split along the x-axis, if 1 along the y-axis and if 2 along the z-axis.
+    std::pair<std::vector<glm::vec3>, std::vector<std::vector<std::pair<glm::mat3, int>>>> data = doSplitting(trianglesAndIndices, axis);
+    if(data.second[0].empty() || data.second[1].empty()) { //All triangles on one side (e.g. coplanar on the axis), splitting would only add an empty leaf with an empty box.
+        makeLeaf();
+        return;
+    }
 
-    std::vector<std::pair<glm::mat3, int>> secondAABBTrianglesAndIndices;
-    for(std::pair<glm::mat3, int> triangleAndIndex : trianglesAndIndices) {
-        for(int index : indiceListSecondAABB) {
-            if(triangleAndIndex.second == index) {
-                secondAABBTrianglesAndIndices.push_back(triangleAndIndex);
-                break;
-            }
+    glm::vec3 aabb1Lower = data.first[0];
+    glm::vec3 aabb1Upper = data.first[1];
+    glm::vec3 aabb2Lower = data.first[2];
+    glm::vec3 aabb2Upper = data.first[3];
+    std::vector<std::pair<glm::mat3, int>>& firstAABBTriangles = data.second[0];
+    std::vector<std::pair<glm::mat3, int>>& secondAABBTriangles = data.second[1];
+
+    if(trianglesAndIndices.size() < ParallelBuildThreshold) {
+        //Recursively make left child nodes, the first child directly follows its parent
+        fillNodeVector(maxDepth, currentLevel+1, aabb1Lower, aabb1Upper, nodes, std::move(firstAABBTriangles), axis+1, maxLeafSize, deepestLevel, triangleOrder);
+
+        //Recursively make right child nodes
+        nodes[nodeIndex].offset = uint32_t(nodes.size());
+        fillNodeVector(maxDepth, currentLevel+1, aabb2Lower, aabb2Upper, nodes, std::move(secondAABBTriangles), axis+1, maxLeafSize, deepestLevel, triangleOrder);
+        return;
+    }
+
+    //Build both children at the same time, each into its own vectors, and append them afterwards.
+    std::vector<BoundingVolumeHierarchy::Node> firstNodes, secondNodes;
+    std::vector<int> firstOrder, secondOrder;
+    int firstDeepest = 0, secondDeepest = 0;
+    tbb::parallel_invoke(
+        [&]() { fillNodeVector(maxDepth, currentLevel+1, aabb1Lower, aabb1Upper, firstNodes, std::move(firstAABBTriangles), axis+1, maxLeafSize, firstDeepest, firstOrder); },
+        [&]() { fillNodeVector(maxDepth, currentLevel+1, aabb2Lower, aabb2Upper, secondNodes, std::move(secondAABBTriangles), axis+1, maxLeafSize, secondDeepest, secondOrder); });
+
+    appendSubtree(nodes, firstNodes, uint32_t(triangleOrder.size()));
+    triangleOrder.insert(triangleOrder.end(), firstOrder.begin(), firstOrder.end());
+    nodes[nodeIndex].offset = uint32_t(nodes.size());
+    appendSubtree(nodes, secondNodes, uint32_t(triangleOrder.size()));
+    triangleOrder.insert(triangleOrder.end(), secondOrder.begin(), secondOrder.end());
+    deepestLevel = std::max({ deepestLevel, firstDeepest, secondDeepest });
+}
+
+// A triangle as seen by the SAH builders: its bounding box, the centroid of that box and its index in the triangle list of the mesh.
+// For spatial splits the box only covers the part of the triangle that lies inside the node.
+struct BuildPrimitive {
+    glm::vec3 lower;
+    glm::vec3 upper;
+    glm::vec3 centroid;
+    int index;
+};
+
+struct SahBin {
+    glm::vec3 lower { std::numeric_limits<float>::infinity() };
+    glm::vec3 upper { -std::numeric_limits<float>::infinity() };
+    int count = 0;
+};
+
+static void growBox(glm::vec3& lower, glm::vec3& upper, const glm::vec3& otherLower, const glm::vec3& otherUpper) {
+    lower = glm::min(lower, otherLower);
+    upper = glm::max(upper, otherUpper);
+}
+
+static int binOfCentroid(const glm::vec3& centroid, int axis, float centroidLower, float binsPerUnit, int numBins) {
+    int bin = int((centroid[axis] - centroidLower) * binsPerUnit);
+    return std::clamp(bin, 0, numBins - 1);
+}
+
+// Bounds of a range of primitives and of their centroids.
+struct BuildBounds {
+    glm::vec3 lower { std::numeric_limits<float>::infinity() };
+    glm::vec3 upper { -std::numeric_limits<float>::infinity() };
+    glm::vec3 centroidLower { std::numeric_limits<float>::infinity() };
+    glm::vec3 centroidUpper { -std::numeric_limits<float>::infinity() };
+};
+
+static BuildBounds computeBounds(const std::vector<BuildPrimitive>& primitives, size_t begin, size_t end) {
+    const auto growRange = [&](const tbb::blocked_range<size_t>& range, BuildBounds bounds) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            growBox(bounds.lower, bounds.upper, primitives[i].lower, primitives[i].upper);
+            growBox(bounds.centroidLower, bounds.centroidUpper, primitives[i].centroid, primitives[i].centroid);
         }
+        return bounds;
+    };
+    if(end - begin < ParallelBuildThreshold) return growRange(tbb::blocked_range<size_t>(begin, end), BuildBounds {});
+
+    return tbb::parallel_reduce(tbb::blocked_range<size_t>(begin, end), BuildBounds {}, growRange, [](BuildBounds a, const BuildBounds& b) {
+        growBox(a.lower, a.upper, b.lower, b.upper);
+        growBox(a.centroidLower, a.centroidUpper, b.centroidLower, b.centroidUpper);
+        return a;
+    });
+}
+
+// Sorts the primitives into bins along the axis. The bins must be empty when this is called.
+static void fillBins(const std::vector<BuildPrimitive>& primitives, size_t begin, size_t end, int axis, float centroidLower, float binsPerUnit, std::vector<SahBin>& bins) {
+    const int numBins = int(bins.size());
+    const auto fillRange = [&](const tbb::blocked_range<size_t>& range, std::vector<SahBin> localBins) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            SahBin& bin = localBins[size_t(binOfCentroid(primitives[i].centroid, axis, centroidLower, binsPerUnit, numBins))];
+            growBox(bin.lower, bin.upper, primitives[i].lower, primitives[i].upper);
+            bin.count++;
+        }
+        return localBins;
+    };
+    if(end - begin < ParallelBuildThreshold) {
+        bins = fillRange(tbb::blocked_range<size_t>(begin, end), std::move(bins));
+        return;
     }
 
-    //Calculating the bounding boxes for the AABB
-    std::pair<glm::vec3, glm::vec3> leftAABB = calculateLowerUpper(firstAABBTrianglesAndIndices);
-    std::pair<glm::vec3, glm::vec3> rightAABB = calculateLowerUpper(secondAABBTrianglesAndIndices);
+    bins = tbb::parallel_reduce(tbb::blocked_range<size_t>(begin, end), std::move(bins), fillRange, [](std::vector<SahBin> a, const std::vector<SahBin>& b) {
+        for(size_t i = 0; i < a.size(); i++) {
+            growBox(a[i].lower, a[i].upper, b[i].lower, b[i].upper);
+            a[i].count += b[i].count;
+        }
+        return a;
+    });
+}
 
-    return std::pair(std::vector{leftAABB.first, leftAABB.second, rightAABB.first, rightAABB.second}, std::vector{firstAABBTrianglesAndIndices, secondAABBTrianglesAndIndices});
+// Moves the primitives for which goesLeft is true to the front of [begin, end) and returns where the others start.
+// Large ranges are partitioned in parallel: every primitive gets its new position from a prefix sum over the flags.
+template <typename Predicate>
+static size_t partitionPrimitives(std::vector<BuildPrimitive>& primitives, size_t begin, size_t end, const Predicate& goesLeft) {
+    if(end - begin < ParallelBuildThreshold) {
+        auto middle = std::partition(primitives.begin() + std::ptrdiff_t(begin), primitives.begin() + std::ptrdiff_t(end), goesLeft);
+        return size_t(middle - primitives.begin());
+    }
+
+    const std::vector<BuildPrimitive> source(primitives.begin() + std::ptrdiff_t(begin), primitives.begin() + std::ptrdiff_t(end));
+    std::vector<uint8_t> isLeft(source.size());
+    std::vector<size_t> leftPosition(source.size()); //Number of primitives going left before this one
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, source.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) isLeft[i] = goesLeft(source[i]) ? 1 : 0;
+    });
+    const size_t numLeft = tbb::parallel_scan(tbb::blocked_range<size_t>(0, source.size()), size_t(0),
+        [&](const tbb::blocked_range<size_t>& range, size_t sum, bool isFinalScan) {
+            for(size_t i = range.begin(); i < range.end(); i++) {
+                if(isFinalScan) leftPosition[i] = sum;
+                sum += isLeft[i];
+            }
+            return sum;
+        },
+        std::plus<size_t>());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, source.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            const size_t position = isLeft[i] ? leftPosition[i] : numLeft + (i - leftPosition[i]);
+            primitives[begin + position] = source[i];
+        }
+    });
+    return begin + numLeft;
+}
+
+// Cheapest split of a range of primitives into the primitives whose centroid lies in the bins below bin and the others,
+// according to the binned surface area heuristic. axis is -1 if no split was evaluated.
+struct ObjectSplit {
+    int axis = -1;
+    int bin = 0;
+    float cost = std::numeric_limits<float>::infinity();
+    SahBin left, right; //Boxes and primitive counts of the two children
+};
+
+static ObjectSplit findObjectSplit(const BvhSettings& settings, const std::vector<BuildPrimitive>& primitives, size_t begin, size_t end, const BuildBounds& bounds) {
+    ObjectSplit best;
+    const float parentArea = surfaceArea(bounds.lower, bounds.upper);
+    const int numBins = std::max(settings.numBins, 2);
+    const size_t binCount = size_t(numBins);
+    std::vector<SahBin> bins(binCount);
+    std::vector<SahBin> rightBins(binCount);
+    for(int axis = 0; axis < 3; axis++) {
+        const float extent = bounds.centroidUpper[axis] - bounds.centroidLower[axis];
+        if(extent <= 0.0f) continue; //All centroids lie in one plane, so this axis cannot separate them.
+
+        std::fill(bins.begin(), bins.end(), SahBin {});
+        const float binsPerUnit = float(numBins) / extent;
+        fillBins(primitives, begin, end, axis, bounds.centroidLower[axis], binsPerUnit, bins);
+
+        //Sweep from the right to get the box and triangle count on the right of every split plane...
+        SahBin right;
+        for(int b = numBins - 1; b > 0; b--) {
+            growBox(right.lower, right.upper, bins[size_t(b)].lower, bins[size_t(b)].upper);
+            right.count += bins[size_t(b)].count;
+            rightBins[size_t(b)] = right;
+        }
+        //...and then from the left to evaluate the cost of splitting between bin b-1 and bin b.
+        SahBin left;
+        for(int b = 1; b < numBins; b++) {
+            growBox(left.lower, left.upper, bins[size_t(b - 1)].lower, bins[size_t(b - 1)].upper);
+            left.count += bins[size_t(b - 1)].count;
+            const SahBin& rightOfSplit = rightBins[size_t(b)];
+            if(left.count == 0 || rightOfSplit.count == 0) continue;
+
+            float cost = settings.traversalCost + settings.intersectionCost * (surfaceArea(left.lower, left.upper) * float(left.count) + surfaceArea(rightOfSplit.lower, rightOfSplit.upper) * float(rightOfSplit.count)) / parentArea;
+            if(cost < best.cost) {
+                best = ObjectSplit { axis, b, cost, left, rightOfSplit };
+            }
+        }
+    }
+    return best;
 }
 
-void fillNodeVector(int maxDepth, int currentLevel, glm::vec3 lower, glm::vec3 upper, std::vector<BoundingVolumeHierarchy::Node>& nodes, std::vector<std::pair<glm::mat3, int>> trianglesAndIndices, int axis) {
+// Recursively builds the subtree over primitives[begin, end) and appends it to nodes in the same order as fillNodeVector.
+// The primitives are partitioned in place, so a leaf simply references its range of the (reordered) primitive array.
+// Large subtrees bin, partition and build their children in parallel; the resulting tree does not depend on the number of threads.
+static void fillNodeVectorSAH(const BvhSettings& settings, int currentLevel, std::vector<BoundingVolumeHierarchy::Node>& nodes, std::vector<BuildPrimitive>& primitives, size_t begin, size_t end, int& deepestLevel) {
+    const BuildBounds bounds = computeBounds(primitives, begin, end);
     BoundingVolumeHierarchy::Node node;
-    node.lower = lower;
-    node.upper = upper;
+    node.lower = bounds.lower;
+    node.upper = bounds.upper;
+    node.count = BoundingVolumeHierarchy::Node::InnerNode;
+    const glm::vec3& centroidLower = bounds.centroidLower;
+    const glm::vec3& centroidUpper = bounds.centroidUpper;
+    deepestLevel = std::max(deepestLevel, currentLevel);
+
+    const size_t count = end - begin;
+    const float leafCost = settings.intersectionCost * float(count);
+    const float parentArea = surfaceArea(node.lower, node.upper);
+
+    //Evaluate the SAH cost at every bin boundary of every axis and remember the cheapest split.
+    ObjectSplit split;
+    const int numBins = std::max(settings.numBins, 2);
+    if(count > size_t(std::max(settings.maxLeafSize, 1)) && currentLevel < settings.maxLevels - 1 && parentArea > 0.0f) {
+        split = findObjectSplit(settings, primitives, begin, end, bounds);
+    }
+    const int bestAxis = split.axis;
+    const int bestBin = split.bin;
+    const float bestCost = split.cost;
+
+    if(bestAxis == -1 || bestCost >= leafCost) { //Base case -> leaf nodes. Splitting would not make traversal any cheaper.
+        node.offset = uint32_t(begin);
+        node.count = uint32_t(count);
+        nodes.push_back(node);
+        return;
+    }
 
-    if(currentLevel == maxDepth || trianglesAndIndices.size() <= 1) { //Base case -> leaf nodes.
-        node.isLeaf = true;
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back(node);
+    const float binsPerUnit = float(numBins) / (centroidUpper[bestAxis] - centroidLower[bestAxis]);
+    const size_t middle = partitionPrimitives(primitives, begin, end, [&](const BuildPrimitive& primitive) {
+        return binOfCentroid(primitive.centroid, bestAxis, centroidLower[bestAxis], binsPerUnit, numBins) < bestBin;
+    });
+
+    if(count < ParallelBuildThreshold) {
+        //Recursively make left child nodes, the first child directly follows its parent
+        fillNodeVectorSAH(settings, currentLevel+1, nodes, primitives, begin, middle, deepestLevel);
+
+        //Recursively make right child nodes
+        nodes[nodeIndex].offset = uint32_t(nodes.size());
+        fillNodeVectorSAH(settings, currentLevel+1, nodes, primitives, middle, end, deepestLevel);
+        return;
+    }
 
-        std::vector<int> theList;
-        for(std::pair<glm::mat3, int> pair : trianglesAndIndices) {
-            theList.push_back(pair.second);
+    //The children work on disjoint ranges of primitives, so they can be built at the same time into their own node vectors.
+    std::vector<BoundingVolumeHierarchy::Node> firstNodes, secondNodes;
+    int firstDeepest = 0, secondDeepest = 0;
+    tbb::parallel_invoke(
+        [&]() { fillNodeVectorSAH(settings, currentLevel+1, firstNodes, primitives, begin, middle, firstDeepest); },
+        [&]() { fillNodeVectorSAH(settings, currentLevel+1, secondNodes, primitives, middle, end, secondDeepest); });
+
+    appendSubtree(nodes, firstNodes, 0); //Leaves already reference absolute primitive ranges
+    nodes[nodeIndex].offset = uint32_t(nodes.size());
+    appendSubtree(nodes, secondNodes, 0);
+    deepestLevel = std::max({ deepestLevel, firstDeepest, secondDeepest });
+}
+
+// Spatial splits are only evaluated where the children of the best object split overlap by more than this fraction of the
+// surface area of the root. Elsewhere object splits are good enough and the extra binning would only slow the build down.
+static constexpr float SpatialSplitOverlapThreshold = 1e-5f;
+
+// Box around the part of the triangle that lies between slabLower and slabUpper along the axis.
+static AxisAlignedBox clippedTriangleBox(const glm::mat3& triangle, int axis, float slabLower, float slabUpper) {
+    AxisAlignedBox box { glm::vec3(std::numeric_limits<float>::infinity()), glm::vec3(-std::numeric_limits<float>::infinity()) };
+    for(int i = 0; i < 3; i++) {
+        const glm::vec3& a = triangle[i];
+        const glm::vec3& b = triangle[(i + 1) % 3];
+        if(a[axis] >= slabLower && a[axis] <= slabUpper) growBox(box.lower, box.upper, a, a);
+        //Add the points where the edge crosses the planes of the slab.
+        for(float plane : { slabLower, slabUpper }) {
+            if((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                const glm::vec3 crossing = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+                growBox(box.lower, box.upper, crossing, crossing);
+            }
         }
-        node.indices = theList;
+    }
+    //The interpolated crossings can end up a tiny bit outside of the slab.
+    box.lower[axis] = std::max(box.lower[axis], slabLower);
+    box.upper[axis] = std::min(box.upper[axis], slabUpper);
+    return box;
+}
 
+// The part of a triangle reference that lies between slabLower and slabUpper. The box of the reference already is the
+// part of the triangle that lies in the nodes above it, so the result is clipped to that box as well.
+static BuildPrimitive clipReference(const BuildPrimitive& reference, const glm::mat3& triangle, int axis, float slabLower, float slabUpper) {
+    const AxisAlignedBox box = clippedTriangleBox(triangle, axis, slabLower, slabUpper);
+    const glm::vec3 lower = glm::max(box.lower, reference.lower);
+    const glm::vec3 upper = glm::min(box.upper, reference.upper);
+    return BuildPrimitive { lower, upper, 0.5f * (lower + upper), reference.index };
+}
+
+static bool isEmptyBox(const glm::vec3& lower, const glm::vec3& upper) {
+    return lower.x > upper.x || lower.y > upper.y || lower.z > upper.z;
+}
+
+// Cheapest spatial split: a plane at a bin boundary, where the references that cross the plane are clipped and go to
+// both children. left.count and right.count include these duplicated references.
+struct SpatialSplit {
+    int axis = -1;
+    int bin = 0;
+    float binsPerUnit = 0.0f;
+    float cost = std::numeric_limits<float>::infinity();
+    SahBin left, right;
+};
+
+static SpatialSplit findSpatialSplit(const BvhSettings& settings, const std::vector<glm::mat3>& triangles, const std::vector<BuildPrimitive>& references, const BuildBounds& bounds) {
+    //Bins are spread over the box of the node instead of over the centroids. Every reference is counted once where it
+    //enters (in the bin of its lower coordinate) and once where it exits, and it grows every bin it overlaps by the part
+    //of the triangle inside that bin.
+    struct SpatialBin {
+        glm::vec3 lower { std::numeric_limits<float>::infinity() };
+        glm::vec3 upper { -std::numeric_limits<float>::infinity() };
+        int entries = 0;
+        int exits = 0;
+    };
+
+    SpatialSplit best;
+    const float parentArea = surfaceArea(bounds.lower, bounds.upper);
+    const int numBins = std::max(settings.numBins, 2);
+    const size_t binCount = size_t(numBins);
+    std::vector<SpatialBin> bins(binCount);
+    std::vector<SahBin> rightBins(binCount);
+    for(int axis = 0; axis < 3; axis++) {
+        const float extent = bounds.upper[axis] - bounds.lower[axis];
+        if(extent <= 0.0f) continue;
+
+        std::fill(bins.begin(), bins.end(), SpatialBin {});
+        const float binsPerUnit = float(numBins) / extent;
+        for(const BuildPrimitive& reference : references) {
+            const int firstBin = binOfCentroid(reference.lower, axis, bounds.lower[axis], binsPerUnit, numBins);
+            const int lastBin = std::max(firstBin, binOfCentroid(reference.upper, axis, bounds.lower[axis], binsPerUnit, numBins));
+            if(firstBin == lastBin) {
+                growBox(bins[size_t(firstBin)].lower, bins[size_t(firstBin)].upper, reference.lower, reference.upper); //Nothing to clip
+            } else for(int b = firstBin; b <= lastBin; b++) {
+                const float slabLower = bounds.lower[axis] + float(b) / binsPerUnit;
+                const float slabUpper = b == numBins - 1 ? bounds.upper[axis] : bounds.lower[axis] + float(b + 1) / binsPerUnit;
+                const BuildPrimitive clipped = clipReference(reference, triangles[size_t(reference.index)], axis, slabLower, slabUpper);
+                if(!isEmptyBox(clipped.lower, clipped.upper)) growBox(bins[size_t(b)].lower, bins[size_t(b)].upper, clipped.lower, clipped.upper);
+            }
+            bins[size_t(firstBin)].entries++;
+            bins[size_t(lastBin)].exits++;
+        }
+
+        //The same two sweeps as for object splits: the right side counts the exits, the left side the entries.
+        SahBin right;
+        for(int b = numBins - 1; b > 0; b--) {
+            growBox(right.lower, right.upper, bins[size_t(b)].lower, bins[size_t(b)].upper);
+            right.count += bins[size_t(b)].exits;
+            rightBins[size_t(b)] = right;
+        }
+        SahBin left;
+        for(int b = 1; b < numBins; b++) {
+            growBox(left.lower, left.upper, bins[size_t(b - 1)].lower, bins[size_t(b - 1)].upper);
+            left.count += bins[size_t(b - 1)].entries;
+            const SahBin& rightOfSplit = rightBins[size_t(b)];
+            if(left.count == 0 || rightOfSplit.count == 0) continue;
+
+            float cost = settings.traversalCost + settings.intersectionCost * (surfaceArea(left.lower, left.upper) * float(left.count) + surfaceArea(rightOfSplit.lower, rightOfSplit.upper) * float(rightOfSplit.count)) / parentArea;
+            if(cost < best.cost) {
+                best = SpatialSplit { axis, b, binsPerUnit, cost, left, rightOfSplit };
+            }
+        }
+    }
+    return best;
+}
+
+// Recursively builds the subtree over a list of triangle references like fillNodeVectorSAH, but also considers spatial
+// splits (split BVH, Stich et al. 2009): a triangle that crosses the split plane is clipped and referenced from both
+// children, so that long or diagonal triangles no longer make the boxes of siblings overlap. Every leaf appends its
+// references to referenceOrder, in which a triangle can therefore appear more than once. At most duplicationBudget
+// extra references are created in the subtree.
+static void fillNodeVectorSBVH(const BvhSettings& settings, const std::vector<glm::mat3>& triangles, float rootArea, int currentLevel, std::vector<BoundingVolumeHierarchy::Node>& nodes,
+    std::vector<BuildPrimitive> references, size_t duplicationBudget, int& deepestLevel, std::vector<int>& referenceOrder) {
+    const BuildBounds bounds = computeBounds(references, 0, references.size());
+    BoundingVolumeHierarchy::Node node { bounds.lower, 0, bounds.upper, BoundingVolumeHierarchy::Node::InnerNode };
+    deepestLevel = std::max(deepestLevel, currentLevel);
+
+    const size_t count = references.size();
+    const float leafCost = settings.intersectionCost * float(count);
+    const float parentArea = surfaceArea(node.lower, node.upper);
+
+    ObjectSplit objectSplit;
+    SpatialSplit spatialSplit;
+    if(count > size_t(std::max(settings.maxLeafSize, 1)) && currentLevel < settings.maxLevels - 1 && parentArea > 0.0f) {
+        objectSplit = findObjectSplit(settings, references, 0, count, bounds);
+        const glm::vec3 overlapLower = glm::max(objectSplit.left.lower, objectSplit.right.lower);
+        const glm::vec3 overlapUpper = glm::min(objectSplit.left.upper, objectSplit.right.upper);
+        const float overlap = objectSplit.axis == -1 ? parentArea : isEmptyBox(overlapLower, overlapUpper) ? 0.0f : surfaceArea(overlapLower, overlapUpper);
+        if(duplicationBudget > 0 && overlap > SpatialSplitOverlapThreshold * rootArea) spatialSplit = findSpatialSplit(settings, triangles, references, bounds);
+    }
+    const size_t spatialDuplicates = spatialSplit.axis == -1 ? 0 : size_t(spatialSplit.left.count + spatialSplit.right.count) - count;
+    const bool useSpatialSplit = spatialSplit.cost < std::min(objectSplit.cost, leafCost) && spatialDuplicates <= duplicationBudget;
+
+    std::vector<BuildPrimitive> firstReferences, secondReferences;
+    if(useSpatialSplit) {
+        const int axis = spatialSplit.axis;
+        const float plane = bounds.lower[axis] + float(spatialSplit.bin) / spatialSplit.binsPerUnit;
+        const int numBins = std::max(settings.numBins, 2);
+        for(const BuildPrimitive& reference : references) {
+            //Use the same bins as findSpatialSplit, so that the counts match the evaluated cost.
+            const int firstBin = binOfCentroid(reference.lower, axis, bounds.lower[axis], spatialSplit.binsPerUnit, numBins);
+            const int lastBin = std::max(firstBin, binOfCentroid(reference.upper, axis, bounds.lower[axis], spatialSplit.binsPerUnit, numBins));
+            if(lastBin < spatialSplit.bin) {
+                firstReferences.push_back(reference);
+            } else if(firstBin >= spatialSplit.bin) {
+                secondReferences.push_back(reference);
+            } else {
+                const BuildPrimitive first = clipReference(reference, triangles[size_t(reference.index)], axis, reference.lower[axis], plane);
+                const BuildPrimitive second = clipReference(reference, triangles[size_t(reference.index)], axis, plane, reference.upper[axis]);
+                //Rounding can leave nothing on one side, then the triangle only goes to the other one.
+                const bool firstEmpty = isEmptyBox(first.lower, first.upper);
+                const bool secondEmpty = isEmptyBox(second.lower, second.upper);
+                if(!firstEmpty) firstReferences.push_back(first);
+                if(!secondEmpty) secondReferences.push_back(second);
+                if(firstEmpty && secondEmpty) firstReferences.push_back(reference);
+            }
+        }
+    } else if(objectSplit.axis != -1 && objectSplit.cost < leafCost) {
+        const int axis = objectSplit.axis;
+        const int numBins = std::max(settings.numBins, 2);
+        const float binsPerUnit = float(numBins) / (bounds.centroidUpper[axis] - bounds.centroidLower[axis]);
+        for(const BuildPrimitive& reference : references) {
+            if(binOfCentroid(reference.centroid, axis, bounds.centroidLower[axis], binsPerUnit, numBins) < objectSplit.bin) firstReferences.push_back(reference);
+            else secondReferences.push_back(reference);
+        }
+    }
+
+    if(firstReferences.empty() || secondReferences.empty()) { //Base case -> leaf nodes. Splitting would not make traversal any cheaper.
+        node.offset = uint32_t(referenceOrder.size());
+        node.count = uint32_t(count);
         nodes.push_back(node);
+        for(const BuildPrimitive& reference : references) {
+            referenceOrder.push_back(reference.index);
+        }
         return;
     }
+    references = {}; //Free the memory before going deeper
 
-    node.isLeaf = false;
+    //Whatever is left of the budget is shared by the children in proportion to their number of references.
+    const size_t duplicates = firstReferences.size() + secondReferences.size() - count;
+    const size_t remainingBudget = duplicationBudget - std::min(duplicationBudget, duplicates);
+    const size_t firstBudget = remainingBudget * firstReferences.size() / (firstReferences.size() + secondReferences.size());
+    const size_t secondBudget = remainingBudget - firstBudget;
 
-    std::vector<glm::mat3> triangles;
-    for(std::pair<glm::mat3, int> tri : trianglesAndIndices) {
-        triangles.push_back(tri.first);
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back(node);
+    if(count < ParallelBuildThreshold) {
+        fillNodeVectorSBVH(settings, triangles, rootArea, currentLevel+1, nodes, std::move(firstReferences), firstBudget, deepestLevel, referenceOrder);
+        nodes[nodeIndex].offset = uint32_t(nodes.size());
+        fillNodeVectorSBVH(settings, triangles, rootArea, currentLevel+1, nodes, std::move(secondReferences), secondBudget, deepestLevel, referenceOrder);
+        return;
     }
 
-    //Splitting criterion is in the assignment description. Axis is an integer -> if 0 we split along the x-axis, if 1 along the y-axis and if 2 along the z-axis.
-    std::pair<std::vector<glm::vec3>, std::vector<std::vector<std::pair<glm::mat3, int>>>> data;
-    if(axis % 3 == 0) data = doSplitting(trianglesAndIndices, axis); //Split on x-axis
-    else if(axis % 3 == 1)data = doSplitting(trianglesAndIndices, axis); //Split on y-axis
-    else data = doSplitting(trianglesAndIndices, axis); //Split on z-axis
+    //The budget is split up front, so the children can be built at the same time and the tree still does not depend on the number of threads.
+    std::vector<BoundingVolumeHierarchy::Node> firstNodes, secondNodes;
+    std::vector<int> firstOrder, secondOrder;
+    int firstDeepest = 0, secondDeepest = 0;
+    tbb::parallel_invoke(
+        [&]() { fillNodeVectorSBVH(settings, triangles, rootArea, currentLevel+1, firstNodes, std::move(firstReferences), firstBudget, firstDeepest, firstOrder); },
+        [&]() { fillNodeVectorSBVH(settings, triangles, rootArea, currentLevel+1, secondNodes, std::move(secondReferences), secondBudget, secondDeepest, secondOrder); });
+
+    appendSubtree(nodes, firstNodes, uint32_t(referenceOrder.size()));
+    referenceOrder.insert(referenceOrder.end(), firstOrder.begin(), firstOrder.end());
+    nodes[nodeIndex].offset = uint32_t(nodes.size());
+    appendSubtree(nodes, secondNodes, uint32_t(referenceOrder.size()));
+    referenceOrder.insert(referenceOrder.end(), secondOrder.begin(), secondOrder.end());
+    deepestLevel = std::max({ deepestLevel, firstDeepest, secondDeepest });
+}
 
-    glm::vec3 aabb1Lower = data.first[0];
-    glm::vec3 aabb1Upper = data.first[1];
-    glm::vec3 aabb2Lower = data.first[2];
-    glm::vec3 aabb2Upper = data.first[3];
-    std::vector<std::pair<glm::mat3, int>> firstAABBTriangles = data.second[0];
-    std::vector<std::pair<glm::mat3, int>> secondAABBTriangles = data.second[1];
+// A primitive in the Morton order of the linear builder: the Morton code of its centroid and its index in the primitive list.
+struct MortonPrimitive {
+    uint64_t code;
+    uint32_t index;
+};
+
+// Spreads the lowest 21 bits of value out so that two zero bits follow every bit.
+static uint64_t expandBits21(uint64_t value) {
+    value &= 0x1FFFFF;
+    value = (value | value << 32) & 0x001F00000000FFFFull;
+    value = (value | value << 16) & 0x001F0000FF0000FFull;
+    value = (value | value << 8) & 0x100F00F00F00F00Full;
+    value = (value | value << 4) & 0x10C30C30C30C30C3ull;
+    value = (value | value << 2) & 0x1249249249249249ull;
+    return value;
+}
+
+// 63-bit Morton code of a point in the unit cube: its coordinates quantized to 21 bits each, with the bits interleaved
+// as ...zyxzyx. Sorting points by their code orders them along a Z-order curve, which keeps points that are close in space close in the array.
+static uint64_t mortonCode(const glm::vec3& point) {
+    const glm::vec3 quantized = glm::clamp(point * float(1 << 21), glm::vec3(0.0f), glm::vec3(float((1 << 21) - 1)));
+    return expandBits21(uint64_t(quantized.x)) | expandBits21(uint64_t(quantized.y)) << 1 | expandBits21(uint64_t(quantized.z)) << 2;
+}
 
-    //Recursively make left child nodes
-    fillNodeVector(maxDepth, currentLevel+1, aabb1Lower, aabb1Upper, nodes, firstAABBTriangles, axis+1);
-    int childNode1 = nodes.size() - 1;
+// Stable least significant digit radix sort by Morton code, 8 bits per pass. The array is split into blocks of
+// ParallelBuildThreshold primitives: all blocks count their digits in parallel, a prefix sum over the counts gives every
+// block its output position per digit, and then all blocks scatter in parallel. Passes over a digit that is the same
+// for every code would not change the order and are skipped.
+static void radixSortByMortonCode(std::vector<MortonPrimitive>& primitives) {
+    constexpr int DigitBits = 8;
+    constexpr size_t NumDigits = size_t(1) << DigitBits;
+    const size_t numBlocks = (primitives.size() + ParallelBuildThreshold - 1) / ParallelBuildThreshold;
+    std::vector<MortonPrimitive> sorted(primitives.size());
+    std::vector<size_t> positions(NumDigits * numBlocks); //Digit major, so that the prefix sum puts all blocks of a digit after each other
+
+    for(int shift = 0; shift < 64; shift += DigitBits) {
+        const auto digitOf = [shift](const MortonPrimitive& primitive) { return uint32_t(primitive.code >> shift) & (NumDigits - 1); };
+        std::fill(positions.begin(), positions.end(), size_t(0));
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numBlocks), [&](const tbb::blocked_range<size_t>& range) {
+            for(size_t block = range.begin(); block < range.end(); block++) {
+                const size_t blockEnd = std::min(primitives.size(), (block + 1) * ParallelBuildThreshold);
+                for(size_t i = block * ParallelBuildThreshold; i < blockEnd; i++) positions[digitOf(primitives[i]) * numBlocks + block]++;
+            }
+        });
 
-    //Recursively make right child nodes
-    fillNodeVector(maxDepth, currentLevel+1, aabb2Lower, aabb2Upper, nodes, secondAABBTriangles, axis+1);
-    int childNode2 = nodes.size() - 1;
+        const size_t firstDigit = digitOf(primitives[0]);
+        if(std::accumulate(positions.begin() + std::ptrdiff_t(firstDigit * numBlocks), positions.begin() + std::ptrdiff_t((firstDigit + 1) * numBlocks), size_t(0)) == primitives.size()) continue;
 
-    node.indices = std::vector<int> {childNode1, childNode2}; //These are the child node indices of an inner node.
-    nodes.push_back(node);
+        std::exclusive_scan(positions.begin(), positions.end(), positions.begin(), size_t(0));
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numBlocks), [&](const tbb::blocked_range<size_t>& range) {
+            for(size_t block = range.begin(); block < range.end(); block++) {
+                const size_t blockEnd = std::min(primitives.size(), (block + 1) * ParallelBuildThreshold);
+                for(size_t i = block * ParallelBuildThreshold; i < blockEnd; i++) sorted[positions[digitOf(primitives[i]) * numBlocks + block]++] = primitives[i];
+            }
+        });
+        primitives.swap(sorted);
+    }
+}
+
+// Returns the primitives sorted by the Morton codes of their centroids within the centroid bounds.
+static std::vector<MortonPrimitive> sortByMortonCode(const std::vector<BuildPrimitive>& primitives, const BuildBounds& bounds) {
+    //Stretch the centroid bounds to the unit cube. An axis on which all centroids are equal contributes zero bits.
+    const glm::vec3 extent = bounds.centroidUpper - bounds.centroidLower;
+    const glm::vec3 scale { extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f, extent.z > 0.0f ? 1.0f / extent.z : 0.0f };
+    std::vector<MortonPrimitive> sorted(primitives.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, primitives.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            sorted[i] = MortonPrimitive { mortonCode((primitives[i].centroid - bounds.centroidLower) * scale), uint32_t(i) };
+        }
+    });
+    if(!sorted.empty()) radixSortByMortonCode(sorted);
+    return sorted;
 }
 
-BoundingVolumeHierarchy::BoundingVolumeHierarchy(Scene* pScene): m_pScene(pScene) {
-    maxDepth = numLevels();
+// Recursively builds the subtree over sorted[begin, end) of the linear builder (LBVH) and appends it to nodes in the same
+// order as fillNodeVector. No costs are evaluated: a range is split where the highest bit in which its first and last
+// Morton code differ flips, which a binary search finds because the codes are sorted. Ranges of equal codes are split in
+// the middle. Leaves reference their range of the sorted array. The box of every node is the union of its children and
+// is returned to the parent.
+static AxisAlignedBox fillNodeVectorLinear(const BvhSettings& settings, int currentLevel, std::vector<BoundingVolumeHierarchy::Node>& nodes, const std::vector<MortonPrimitive>& sorted,
+    const std::vector<BuildPrimitive>& primitives, size_t begin, size_t end, int& deepestLevel) {
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back(BoundingVolumeHierarchy::Node { glm::vec3(0.0f), 0, glm::vec3(0.0f), BoundingVolumeHierarchy::Node::InnerNode });
+    deepestLevel = std::max(deepestLevel, currentLevel);
+
+    const size_t count = end - begin;
+    if(count <= size_t(std::max(settings.maxLeafSize, 1)) || currentLevel >= settings.maxLevels - 1) { //Base case -> leaf nodes.
+        AxisAlignedBox box { glm::vec3(std::numeric_limits<float>::infinity()), glm::vec3(-std::numeric_limits<float>::infinity()) };
+        for(size_t i = begin; i < end; i++) {
+            const BuildPrimitive& primitive = primitives[sorted[i].index];
+            growBox(box.lower, box.upper, primitive.lower, primitive.upper);
+        }
+        nodes[nodeIndex] = BoundingVolumeHierarchy::Node { box.lower, uint32_t(begin), box.upper, uint32_t(count) };
+        return box;
+    }
+
+    const uint64_t differentBits = sorted[begin].code ^ sorted[end - 1].code;
+    size_t middle = begin + count / 2;
+    if(differentBits != 0) {
+        const int splitBit = 63 - std::countl_zero(differentBits);
+        middle = size_t(std::partition_point(sorted.begin() + std::ptrdiff_t(begin), sorted.begin() + std::ptrdiff_t(end), [&](const MortonPrimitive& primitive) {
+            return ((primitive.code >> splitBit) & 1) == 0;
+        }) - sorted.begin());
+    }
+
+    AxisAlignedBox firstBox, secondBox;
+    if(count < ParallelBuildThreshold) {
+        //Recursively make left child nodes, the first child directly follows its parent
+        firstBox = fillNodeVectorLinear(settings, currentLevel+1, nodes, sorted, primitives, begin, middle, deepestLevel);
 
-    //Define the lower and upper coordinates for the entire scene
+        //Recursively make right child nodes
+        nodes[nodeIndex].offset = uint32_t(nodes.size());
+        secondBox = fillNodeVectorLinear(settings, currentLevel+1, nodes, sorted, primitives, middle, end, deepestLevel);
+    } else {
+        std::vector<BoundingVolumeHierarchy::Node> firstNodes, secondNodes;
+        int firstDeepest = 0, secondDeepest = 0;
+        tbb::parallel_invoke(
+            [&]() { firstBox = fillNodeVectorLinear(settings, currentLevel+1, firstNodes, sorted, primitives, begin, middle, firstDeepest); },
+            [&]() { secondBox = fillNodeVectorLinear(settings, currentLevel+1, secondNodes, sorted, primitives, middle, end, secondDeepest); });
+
+        appendSubtree(nodes, firstNodes, 0); //Leaves already reference absolute ranges of the sorted array
+        nodes[nodeIndex].offset = uint32_t(nodes.size());
+        appendSubtree(nodes, secondNodes, 0);
+        deepestLevel = std::max({ deepestLevel, firstDeepest, secondDeepest });
+    }
+
+    growBox(firstBox.lower, firstBox.upper, secondBox.lower, secondBox.upper);
+    nodes[nodeIndex].lower = firstBox.lower;
+    nodes[nodeIndex].upper = firstBox.upper;
+    return firstBox;
+}
+
+//Relative amount by which the node boxes are grown after building.
+static constexpr float BoxPadding = 1e-5f;
+
+//The slab test is exact, but the triangle test accepts hits slightly outside the triangle (e.g. on the mirror seam of the monkey).
+//Pad every box by a tiny amount so that the box never rejects a hit that the triangle test would accept.
+static void padBox(glm::vec3& lower, glm::vec3& upper) {
+    if(isEmptyBox(lower, upper)) return; //inf - inf would turn the box into NaN
+    const glm::vec3 padding = BoxPadding * (1.0f + glm::max(glm::abs(lower), glm::abs(upper)));
+    lower -= padding;
+    upper += padding;
+}
+
+// Returns the world space box around a box in the coordinates of a mesh, by transforming all 8 corners.
+static AxisAlignedBox transformBox(const glm::vec3& lower, const glm::vec3& upper, const glm::mat4& transform) {
+    AxisAlignedBox box { glm::vec3(std::numeric_limits<float>::infinity()), glm::vec3(-std::numeric_limits<float>::infinity()) };
+    for(int corner = 0; corner < 8; corner++) {
+        const glm::vec3 point { (corner & 1) ? upper.x : lower.x, (corner & 2) ? upper.y : lower.y, (corner & 4) ? upper.z : lower.z };
+        const glm::vec3 transformed = glm::vec3(transform * glm::vec4(point, 1.0f));
+        growBox(box.lower, box.upper, transformed, transformed);
+    }
+    return box;
+}
+
+// Collapses the binary tree of a mesh (or of the top level) into the wide nodes of the layout, and empties the wide nodes
+// of the other layouts. The binary nodes are kept: refitting, ray packets and drawing walk them.
+template <typename Tree>
+static void collapseNodes(Tree& tree, BvhLayout layout) {
+    tree.wideNodes4 = layout == BvhLayout::Wide4 ? collapseBvh4(tree.nodes) : std::vector<BoundingVolumeHierarchy::WideNode<4>> {};
+    tree.wideNodes8 = layout == BvhLayout::Wide8 ? collapseBvh8(tree.nodes) : std::vector<BoundingVolumeHierarchy::WideNode<8>> {};
+    tree.compressedNodes4 = layout == BvhLayout::Wide4Compressed ? compressBvh4(collapseBvh4(tree.nodes)) : std::vector<BoundingVolumeHierarchy::CompressedWideNode<4>> {};
+    tree.compressedNodes8 = layout == BvhLayout::Wide8Compressed ? compressBvh8(collapseBvh8(tree.nodes)) : std::vector<BoundingVolumeHierarchy::CompressedWideNode<8>> {};
+}
+
+// Expected cost of a random ray through the tree according to the surface area heuristic.
+static float treeSahCost(const std::vector<BoundingVolumeHierarchy::Node>& nodes, const BvhSettings& settings) {
+    if(nodes.empty()) return 0.0f;
+    const float rootArea = surfaceArea(nodes[0].lower, nodes[0].upper);
+    if(rootArea <= 0.0f) return 0.0f;
+
+    //Every node is visited with a probability equal to its area relative to the root.
+    float cost = 0.0f;
+    for(const BoundingVolumeHierarchy::Node& node : nodes) {
+        const float nodeCost = node.isLeaf() ? settings.intersectionCost * float(node.count) : settings.traversalCost;
+        cost += nodeCost * surfaceArea(node.lower, node.upper);
+    }
+    return cost / rootArea;
+}
+
+//Precomputes the edges of every triangle (one by one or in packets) if the triangle test uses them, and frees them otherwise.
+static void buildTriangleRecords(BoundingVolumeHierarchy::MeshBvh& meshBvh, TriangleTest triangleTest) {
+    meshBvh.triangleRecords.clear();
+    meshBvh.trianglePackets4 = triangleTest == TriangleTest::Precomputed4 ? buildTrianglePackets4(meshBvh.nodes, meshBvh.triangles, meshBvh.trianglePacketIndices) : std::vector<BoundingVolumeHierarchy::TrianglePacket<4>> {};
+    meshBvh.trianglePackets8 = triangleTest == TriangleTest::Precomputed8 ? buildTrianglePackets8(meshBvh.nodes, meshBvh.triangles, meshBvh.trianglePacketIndices) : std::vector<BoundingVolumeHierarchy::TrianglePacket<8>> {};
+    if(triangleTest != TriangleTest::Precomputed4 && triangleTest != TriangleTest::Precomputed8) meshBvh.trianglePacketIndices.clear();
+    if(triangleTest != TriangleTest::Precomputed) return;
+    meshBvh.triangleRecords.resize(meshBvh.triangles.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, meshBvh.triangles.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            const glm::mat3& triangle = meshBvh.triangles[i];
+            meshBvh.triangleRecords[i] = makeTriangleRecord(triangle[0], triangle[1], triangle[2]);
+        }
+    });
+}
+
+// Builds the bottom level tree over the triangles of one mesh, or loads it from settings.cacheDirectory.
+static BoundingVolumeHierarchy::MeshBvh buildMeshBvh(const Mesh& mesh, const BvhSettings& settings) {
+    BoundingVolumeHierarchy::MeshBvh meshBvh;
+    meshBvh.numMeshTriangles = mesh.triangles.size();
+    if(mesh.triangles.empty()) return meshBvh;
+
+    //Define the lower and upper coordinates for the entire mesh
     float xmin, ymin, zmin;
     xmin = ymin = zmin = std::numeric_limits<float>::infinity();
     float xmax, ymax, zmax;
     xmax = ymax = zmax = -1 * std::numeric_limits<float>::infinity();
-    for(const auto& mesh : m_pScene->meshes) {
-        for(const auto& vertex : mesh.vertices) {
-            if(vertex.position.x < xmin) xmin = vertex.position.x;
-            if(vertex.position.y < ymin) ymin = vertex.position.y;
-            if(vertex.position.z < zmin) zmin = vertex.position.z;
-            if(vertex.position.x > xmax) xmax = vertex.position.x;
-            if(vertex.position.y > ymax) ymax = vertex.position.y;
-            if(vertex.position.z > zmax) zmax = vertex.position.z;
-        }
+    for(const auto& vertex : mesh.vertices) {
+        if(vertex.position.x < xmin) xmin = vertex.position.x;
+        if(vertex.position.y < ymin) ymin = vertex.position.y;
+        if(vertex.position.z < zmin) zmin = vertex.position.z;
+        if(vertex.position.x > xmax) xmax = vertex.position.x;
+        if(vertex.position.y > ymax) ymax = vertex.position.y;
+        if(vertex.position.z > zmax) zmax = vertex.position.z;
     }
     glm::vec3 lower = glm::vec3(xmin, ymin, zmin);
     glm::vec3 upper = glm::vec3(xmax, ymax, zmax);
 
     //Make a list of all the triangles with its positions
-    //Every row is the xyz coordinate of 1 vertex and there are 3 vertices per triangle -> 3x3 matrix. The int corresponds to the index that it will have in the allTriangles array
-    std::vector<std::pair<glm::mat3, int>> triangles;
+    //Every row is the xyz coordinate of 1 vertex and there are 3 vertices per triangle -> 3x3 matrix. The int corresponds to the index of the triangle in the mesh
+    std::vector<std::pair<glm::mat3, int>> trianglesAndIndices;
+    std::vector<glm::mat3> triangles;
+    std::vector<std::array<Vertex, 3>> triangleVertices;
     int triangleCounter = 0;
-    int meshCounter = 0;
-    for(const auto& mesh : m_pScene->meshes) {
-        for(const auto& triangle : mesh.triangles) {
-            Vertex v0 = mesh.vertices[triangle.x];
-            Vertex v1 = mesh.vertices[triangle.y];
-            Vertex v2 = mesh.vertices[triangle.z];
+    for(const auto& triangle : mesh.triangles) {
+        Vertex v0 = mesh.vertices[triangle.x];
+        Vertex v1 = mesh.vertices[triangle.y];
+        Vertex v2 = mesh.vertices[triangle.z];
+
+        glm::mat3 triangleWithPositions = glm::mat3(v0.position, v1.position, v2.position);
+        trianglesAndIndices.push_back(std::pair(triangleWithPositions, triangleCounter++));
+        triangles.push_back(triangleWithPositions);
+        triangleVertices.push_back(std::array{v0, v1, v2});
+    }
+
+    std::vector<int> triangleOrder; //Triangle indices in the order in which the leaves reference them
+
+    //Reuse a tree that was built before for the same triangles and settings. A stale or damaged file is ignored and overwritten.
+    const bool useCache = !settings.cacheDirectory.empty();
+    const uint64_t cacheKey = useCache ? bvhCacheKey(mesh, settings) : 0;
+    const std::filesystem::path cacheFile = useCache ? bvhCacheFile(settings.cacheDirectory, cacheKey) : std::filesystem::path {};
+    std::optional<BvhCacheEntry> cached;
+    if(useCache) cached = readBvhCache(cacheFile, cacheKey, triangles.size());
 
-            glm::mat3 triangleWithPositions = glm::mat3(v0.position, v1.position, v2.position);
-            triangles.push_back(std::pair(triangleWithPositions, triangleCounter++));
-            allTriangles.push_back(triangleWithPositions);
-            meshIndices.push_back(meshCounter);
-            vertexIndices.push_back(std::vector{v0, v1, v2});
+    if(cached) {
+        meshBvh.nodes = std::move(cached->nodes);
+        triangleOrder = std::move(cached->triangleOrder);
+        meshBvh.maxDepth = cached->maxDepth;
+        meshBvh.loadedFromCache = true;
+    } else {
+        int deepestLevel = 0;
+        if(settings.builder == BvhBuilder::Median) {
+            fillNodeVector(settings.maxLevels-1, 0, lower, upper, meshBvh.nodes, std::move(trianglesAndIndices), 0, size_t(settings.maxLeafSize), deepestLevel, triangleOrder);
+        } else {
+            std::vector<BuildPrimitive> primitives(triangles.size());
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, triangles.size()), [&](const tbb::blocked_range<size_t>& range) {
+                for(size_t i = range.begin(); i < range.end(); i++) {
+                    const glm::mat3& triangle = triangles[i];
+                    glm::vec3 triangleLower = glm::min(glm::min(triangle[0], triangle[1]), triangle[2]);
+                    glm::vec3 triangleUpper = glm::max(glm::max(triangle[0], triangle[1]), triangle[2]);
+                    primitives[i] = BuildPrimitive { triangleLower, triangleUpper, 0.5f * (triangleLower + triangleUpper), int(i) };
+                }
+            });
+            if(settings.builder == BvhBuilder::Linear) {
+                const std::vector<MortonPrimitive> sorted = sortByMortonCode(primitives, computeBounds(primitives, 0, primitives.size()));
+                fillNodeVectorLinear(settings, 0, meshBvh.nodes, sorted, primitives, 0, sorted.size(), deepestLevel);
+                for(const MortonPrimitive& primitive : sorted) {
+                    triangleOrder.push_back(int(primitive.index));
+                }
+            } else if(settings.builder == BvhBuilder::SpatialSplitSAH) {
+                const BuildBounds bounds = computeBounds(primitives, 0, primitives.size());
+                const size_t duplicationBudget = size_t(std::max(settings.maxDuplication, 0.0f) * float(primitives.size()));
+                fillNodeVectorSBVH(settings, triangles, surfaceArea(bounds.lower, bounds.upper), 0, meshBvh.nodes, std::move(primitives), duplicationBudget, deepestLevel, triangleOrder);
+            } else {
+                fillNodeVectorSAH(settings, 0, meshBvh.nodes, primitives, 0, primitives.size(), deepestLevel);
+                for(const BuildPrimitive& primitive : primitives) {
+                    triangleOrder.push_back(primitive.index);
+                }
+            }
+        }
+        meshBvh.maxDepth = deepestLevel + 1;
+        //Done before padding, so that the costs are computed with the exact boxes.
+        if(settings.optimizeTreelets) meshBvh.maxDepth = optimizeTreelets(meshBvh.nodes, settings);
+
+        for(BoundingVolumeHierarchy::Node& node : meshBvh.nodes) {
+            padBox(node.lower, node.upper);
+        }
+
+        if(useCache) writeBvhCache(cacheFile, cacheKey, triangles.size(), BvhCacheEntry { meshBvh.nodes, triangleOrder, meshBvh.maxDepth });
+    }
+
+    //Sort the triangle arrays in BVH order so that every leaf covers one contiguous range of triangles. With spatial splits
+    //a triangle can be referenced by several leaves and is then stored once for each of them.
+    meshBvh.triangles.resize(triangleOrder.size());
+    meshBvh.triangleVertices.resize(triangleOrder.size());
+    meshBvh.meshTriangleIndices.resize(triangleOrder.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, triangleOrder.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            const size_t index = size_t(triangleOrder[i]);
+            meshBvh.triangles[i] = triangles[index];
+            meshBvh.triangleVertices[i] = triangleVertices[index];
+            meshBvh.meshTriangleIndices[i] = int(index);
+        }
+    });
+
+    buildTriangleRecords(meshBvh, settings.triangleTest);
+    collapseNodes(meshBvh, settings.layout);
+    meshBvh.builtSahCost = treeSahCost(meshBvh.nodes, settings);
+    return meshBvh;
+}
+
+BoundingVolumeHierarchy::BoundingVolumeHierarchy(Scene* pScene, const BvhSettings& bvhSettings): settings(bvhSettings), m_pScene(pScene) {
+    settings.maxLevels = std::clamp(settings.maxLevels, 1, MaxTraversalDepth); //The traversal stack has room for one node per level
+    settings.layout = resolveBvhLayout(settings.layout);
+    settings.triangleTest = resolveTriangleTest(settings.triangleTest);
+    //Hits refer to the material table, so meshes that were added to the scene by hand need an entry as well
+    addMeshMaterials(*m_pScene);
+
+    //Every mesh is built once, no matter how often it is placed. The meshes are independent, so they are built at the same time.
+    meshBvhs.resize(m_pScene->meshes.size());
+    tbb::parallel_for(size_t(0), m_pScene->meshes.size(), [&](size_t meshIndex) {
+        meshBvhs[meshIndex] = buildMeshBvh(m_pScene->meshes[meshIndex], settings);
+    });
+    loadedFromCache = !meshBvhs.empty() && std::all_of(meshBvhs.begin(), meshBvhs.end(), [](const MeshBvh& meshBvh) { return meshBvh.loadedFromCache; });
+
+    rebuildTopLevel();
+}
+
+//Builds the tree over the spheres and boxes with the same SAH builder as the top level, so that rays no longer test every shape.
+void BoundingVolumeHierarchy::rebuildShapes() {
+    shapeBvh = ShapeBvh {};
+    std::vector<std::variant<Sphere, Box>> unorderedShapes;
+    std::vector<BuildPrimitive> primitives;
+    const auto addShape = [&](const std::variant<Sphere, Box>& shape, const glm::vec3& lower, const glm::vec3& upper) {
+        primitives.push_back(BuildPrimitive { lower, upper, 0.5f * (lower + upper), int(unorderedShapes.size()) });
+        unorderedShapes.push_back(shape);
+    };
+    for(const Sphere& sphere : m_pScene->spheres) {
+        addShape(sphere, sphere.center - sphere.radius, sphere.center + sphere.radius);
+    }
+    for(const Box& box : m_pScene->boxes) {
+        addShape(box, box.shape.lower, box.shape.upper);
+    }
+    if(primitives.empty()) return;
+
+    BvhSettings shapeSettings = settings;
+    shapeSettings.maxLevels = MaxTraversalDepth;
+    int deepestLevel = 0;
+    fillNodeVectorSAH(shapeSettings, 0, shapeBvh.nodes, primitives, 0, primitives.size(), deepestLevel);
+    shapeBvh.maxDepth = deepestLevel + 1;
+    for(Node& node : shapeBvh.nodes) {
+        padBox(node.lower, node.upper);
+    }
+    for(const BuildPrimitive& primitive : primitives) {
+        shapeBvh.shapes.push_back(unorderedShapes[size_t(primitive.index)]);
+    }
+    collapseNodes(shapeBvh, settings.layout);
+}
+
+void BoundingVolumeHierarchy::rebuildTopLevel() {
+    rebuildShapes();
+    nodes.clear();
+    wideNodes4.clear();
+    wideNodes8.clear();
+    compressedNodes4.clear();
+    compressedNodes8.clear();
+    instances.clear();
+    maxDepth = 0;
+
+    std::vector<Instance> unorderedInstances;
+    const auto addInstance = [&](size_t meshIndex, const glm::mat4& transform) {
+        if(meshBvhs[meshIndex].nodes.empty()) return; //Nothing to hit
+        const glm::mat4 inverse = glm::inverse(transform);
+        unorderedInstances.push_back(Instance { uint32_t(meshIndex), transform != glm::mat4(1.0f), transform, inverse, glm::transpose(glm::mat3(inverse)) });
+    };
+    if(m_pScene->instances.empty()) {
+        for(size_t meshIndex = 0; meshIndex < meshBvhs.size(); meshIndex++) {
+            addInstance(meshIndex, glm::mat4(1.0f));
         }
-        meshCounter++;
+    }
+    for(const MeshInstance& instance : m_pScene->instances) {
+        addInstance(instance.meshIndex, instance.transform);
+    }
+    if(unorderedInstances.empty()) return;
+
+    //The top level is built by the same SAH builder, with the world space boxes of the instances as primitives.
+    std::vector<BuildPrimitive> primitives;
+    for(size_t i = 0; i < unorderedInstances.size(); i++) {
+        const Instance& instance = unorderedInstances[i];
+        const Node& root = meshBvhs[instance.meshIndex].nodes[0];
+        const AxisAlignedBox box = instance.hasTransform ? transformBox(root.lower, root.upper, instance.objectToWorld) : AxisAlignedBox { root.lower, root.upper };
+        primitives.push_back(BuildPrimitive { box.lower, box.upper, 0.5f * (box.lower + box.upper), int(i) });
+    }
+    BvhSettings topLevelSettings = settings;
+    topLevelSettings.maxLevels = MaxTraversalDepth;
+    topLevelSettings.maxLeafSize = 1;
+    int deepestLevel = 0;
+    fillNodeVectorSAH(topLevelSettings, 0, nodes, primitives, 0, primitives.size(), deepestLevel);
+    maxDepth = deepestLevel + 1;
+    for(Node& node : nodes) {
+        padBox(node.lower, node.upper);
     }
 
-    fillNodeVector(maxDepth-1, 0, lower, upper, nodes, triangles, 0);
+    for(const BuildPrimitive& primitive : primitives) {
+        instances.push_back(unorderedInstances[size_t(primitive.index)]);
+    }
+    collapseNodes(*this, settings.layout);
+}
+
+void BoundingVolumeHierarchy::refitMesh(size_t meshIndex) {
+    MeshBvh& meshBvh = meshBvhs[meshIndex];
+    const Mesh& mesh = m_pScene->meshes[meshIndex];
+
+    //Copy the new vertices from the scene.
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, meshBvh.triangles.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            const glm::uvec3& triangle = mesh.triangles[size_t(meshBvh.meshTriangleIndices[i])];
+            meshBvh.triangleVertices[i] = std::array { mesh.vertices[triangle.x], mesh.vertices[triangle.y], mesh.vertices[triangle.z] };
+            meshBvh.triangles[i] = glm::mat3(meshBvh.triangleVertices[i][0].position, meshBvh.triangleVertices[i][1].position, meshBvh.triangleVertices[i][2].position);
+        }
+    });
+    buildTriangleRecords(meshBvh, settings.triangleTest);
+
+    //The leaves are independent of each other... With spatial splits a leaf gets the box of its whole triangles again, which
+    //is correct but looser than the clipped box that it was built with.
+    std::vector<Node>& meshNodes = meshBvh.nodes;
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, meshNodes.size()), [&](const tbb::blocked_range<size_t>& range) {
+        for(size_t i = range.begin(); i < range.end(); i++) {
+            Node& node = meshNodes[i];
+            if(!node.isLeaf()) continue;
+            node.lower = glm::vec3(std::numeric_limits<float>::infinity());
+            node.upper = glm::vec3(-std::numeric_limits<float>::infinity());
+            for(uint32_t index = node.offset; index < node.offset + node.count; index++) {
+                const glm::mat3& triangle = meshBvh.triangles[index];
+                growBox(node.lower, node.upper, glm::min(glm::min(triangle[0], triangle[1]), triangle[2]), glm::max(glm::max(triangle[0], triangle[1]), triangle[2]));
+            }
+            padBox(node.lower, node.upper);
+        }
+    });
+
+    //...and an inner node always comes before its children, so walking backwards sees both children before their parent.
+    //The children are already padded, so their union does not need any extra padding.
+    for(size_t i = meshNodes.size(); i-- > 0;) {
+        Node& node = meshNodes[i];
+        if(node.isLeaf()) continue;
+        node.lower = glm::vec3(std::numeric_limits<float>::infinity());
+        node.upper = glm::vec3(-std::numeric_limits<float>::infinity());
+        for(const Node* child : { &meshNodes[i + 1], &meshNodes[node.offset] }) {
+            if(!isEmptyBox(child->lower, child->upper)) growBox(node.lower, node.upper, child->lower, child->upper);
+        }
+    }
+
+    //The wide nodes hold copies of the boxes of the binary nodes, so they are simply collapsed again.
+    collapseNodes(meshBvh, settings.layout);
+}
+
+void BoundingVolumeHierarchy::refit() {
+    for(size_t meshIndex = 0; meshIndex < meshBvhs.size(); meshIndex++) {
+        refitMesh(meshIndex);
+    }
+    rebuildTopLevel();
+}
+
+float BoundingVolumeHierarchy::sahCost() const {
+    float cost = 0.0f;
+    for(const MeshBvh& meshBvh : meshBvhs) {
+        cost += treeSahCost(meshBvh.nodes, settings);
+    }
+    return cost;
+}
+
+bool BoundingVolumeHierarchy::update() {
+    //The geometry keeps changing, so rebuilt trees are not worth caching.
+    BvhSettings rebuildSettings = settings;
+    rebuildSettings.cacheDirectory.clear();
+
+    if(m_pScene->meshes.size() != meshBvhs.size()) {
+        const std::filesystem::path cacheDirectory = settings.cacheDirectory;
+        *this = BoundingVolumeHierarchy(m_pScene, rebuildSettings);
+        settings.cacheDirectory = cacheDirectory;
+        return true;
+    }
+
+    bool rebuilt = false;
+    for(size_t meshIndex = 0; meshIndex < meshBvhs.size(); meshIndex++) {
+        MeshBvh& meshBvh = meshBvhs[meshIndex];
+        const Mesh& mesh = m_pScene->meshes[meshIndex];
+        if(mesh.triangles.size() == meshBvh.numMeshTriangles) {
+            refitMesh(meshIndex);
+            if(treeSahCost(meshBvh.nodes, settings) <= meshBvh.builtSahCost * settings.rebuildCostRatio) continue;
+        }
+        meshBvh = buildMeshBvh(mesh, rebuildSettings);
+        rebuilt = true;
+    }
+    rebuildTopLevel();
+    return rebuilt;
 }
 
 // Return the depth of the tree that you constructed. This is used to tell the
 // slider in the UI how many steps it should display.
 int BoundingVolumeHierarchy::numLevels() const {
-    return 4;
+    int meshLevels = 0;
+    for(const MeshBvh& meshBvh : meshBvhs) {
+        meshLevels = std::max(meshLevels, meshBvh.maxDepth);
+    }
+    return std::max(maxDepth + meshLevels, 1);
 }
 
-std::vector<BoundingVolumeHierarchy::Node> getLeafNodes(std::vector<BoundingVolumeHierarchy::Node>& nodes, BoundingVolumeHierarchy::Node root) {
-    if(root.isLeaf) return std::vector<BoundingVolumeHierarchy::Node>{root};
+std::vector<BoundingVolumeHierarchy::Node> getLeafNodes(const std::vector<BoundingVolumeHierarchy::Node>& nodes, size_t rootIndex) {
+    const BoundingVolumeHierarchy::Node& root = nodes[rootIndex];
+    if(root.isLeaf()) return std::vector<BoundingVolumeHierarchy::Node>{root};
 
-    std::vector<BoundingVolumeHierarchy::Node> v1;
-    std::vector<BoundingVolumeHierarchy::Node> v2;
-    if(root.indices.size() == 2) {
-        v1 = getLeafNodes(nodes, nodes[root.indices[0]]);
-        v2 = getLeafNodes(nodes, nodes[root.indices[1]]);
-    }
+    std::vector<BoundingVolumeHierarchy::Node> v1 = getLeafNodes(nodes, rootIndex + 1);
+    std::vector<BoundingVolumeHierarchy::Node> v2 = getLeafNodes(nodes, root.offset);
 
     //Just concatenates two vectors. The nodes found on the left subtree and the nodes found on the right subtree.
     std::vector<BoundingVolumeHierarchy::Node> nodesAtGivenLevel;
@@ -292,14 +1199,15 @@ std::vector<BoundingVolumeHierarchy::Node> getLeafNodes(std::vector<BoundingVolu
     return nodesAtGivenLevel;
 }
 
-std::vector<BoundingVolumeHierarchy::Node> getNodesAtLevel(std::vector<BoundingVolumeHierarchy::Node>& nodes, BoundingVolumeHierarchy::Node root, int currentLevel, int targetLevel) {
+std::vector<BoundingVolumeHierarchy::Node> getNodesAtLevel(const std::vector<BoundingVolumeHierarchy::Node>& nodes, size_t rootIndex, int currentLevel, int targetLevel) {
+    const BoundingVolumeHierarchy::Node& root = nodes[rootIndex];
     if(currentLevel == targetLevel) return std::vector<BoundingVolumeHierarchy::Node>{root};
 
     std::vector<BoundingVolumeHierarchy::Node> v1;
     std::vector<BoundingVolumeHierarchy::Node> v2;
-    if(root.indices.size() == 2) {
-        v1 = getNodesAtLevel(nodes, nodes[root.indices[0]], currentLevel+1, targetLevel);
-        v2 = getNodesAtLevel(nodes, nodes[root.indices[1]], currentLevel+1, targetLevel);
+    if(!root.isLeaf()) {
+        v1 = getNodesAtLevel(nodes, rootIndex + 1, currentLevel+1, targetLevel);
+        v2 = getNodesAtLevel(nodes, root.offset, currentLevel+1, targetLevel);
     }
 
     //Just concatenates two vectors. The nodes found on the left subtree and the nodes found on the right subtree.
@@ -318,24 +1226,41 @@ void BoundingVolumeHierarchy::debugDraw(int level) {
     //drawShape(aabb, DrawMode::Filled, glm::vec3(0.0f, 1.0f, 0.0f), 0.2f);
 
     bool left = true;
-    //Get the nodes at a specific level of the BVH tree and draw the AABB.
-    for(BoundingVolumeHierarchy::Node node : getNodesAtLevel(nodes, nodes.back(), 0, level)) {
+    const auto drawBox = [&](const AxisAlignedBox& box) {
         if (left) {
-            drawAABB(AxisAlignedBox{ node.lower, node.upper }, DrawMode::Wireframe, glm::vec3{0,1,0});
+            drawAABB(box, DrawMode::Wireframe, glm::vec3{0,1,0});
             left = false;
         }
         else {
-            drawAABB(AxisAlignedBox{ node.lower, node.upper }, DrawMode::Wireframe, glm::vec3{1,0,0});
+            drawAABB(box, DrawMode::Wireframe, glm::vec3{1,0,0});
             left = true;
         }
+    };
+
+    //Get the nodes at a specific level of the BVH tree and draw the AABB.
+    if(nodes.empty()) return;
+    if(level < maxDepth) {
+        for(const BoundingVolumeHierarchy::Node& node : getNodesAtLevel(nodes, 0, 0, level)) {
+            drawBox(AxisAlignedBox{ node.lower, node.upper });
+        }
+        return;
+    }
+
+    //Below the top level tree, draw the requested level of the tree of every instance, in world space.
+    for(const Instance& instance : instances) {
+        for(const BoundingVolumeHierarchy::Node& node : getNodesAtLevel(meshBvhs[instance.meshIndex].nodes, 0, 0, level - maxDepth)) {
+            drawBox(instance.hasTransform ? transformBox(node.lower, node.upper, instance.objectToWorld) : AxisAlignedBox{ node.lower, node.upper });
+        }
     }
 
     //Coloring all the leaf nodes of the BVH
 //    glm::vec3 color = glm::vec3(0, 0, 0);
-//    std::vector<Node> leafNodes = getLeafNodes(nodes, nodes.back());
+//    std::vector<Node> leafNodes = getLeafNodes(nodes, 0);
 //    float range = 255.0f / leafNodes.size();
 //    for(BoundingVolumeHierarchy::Node node : leafNodes) {
-//        drawTriangles(node.indices, color, allTriangles);
+//        std::vector<int> indices(node.count);
+//        std::iota(indices.begin(), indices.end(), int(node.offset));
+//        drawTriangles(indices, color, meshBvhs[0].triangles);
 //        color.y += (range / 255.0f);
 //    }
 
@@ -345,107 +1270,826 @@ void BoundingVolumeHierarchy::debugDraw(int level) {
     //drawAABB(aabb, DrawMode::Filled, glm::vec3(0.05f, 1.0f, 0.05f), 0.1f);
 }
 
-bool intersect(const std::vector<BoundingVolumeHierarchy::Node>& nodes, BoundingVolumeHierarchy::Node root, Ray& ray, HitInfo& hitInfo, const std::vector<int>& meshIndices, std::vector<Mesh>& meshes, const std::vector<std::vector<Vertex>>& vertexIndices) {
-    if(root.isLeaf) {
-        //drawTriangles(root.indices, glm::vec3(1, 0 , 0), triangles); //Uncomment this to draw all the triangles of the leaf node of the intersected triangle
-        bool hit = false;
-        drawAABB(AxisAlignedBox{root.lower, root.upper}, DrawMode::Wireframe, glm::vec3(0, 0, 1)); //Draws the intersected AABBs. For some reason the color doesn't work...
-        for(int index : root.indices) {
-            Vertex v0 = vertexIndices[index][0];
-            Vertex v1 = vertexIndices[index][1];
-            Vertex v2 = vertexIndices[index][2];
-
-            float oldT = ray.t;
-            if(intersectRayWithTriangle(v0.position, v1.position, v2.position, ray, hitInfo)) {
-                if(ray.t < oldT) hitInfo.finalTriangleVertices = glm::mat3(v0.position, v1.position, v2.position);
-                hitInfo.material = meshes[meshIndices[index]].material;
-                hit = true;
-
-                //intersection on the mesh
-                glm::vec3 p = ray.origin + ray.t * ray.direction;
-                //find the areas of the 3 subtriangles and total triangle area
-                float areaTotal = glm::length(glm::cross(v1.position - v0.position, v2.position - v0.position));
-                float area0 = glm::length(glm::cross(v1.position - p, v2.position - p));
-                float area1 = glm::length(glm::cross(v2.position - p, v0.position - p));
-                float area2 = glm::length(glm::cross(v0.position - p, v1.position - p));
-                //the weights of the normals
-                float w2 = area2 / areaTotal;
-                float w0 = area0 / areaTotal;
-                float w1 = area1 / areaTotal;
-
-                //normal: addition of all normals with their weights, normalized
-                hitInfo.normal = glm::normalize(w2 * v2.normal + w0 * v0.normal + w1 * v1.normal);
-
-                drawRay({ v0.position, v0.normal, 0.1 }, glm::vec3(1, 0, 0));
-                drawRay({ v1.position, v1.normal, 0.1 }, glm::vec3(1, 0, 0));
-                drawRay({ v2.position, v2.normal, 0.1 }, glm::vec3(1, 0, 0));
-
-                //Textures
-
-                glm::vec2 v0TextCoord = v0.texCoord;
-                glm::vec2 v1TextCoord = v1.texCoord;
-                glm::vec2 v2TextCoord = v2.texCoord;
-                //using barycentric coordinates to find the texture coordinates at the intersection
-                glm::vec2 vertexPosTextCoord = w0 * v0TextCoord + w1 * v1TextCoord + w2 * v2TextCoord;
-
-                if (hitInfo.material.kdTexture) {
-                    hitInfo.material.kd = hitInfo.material.kdTexture->getTexel(vertexPosTextCoord);
-                }
-            }
-        }
+// Work of the ray that is currently being traced on this thread. Constant initialized, so that the traversal can count
+// into it without any check whether the thread local was initialized yet.
+static thread_local TraversalStatistics::Counters currentRayCounters;
+
+// Totals of the rays traced on one thread. Every thread that traces rays gets its own copy, which registers itself so
+// that traversalStatistics() can add all of them up.
+struct ThreadTraversalStatistics {
+    TraversalStatistics totals;
+
+    ThreadTraversalStatistics();
+    ~ThreadTraversalStatistics();
+};
+
+struct TraversalStatisticsRegistry {
+    std::mutex mutex;
+    std::vector<ThreadTraversalStatistics*> threads;
+    TraversalStatistics exitedThreads; //Totals of the threads that have exited
+};
+
+// Never destroyed, so that worker threads that exit after main returned can still unregister.
+static TraversalStatisticsRegistry& traversalStatisticsRegistry() {
+    static TraversalStatisticsRegistry* registry = new TraversalStatisticsRegistry();
+    return *registry;
+}
+
+static void addStatistics(TraversalStatistics& statistics, const TraversalStatistics& other) {
+    for(size_t kind = 0; kind < statistics.rays.size(); kind++) {
+        statistics.rays[kind].numRays += other.rays[kind].numRays;
+        statistics.rays[kind].nodesVisited += other.rays[kind].nodesVisited;
+        statistics.rays[kind].trianglesTested += other.rays[kind].trianglesTested;
+    }
+}
+
+ThreadTraversalStatistics::ThreadTraversalStatistics() {
+    TraversalStatisticsRegistry& registry = traversalStatisticsRegistry();
+    std::lock_guard lock { registry.mutex };
+    registry.threads.push_back(this);
+}
+
+ThreadTraversalStatistics::~ThreadTraversalStatistics() {
+    TraversalStatisticsRegistry& registry = traversalStatisticsRegistry();
+    std::lock_guard lock { registry.mutex };
+    addStatistics(registry.exitedThreads, totals);
+    std::erase(registry.threads, this);
+}
+
+static thread_local ThreadTraversalStatistics threadTraversalStatistics;
+
+// Adds the work of the ray (or packet of numRays rays) that was just traced on this thread to the totals of its kind.
+static void finishRayStatistics(RayKind rayKind, uint64_t numRays = 1) {
+    TraversalStatistics::Counters& totals = threadTraversalStatistics.totals.rays[size_t(rayKind)];
+    totals.numRays += numRays;
+    totals.nodesVisited += currentRayCounters.nodesVisited;
+    totals.trianglesTested += currentRayCounters.trianglesTested;
+    currentRayCounters = {};
+}
+
+TraversalStatistics BoundingVolumeHierarchy::traversalStatistics() {
+    TraversalStatisticsRegistry& registry = traversalStatisticsRegistry();
+    std::lock_guard lock { registry.mutex };
+    TraversalStatistics statistics = registry.exitedThreads;
+    for(const ThreadTraversalStatistics* thread : registry.threads) {
+        addStatistics(statistics, thread->totals);
+    }
+    return statistics;
+}
+
+void BoundingVolumeHierarchy::resetTraversalStatistics() {
+    TraversalStatisticsRegistry& registry = traversalStatisticsRegistry();
+    std::lock_guard lock { registry.mutex };
+    registry.exitedThreads = {};
+    for(ThreadTraversalStatistics* thread : registry.threads) {
+        thread->totals = {};
+    }
+}
+
+//Tests the ray against triangle index of the tree with the given triangle test. On a hit closer than ray.t, stores the
+//distance and the barycentric weights in triangleHit. watertightRay is only used by TriangleTest::Watertight.
+//TriangleTest::Original only stores the distance, its weights take 3 more cross products that resolveHit spends on the final hit only.
+static bool intersectTriangle(TriangleTest triangleTest, const BoundingVolumeHierarchy::MeshBvh& meshBvh, uint32_t index, const Ray& ray, const WatertightRay* watertightRay, TriangleHit& triangleHit) {
+    const glm::mat3& triangle = meshBvh.triangles[index];
+    if(triangleTest == TriangleTest::Precomputed) return intersectRayWithTriangle(meshBvh.triangleRecords[index], ray, triangleHit);
+    if(triangleTest == TriangleTest::Watertight) return intersectRayWithTriangle(triangle[0], triangle[1], triangle[2], *watertightRay, ray.t, triangleHit);
+
+    Ray copy = ray;
+    HitInfo scratch;
+    if(!intersectRayWithTriangle(triangle[0], triangle[1], triangle[2], copy, scratch)) return false;
+    triangleHit = TriangleHit { copy.t, 0.0f, 0.0f };
+    return true;
+}
+
+//Nearest hit among the triangles of the leaf before ray.t, tested Width at a time. Stores the triangle in index.
+template <size_t Width>
+static bool intersectTrianglePackets(const std::vector<BoundingVolumeHierarchy::TrianglePacket<Width>>& packets, const BoundingVolumeHierarchy::MeshBvh& meshBvh, const BoundingVolumeHierarchy::Node& leaf, const Ray& ray, uint32_t& index, TriangleHit& triangleHit) {
+    if(leaf.count == 0) return false;
+    Ray nearest = ray; //Shortened with every hit, so that the later packets only report nearer ones
+    bool hit = false;
+    const uint32_t end = leaf.offset + leaf.count;
+    for(uint32_t packetIndex = meshBvh.trianglePacketIndices[leaf.offset]; packetIndex <= meshBvh.trianglePacketIndices[end - 1]; packetIndex++) {
+        const BoundingVolumeHierarchy::TrianglePacket<Width>& packet = packets[packetIndex];
+        //The leaves of the compressed layouts can be split into pieces that start or end in the middle of a packet
+        const uint32_t firstLane = std::max(leaf.offset, packet.firstTriangle) - packet.firstTriangle;
+        const uint32_t endLane = std::min(end, packet.firstTriangle + packet.count) - packet.firstTriangle;
+        const uint32_t laneMask = ((1u << endLane) - 1) & ~((1u << firstLane) - 1);
+        const int lane = intersectRayWithTrianglePacket(packet, nearest, laneMask, triangleHit);
+        if(lane < 0) continue;
+        nearest.t = triangleHit.t;
+        index = packet.firstTriangle + uint32_t(lane);
+        hit = true;
+    }
+    return hit;
+}
+
+// Tests the ray against every triangle of the leaf. Only hits closer than ray.t are accepted: they shorten the ray and
+// are recorded in deferredHit, all but the instance, which the caller fills in.
+bool BoundingVolumeHierarchy::intersectLeaf(size_t meshIndex, const Node& leaf, Ray& ray, DeferredHit& deferredHit) const {
+    const MeshBvh& meshBvh = meshBvhs[meshIndex];
+    if(enableDrawRay) drawAABB(AxisAlignedBox{leaf.lower, leaf.upper}, DrawMode::Wireframe, glm::vec3(0, 0, 1)); //Draws the intersected AABBs. For some reason the color doesn't work...
+    currentRayCounters.trianglesTested += leaf.count;
+
+    const auto storeHit = [&](uint32_t index, const TriangleHit& triangleHit) {
+        ray.t = triangleHit.t;
+        deferredHit.triangle = index;
+        deferredHit.u = triangleHit.u;
+        deferredHit.v = triangleHit.v;
+    };
+
+    //The packets only report the nearest hit of the leaf
+    if(settings.triangleTest == TriangleTest::Precomputed4 || settings.triangleTest == TriangleTest::Precomputed8) {
+        uint32_t index;
+        TriangleHit triangleHit;
+        const bool hit = settings.triangleTest == TriangleTest::Precomputed4 ? intersectTrianglePackets(meshBvh.trianglePackets4, meshBvh, leaf, ray, index, triangleHit)
+                                                                             : intersectTrianglePackets(meshBvh.trianglePackets8, meshBvh, leaf, ray, index, triangleHit);
+        if(hit) storeHit(index, triangleHit);
         return hit;
     }
 
-    float originalT = ray.t;
+    bool hit = false;
+    const std::optional<WatertightRay> watertightRay = settings.triangleTest == TriangleTest::Watertight ? std::optional(WatertightRay(ray)) : std::nullopt;
+    for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count; index++) {
+        TriangleHit triangleHit;
+        if(!intersectTriangle(settings.triangleTest, meshBvh, index, ray, watertightRay ? &*watertightRay : nullptr, triangleHit)) continue;
+        storeHit(index, triangleHit);
+        hit = true;
+    }
+    return hit;
+}
 
-    bool intersectFirst = intersectRayWithShape(AxisAlignedBox{nodes[root.indices[0]].lower, nodes[root.indices[0]].upper}, ray);
-    float rayT1 = ray.t;
-    ray.t = originalT;
+// Looks up the shading attributes of the triangle that the traversal ended with, and moves them into world coordinates.
+void BoundingVolumeHierarchy::resolveHit(const DeferredHit& deferredHit, const Ray& ray, HitInfo& hitInfo) const {
+    const Instance& instance = *deferredHit.instance;
+    const MeshBvh& meshBvh = meshBvhs[instance.meshIndex];
+    const Vertex& v0 = meshBvh.triangleVertices[deferredHit.triangle][0];
+    const Vertex& v1 = meshBvh.triangleVertices[deferredHit.triangle][1];
+    const Vertex& v2 = meshBvh.triangleVertices[deferredHit.triangle][2];
+    hitInfo.finalTriangleVertices = glm::mat3(v0.position, v1.position, v2.position);
+    hitInfo.materialId = m_pScene->meshMaterialIds[instance.meshIndex];
+    const Material& material = m_pScene->materials[hitInfo.materialId];
+
+    //the weights of the normals, straight from the triangle test
+    float w1 = deferredHit.u;
+    float w2 = deferredHit.v;
+    if(settings.triangleTest == TriangleTest::Original) {
+        //The weights are the areas of the 3 subtriangles relative to the total triangle area
+        glm::vec3 p = ray.origin + ray.t * ray.direction;
+        if(instance.hasTransform) p = glm::vec3(instance.worldToObject * glm::vec4(p, 1.0f));
+        const glm::mat3& triangle = meshBvh.triangles[deferredHit.triangle];
+        const float areaTotal = glm::length(glm::cross(triangle[1] - triangle[0], triangle[2] - triangle[0]));
+        w1 = glm::length(glm::cross(triangle[2] - p, triangle[0] - p)) / areaTotal;
+        w2 = glm::length(glm::cross(triangle[0] - p, triangle[1] - p)) / areaTotal;
+    }
+    const float w0 = 1.0f - w1 - w2;
+
+    //normal: addition of all normals with their weights, normalized
+    hitInfo.normal = glm::normalize(w2 * v2.normal + w0 * v0.normal + w1 * v1.normal);
+
+    drawRay({ v0.position, v0.normal, 0.1 }, glm::vec3(1, 0, 0));
+    drawRay({ v1.position, v1.normal, 0.1 }, glm::vec3(1, 0, 0));
+    drawRay({ v2.position, v2.normal, 0.1 }, glm::vec3(1, 0, 0));
+
+    //Textures
+
+    glm::vec2 v0TextCoord = v0.texCoord;
+    glm::vec2 v1TextCoord = v1.texCoord;
+    glm::vec2 v2TextCoord = v2.texCoord;
+    //using barycentric coordinates to find the texture coordinates at the intersection
+    glm::vec2 vertexPosTextCoord = w0 * v0TextCoord + w1 * v1TextCoord + w2 * v2TextCoord;
+
+    hitInfo.kd = material.kdTexture ? material.kdTexture->getTexel(vertexPosTextCoord) : material.kd;
+
+    if(instance.hasTransform) {
+        hitInfo.normal = glm::normalize(instance.normalToWorld * hitInfo.normal);
+        for(int i = 0; i < 3; i++) {
+            hitInfo.finalTriangleVertices[i] = glm::vec3(instance.objectToWorld * glm::vec4(hitInfo.finalTriangleVertices[i], 1.0f));
+        }
+    }
+}
+
+// Returns the distance at which the ray enters the box of the node, or infinity if it misses the box or only
+// reaches it beyond tMax. The distance is 0 when the ray starts inside the box.
+static float boxEntryDistance(const BoundingVolumeHierarchy::Node& node, const RayInverse& rayInverse, float tMax) {
+    float tEntry, tExit;
+    if(intersectRayWithBox(node.lower, node.upper, rayInverse, tMax, tEntry, tExit)) return tEntry;
+    return std::numeric_limits<float>::infinity();
+}
 
-    bool intersectSecond = intersectRayWithShape(AxisAlignedBox{nodes[root.indices[1]].lower, nodes[root.indices[1]].upper}, ray);
-    float rayT2 = ray.t;
-    ray.t = originalT;
+// Visits the subtree of nodes[rootIndex] of a mesh recursively. This is the original traversal, kept around so that it
+// can be compared against traverseStack (see BvhTraversal).
+bool BoundingVolumeHierarchy::intersectRecursive(size_t meshIndex, size_t rootIndex, const RayInverse& rayInverse, Ray& ray, DeferredHit& deferredHit) const {
+    const std::vector<Node>& meshNodes = meshBvhs[meshIndex].nodes;
+    const Node& root = meshNodes[rootIndex];
+    currentRayCounters.nodesVisited++;
+    if(root.isLeaf()) return intersectLeaf(meshIndex, root, ray, deferredHit);
+
+    const size_t firstChild = rootIndex + 1;
+    const size_t secondChild = root.offset;
+
+    float tEntry, tExit;
+    bool intersectFirst = intersectRayWithBox(meshNodes[firstChild].lower, meshNodes[firstChild].upper, rayInverse, ray.t, tEntry, tExit);
+    bool intersectSecond = intersectRayWithBox(meshNodes[secondChild].lower, meshNodes[secondChild].upper, rayInverse, ray.t, tEntry, tExit);
 
     if(intersectFirst && intersectSecond) {
         //We have to execute both intersect methods to get the closest ray.t
-        bool number1 = intersect(nodes, nodes[root.indices[0]], ray, hitInfo, meshIndices, meshes, vertexIndices);
-        bool number2 = intersect(nodes, nodes[root.indices[1]], ray, hitInfo, meshIndices, meshes, vertexIndices);
+        bool number1 = intersectRecursive(meshIndex, firstChild, rayInverse, ray, deferredHit);
+        bool number2 = intersectRecursive(meshIndex, secondChild, rayInverse, ray, deferredHit);
 
         return number1 || number2;
     }
-    if(rayT1 < rayT2) return intersect(nodes, nodes[root.indices[0]], ray, hitInfo, meshIndices, meshes, vertexIndices);
-    else return intersect(nodes, nodes[root.indices[1]], ray, hitInfo, meshIndices, meshes, vertexIndices);
+    if(intersectFirst) return intersectRecursive(meshIndex, firstChild, rayInverse, ray, deferredHit);
+    if(intersectSecond) return intersectRecursive(meshIndex, secondChild, rayInverse, ray, deferredHit);
+    return false;
+}
+
+// Visits the nodes front-to-back with an explicit stack. When both children are hit the nearer one is visited first,
+// and nodes that the ray only enters beyond the closest hit found so far (ray.t) are skipped. intersectLeaf is called
+// for every leaf that is reached; it returns whether it found a hit and then has to lower ray.t.
+template <typename IntersectLeaf>
+static bool traverseStack(const std::vector<BoundingVolumeHierarchy::Node>& nodes, const RayInverse& rayInverse, Ray& ray, const IntersectLeaf& intersectLeaf) {
+    struct StackEntry {
+        uint32_t node;
+        float entry; //Distance at which the ray enters the box of the node
+    };
+    std::array<StackEntry, MaxTraversalDepth> stack;
+    size_t stackSize = 0;
+
+    bool hit = false;
+    stack[stackSize++] = StackEntry { 0, boxEntryDistance(nodes[0], rayInverse, ray.t) };
+    while(stackSize > 0) {
+        const StackEntry current = stack[--stackSize];
+        if(current.entry > ray.t) continue; //A closer hit was found after this node was pushed.
+
+        const BoundingVolumeHierarchy::Node& node = nodes[current.node];
+        currentRayCounters.nodesVisited++;
+        if(node.isLeaf()) {
+            hit |= intersectLeaf(node);
+            continue;
+        }
+
+        StackEntry first { current.node + 1, boxEntryDistance(nodes[current.node + 1], rayInverse, ray.t) };
+        StackEntry second { node.offset, boxEntryDistance(nodes[node.offset], rayInverse, ray.t) };
+        if(second.entry < first.entry) std::swap(first, second);
+
+        //Push the far child first so that the near child is popped (and visited) first.
+        if(second.entry <= ray.t) stack[stackSize++] = second;
+        if(first.entry <= ray.t) stack[stackSize++] = first;
+    }
+    return hit;
+}
+
+// Visits the nodes whose box the ray enters before tMax until anyHitInLeaf returns true for one of the leaves.
+// Any hit will do, so the children are visited in tree order without sorting them by distance.
+template <typename AnyHitInLeaf>
+static bool traverseAnyHit(const std::vector<BoundingVolumeHierarchy::Node>& nodes, const RayInverse& rayInverse, float tMax, const AnyHitInLeaf& anyHitInLeaf) {
+    std::array<uint32_t, MaxTraversalDepth> stack;
+    size_t stackSize = 0;
+    float tEntry, tExit;
+    if(!intersectRayWithBox(nodes[0].lower, nodes[0].upper, rayInverse, tMax, tEntry, tExit)) return false;
+    stack[stackSize++] = 0;
+    while(stackSize > 0) {
+        const uint32_t nodeIndex = stack[--stackSize];
+        const BoundingVolumeHierarchy::Node& node = nodes[nodeIndex];
+        currentRayCounters.nodesVisited++;
+        if(node.isLeaf()) {
+            if(anyHitInLeaf(node)) return true;
+            continue;
+        }
+
+        const uint32_t firstChild = nodeIndex + 1;
+        if(intersectRayWithBox(nodes[node.offset].lower, nodes[node.offset].upper, rayInverse, tMax, tEntry, tExit)) stack[stackSize++] = node.offset;
+        if(intersectRayWithBox(nodes[firstChild].lower, nodes[firstChild].upper, rayInverse, tMax, tEntry, tExit)) stack[stackSize++] = firstChild;
+    }
+    return false;
+}
+
+// Returns child slot child of a wide node as a binary leaf node.
+template <size_t Width>
+static BoundingVolumeHierarchy::Node wideLeaf(const BoundingVolumeHierarchy::WideNode<Width>& node, uint32_t child) {
+    return BoundingVolumeHierarchy::Node {
+        glm::vec3(node.lowerX[child], node.lowerY[child], node.lowerZ[child]), node.offset[child],
+        glm::vec3(node.upperX[child], node.upperY[child], node.upperZ[child]), node.count[child] };
+}
+template <size_t Width>
+static BoundingVolumeHierarchy::Node wideLeaf(const BoundingVolumeHierarchy::CompressedWideNode<Width>& node, uint32_t child) {
+    const AxisAlignedBox box = decodeChildBox(node, child);
+    return BoundingVolumeHierarchy::Node { box.lower, node.offset[child], box.upper, node.count[child] };
+}
+
+template <size_t Width>
+static bool isInnerChild(const BoundingVolumeHierarchy::WideNode<Width>& node, uint32_t child) {
+    return node.count[child] == BoundingVolumeHierarchy::Node::InnerNode;
+}
+template <size_t Width>
+static bool isInnerChild(const BoundingVolumeHierarchy::CompressedWideNode<Width>& node, uint32_t child) {
+    return node.count[child] == BoundingVolumeHierarchy::CompressedWideNode<Width>::InnerChild;
+}
+
+// traverseStack for the collapsed tree: the boxes of all children of a node are tested at once, and the children that
+// are hit are pushed sorted by distance so that the nearest one is visited first. WideNode is either
+// BoundingVolumeHierarchy::WideNode or BoundingVolumeHierarchy::CompressedWideNode.
+template <typename WideNode, typename IntersectLeaf>
+static bool traverseWide(const std::vector<WideNode>& nodes, const RayInverse& rayInverse, Ray& ray, const IntersectLeaf& intersectLeaf) {
+    constexpr size_t Width = std::tuple_size_v<decltype(WideNode::offset)>;
+    struct StackEntry {
+        uint32_t node; //Wide node that holds the child
+        uint32_t child; //Slot of the child in that node
+        float entry; //Distance at which the ray enters the box of the child
+    };
+    //Every level adds at most Width - 1 entries (one entry is popped and up to Width are pushed).
+    std::array<StackEntry, MaxTraversalDepth * Width> stack;
+    size_t stackSize = 0;
+    alignas(32) std::array<float, Width> entries;
+
+    const auto pushChildren = [&](uint32_t nodeIndex) {
+        currentRayCounters.nodesVisited++;
+        const size_t first = stackSize;
+        for(uint32_t mask = intersectRayWithWideNode(nodes[nodeIndex], rayInverse, ray.t, entries.data()); mask != 0; mask &= mask - 1) {
+            const uint32_t child = uint32_t(std::countr_zero(mask));
+            //Insertion sort, farthest child at the bottom. There are at most Width children, so this is cheap.
+            size_t position = stackSize++;
+            while(position > first && stack[position - 1].entry < entries[child]) {
+                stack[position] = stack[position - 1];
+                position--;
+            }
+            stack[position] = StackEntry { nodeIndex, child, entries[child] };
+        }
+    };
+
+    bool hit = false;
+    pushChildren(0);
+    while(stackSize > 0) {
+        const StackEntry current = stack[--stackSize];
+        if(current.entry > ray.t) continue; //A closer hit was found after this child was pushed.
+
+        const WideNode& node = nodes[current.node];
+        if(isInnerChild(node, current.child)) {
+            pushChildren(node.offset[current.child]);
+            continue;
+        }
+        hit |= intersectLeaf(wideLeaf(node, current.child));
+    }
+    return hit;
+}
+
+// traverseAnyHit for the collapsed tree.
+template <typename WideNode, typename AnyHitInLeaf>
+static bool traverseWideAnyHit(const std::vector<WideNode>& nodes, const RayInverse& rayInverse, float tMax, const AnyHitInLeaf& anyHitInLeaf) {
+    constexpr size_t Width = std::tuple_size_v<decltype(WideNode::offset)>;
+    struct StackEntry {
+        uint32_t node;
+        uint32_t child;
+    };
+    std::array<StackEntry, MaxTraversalDepth * Width> stack;
+    size_t stackSize = 0;
+    alignas(32) std::array<float, Width> entries;
+
+    const auto pushChildren = [&](uint32_t nodeIndex) {
+        currentRayCounters.nodesVisited++;
+        for(uint32_t mask = intersectRayWithWideNode(nodes[nodeIndex], rayInverse, tMax, entries.data()); mask != 0; mask &= mask - 1) {
+            stack[stackSize++] = StackEntry { nodeIndex, uint32_t(std::countr_zero(mask)) };
+        }
+    };
+
+    pushChildren(0);
+    while(stackSize > 0) {
+        const StackEntry current = stack[--stackSize];
+        const WideNode& node = nodes[current.node];
+        if(isInnerChild(node, current.child)) {
+            pushChildren(node.offset[current.child]);
+            continue;
+        }
+        if(anyHitInLeaf(wideLeaf(node, current.child))) return true;
+    }
+    return false;
+}
+
+// Front-to-back traversal of whichever nodes the layout uses. Tree is a MeshBvh or the top level.
+template <typename Tree, typename IntersectLeaf>
+static bool traverseLayout(BvhLayout layout, const Tree& tree, const RayInverse& rayInverse, Ray& ray, const IntersectLeaf& intersectLeaf) {
+    switch(layout) {
+    case BvhLayout::Wide4: return traverseWide(tree.wideNodes4, rayInverse, ray, intersectLeaf);
+    case BvhLayout::Wide8: return traverseWide(tree.wideNodes8, rayInverse, ray, intersectLeaf);
+    case BvhLayout::Wide4Compressed: return traverseWide(tree.compressedNodes4, rayInverse, ray, intersectLeaf);
+    case BvhLayout::Wide8Compressed: return traverseWide(tree.compressedNodes8, rayInverse, ray, intersectLeaf);
+    default: return traverseStack(tree.nodes, rayInverse, ray, intersectLeaf);
+    }
+}
+
+// Any-hit traversal of whichever nodes the layout uses.
+template <typename Tree, typename AnyHitInLeaf>
+static bool traverseLayoutAnyHit(BvhLayout layout, const Tree& tree, const RayInverse& rayInverse, float tMax, const AnyHitInLeaf& anyHitInLeaf) {
+    switch(layout) {
+    case BvhLayout::Wide4: return traverseWideAnyHit(tree.wideNodes4, rayInverse, tMax, anyHitInLeaf);
+    case BvhLayout::Wide8: return traverseWideAnyHit(tree.wideNodes8, rayInverse, tMax, anyHitInLeaf);
+    case BvhLayout::Wide4Compressed: return traverseWideAnyHit(tree.compressedNodes4, rayInverse, tMax, anyHitInLeaf);
+    case BvhLayout::Wide8Compressed: return traverseWideAnyHit(tree.compressedNodes8, rayInverse, tMax, anyHitInLeaf);
+    default: return traverseAnyHit(tree.nodes, rayInverse, tMax, anyHitInLeaf);
+    }
+}
+
+// Intersects the tree of one mesh with a ray in the coordinates of that mesh.
+bool BoundingVolumeHierarchy::intersectMesh(size_t meshIndex, Ray& ray, DeferredHit& deferredHit) const {
+    const MeshBvh& meshBvh = meshBvhs[meshIndex];
+    const std::vector<Node>& meshNodes = meshBvh.nodes;
+    const RayInverse rayInverse(ray); //Shared by all box tests of this ray
+    if(settings.layout != BvhLayout::Binary || settings.traversal == BvhTraversal::Stack) {
+        return traverseLayout(settings.layout, meshBvh, rayInverse, ray, [&](const Node& leaf) { return intersectLeaf(meshIndex, leaf, ray, deferredHit); });
+    }
+
+    float tEntry, tExit;
+    if(!intersectRayWithBox(meshNodes[0].lower, meshNodes[0].upper, rayInverse, ray.t, tEntry, tExit)) return false;
+    return intersectRecursive(meshIndex, 0, rayInverse, ray, deferredHit);
+}
+
+// Moves the ray into the coordinates of the mesh of the instance and intersects it there. The direction is transformed
+// but not normalized again, so t means the same in both coordinate systems. resolveHit moves the hit back into world coordinates.
+bool BoundingVolumeHierarchy::intersectInstance(const Instance& instance, Ray& ray, DeferredHit& deferredHit) const {
+    if(!instance.hasTransform) {
+        if(!intersectMesh(instance.meshIndex, ray, deferredHit)) return false;
+        deferredHit.instance = &instance;
+        return true;
+    }
+
+    Ray localRay { glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.0f)), glm::mat3(instance.worldToObject) * ray.direction, ray.t };
+    if(!intersectMesh(instance.meshIndex, localRay, deferredHit)) return false;
+
+    ray.t = localRay.t;
+    deferredHit.instance = &instance;
+    return true;
 }
 
 // Return true if something is hit, returns false otherwise. Only find hits if they are closer than t stored
 // in the ray and if the intersection is on the correct side of the origin (the new t >= 0). Replace the code
 // by a bounding volume hierarchy acceleration structure as described in the assignment. You can change any
 // file you like, including bounding_volume_hierarchy.h.
-bool BoundingVolumeHierarchy::intersect(Ray& ray, HitInfo& hitInfo) const {
-//    bool hit = false;
-//    // Intersect with all triangles of all meshes.
-//    for (const auto& mesh : m_pScene->meshes) {
-//        for (const auto& tri : mesh.triangles) {
-//            const auto v0 = mesh.vertices[tri[0]];
-//            const auto v1 = mesh.vertices[tri[1]];
-//            const auto v2 = mesh.vertices[tri[2]];
-//            if (intersectRayWithTriangle(v0.position, v1.position, v2.position, ray, hitInfo)) {
-//                hitInfo.material = mesh.material;
-//                hit = true;
-//            }
-//        }
-//    }
+bool BoundingVolumeHierarchy::intersect(Ray& ray, HitInfo& hitInfo, RayKind rayKind) const {
+    bool hit = false;
+    const RayInverse rayInverse(ray);
+    if(!shapeBvh.nodes.empty()) {
+        hit |= traverseLayout(settings.layout, shapeBvh, rayInverse, ray, [&](const Node& leaf) { return intersectShapes(leaf, ray, hitInfo); });
+    }
 
+    if(nodes.empty()) {
+        finishRayStatistics(rayKind);
+        return hit;
+    }
+    //The shapes went first, so a triangle that is hit after them is always nearer
+    DeferredHit deferredHit;
+    hit |= traverseLayout(settings.layout, *this, rayInverse, ray, [&](const Node& leaf) {
+        bool leafHit = false;
+        for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count; index++) {
+            leafHit |= intersectInstance(instances[index], ray, deferredHit);
+        }
+        return leafHit;
+    });
+    if(deferredHit.instance) resolveHit(deferredHit, ray, hitInfo);
+    //drawATriangle(hitInfo.finalTriangleVertices[0], hitInfo.finalTriangleVertices[1], hitInfo.finalTriangleVertices[2]); //Marks the final triangle as blue
+
+    finishRayStatistics(rayKind);
+    return hit;
+}
+
+// Tests the ray against the spheres and boxes of a leaf of the shape tree.
+bool BoundingVolumeHierarchy::intersectShapes(const Node& leaf, Ray& ray, HitInfo& hitInfo) const {
     bool hit = false;
+    for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count; index++) {
+        hit |= std::visit([&](const auto& shape) { return intersectRayWithShape(shape, ray, hitInfo); }, shapeBvh.shapes[index]);
+    }
+    if(hit) hitInfo.kd = m_pScene->materials[hitInfo.materialId].kd;
+    return hit;
+}
 
-    // Intersect with spheres.
-    for (const auto& sphere : m_pScene->spheres)
-        hit |= intersectRayWithShape(sphere, ray, hitInfo);
+//Tests the ray against the triangles of a leaf of the mesh until one of them is hit before ray.t.
+static bool occludedLeaf(const BvhSettings& settings, const BoundingVolumeHierarchy::MeshBvh& meshBvh, const BoundingVolumeHierarchy::Node& leaf, const Ray& ray, const WatertightRay* watertightRay) {
+    TriangleHit triangleHit; //Not needed here
+    uint32_t hitIndex; //Not needed either
+    if(settings.triangleTest == TriangleTest::Precomputed4) {
+        currentRayCounters.trianglesTested += leaf.count;
+        return intersectTrianglePackets(meshBvh.trianglePackets4, meshBvh, leaf, ray, hitIndex, triangleHit);
+    }
+    if(settings.triangleTest == TriangleTest::Precomputed8) {
+        currentRayCounters.trianglesTested += leaf.count;
+        return intersectTrianglePackets(meshBvh.trianglePackets8, meshBvh, leaf, ray, hitIndex, triangleHit);
+    }
+    for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count; index++) {
+        currentRayCounters.trianglesTested++;
+        if(intersectTriangle(settings.triangleTest, meshBvh, index, ray, watertightRay, triangleHit)) return true;
+    }
+    return false;
+}
 
-    Ray r = ray; //Send a copy over so it doesn't modify the original ray.t
-    if(!intersectRayWithShape(AxisAlignedBox{nodes.back().lower, nodes.back().upper}, r)) return false;
-    hit |= ::intersect(nodes, nodes.back(), ray, hitInfo, meshIndices, m_pScene->meshes, vertexIndices);
-    //drawATriangle(hitInfo.finalTriangleVertices[0], hitInfo.finalTriangleVertices[1], hitInfo.finalTriangleVertices[2]); //Marks the final triangle as blue
+// Tests the ray against the triangles of the mesh of the instance until one of them is hit before ray.t.
+bool BoundingVolumeHierarchy::occludedInstance(const Instance& instance, const Ray& ray) const {
+    Ray localRay = ray;
+    if(instance.hasTransform) {
+        localRay.origin = glm::vec3(instance.worldToObject * glm::vec4(ray.origin, 1.0f));
+        localRay.direction = glm::mat3(instance.worldToObject) * ray.direction;
+    }
+
+    const MeshBvh& meshBvh = meshBvhs[instance.meshIndex];
+    const RayInverse rayInverse(localRay);
+    const std::optional<WatertightRay> watertightRay = settings.triangleTest == TriangleTest::Watertight ? std::optional(WatertightRay(localRay)) : std::nullopt;
+    return traverseLayoutAnyHit(settings.layout, meshBvh, rayInverse, localRay.t, [&](const Node& leaf) {
+        return occludedLeaf(settings, meshBvh, leaf, localRay, watertightRay ? &*watertightRay : nullptr);
+    });
+}
+
+bool BoundingVolumeHierarchy::occluded(const glm::vec3& origin, const glm::vec3& direction, float tMax) const {
+    const Ray ray { origin, direction, tMax };
+    const RayInverse rayInverse(ray);
+    if(!shapeBvh.nodes.empty()) {
+        const bool hitShape = traverseLayoutAnyHit(settings.layout, shapeBvh, rayInverse, tMax, [&](const Node& leaf) {
+            Ray shapeRay = ray; //The shape tests shorten the ray on a hit
+            HitInfo scratch;
+            return intersectShapes(leaf, shapeRay, scratch);
+        });
+        if(hitShape) {
+            finishRayStatistics(RayKind::Shadow);
+            return true;
+        }
+    }
 
+    if(nodes.empty()) {
+        finishRayStatistics(RayKind::Shadow);
+        return false;
+    }
+    const bool hit = traverseLayoutAnyHit(settings.layout, *this, rayInverse, tMax, [&](const Node& leaf) {
+        for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count; index++) {
+            if(occludedInstance(instances[index], ray)) return true;
+        }
+        return false;
+    });
+    finishRayStatistics(RayKind::Shadow);
     return hit;
 }
+
+// Rays of a packet together with what traversePacket needs for them: the inverse directions for the box tests, and the
+// bounds of all rays for skipping a node for the whole packet at once.
+struct RayPacket {
+    std::span<Ray> rays;
+    std::array<RayInverse, MaxPacketSize> inverses;
+    glm::vec3 originLower, originUpper;
+    glm::vec3 invDirectionLower, invDirectionUpper;
+    glm::bvec3 negative; //Direction signs, the same for all rays
+    float tMax; //Largest ray.t of the rays that are traced
+};
+
+// Index of the lowest ray in a mask of packet rays.
+static uint32_t lowestRay(uint64_t rayMask) {
+    return uint32_t(std::countr_zero(rayMask));
+}
+
+// Sets up the packet for the rays of rayMask. Returns false if their directions do not share their signs (or are
+// parallel to an axis), because the packet then has no bounds that a box could be tested against.
+static bool makeRayPacket(std::span<Ray> rays, uint64_t rayMask, RayPacket& packet) {
+    packet.rays = rays;
+    const uint32_t firstRay = lowestRay(rayMask);
+    packet.originLower = packet.originUpper = rays[firstRay].origin;
+    packet.invDirectionLower = packet.invDirectionUpper = glm::vec3(1.0f) / rays[firstRay].direction;
+    packet.negative = glm::lessThan(packet.invDirectionLower, glm::vec3(0.0f));
+    packet.tMax = 0.0f;
+    for(; rayMask != 0; rayMask &= rayMask - 1) {
+        const uint32_t ray = lowestRay(rayMask);
+        const glm::vec3& direction = rays[ray].direction;
+        if(direction.x == 0.0f || direction.y == 0.0f || direction.z == 0.0f) return false;
+        const RayInverse& rayInverse = packet.inverses[ray] = RayInverse(rays[ray]);
+        if(rayInverse.negative != packet.negative) return false;
+        packet.originLower = glm::min(packet.originLower, rayInverse.origin);
+        packet.originUpper = glm::max(packet.originUpper, rayInverse.origin);
+        packet.invDirectionLower = glm::min(packet.invDirectionLower, rayInverse.invDirection);
+        packet.invDirectionUpper = glm::max(packet.invDirectionUpper, rayInverse.invDirection);
+        packet.tMax = std::max(packet.tMax, rays[ray].t);
+    }
+    return true;
+}
+
+// Interval arithmetic: true if no ray of the packet can hit the box before packet.tMax. Along every axis, each ray
+// reaches the near plane no earlier than the smallest of the 4 products of the extreme distances and inverse
+// directions, and the far plane no later than the largest one. Float rounding keeps that order, so the test never
+// culls a box that one of the rays would hit in intersectRayWithBox.
+static bool packetMissesBox(const RayPacket& packet, const BoundingVolumeHierarchy::Node& node) {
+    float entry = 0.0f;
+    float exit = packet.tMax;
+    for(int axis = 0; axis < 3; axis++) {
+        const float nearPlane = packet.negative[axis] ? node.upper[axis] : node.lower[axis];
+        const float farPlane = packet.negative[axis] ? node.lower[axis] : node.upper[axis];
+        const float nearLower = nearPlane - packet.originUpper[axis], nearUpper = nearPlane - packet.originLower[axis];
+        const float farLower = farPlane - packet.originUpper[axis], farUpper = farPlane - packet.originLower[axis];
+        const float invLower = packet.invDirectionLower[axis], invUpper = packet.invDirectionUpper[axis];
+        entry = std::max(entry, std::min({ nearLower * invLower, nearLower * invUpper, nearUpper * invLower, nearUpper * invUpper }));
+        exit = std::min(exit, std::max({ farLower * invLower, farLower * invUpper, farUpper * invLower, farUpper * invUpper }));
+    }
+    return entry > exit;
+}
+
+// Packet version of traverseStack and traverseAnyHit on the binary nodes (Wald et al., "Ray Tracing Deformable Scenes
+// Using Dynamic Bounding Volume Hierarchies"). A node is visited once for the whole packet: it is skipped if the bounds of
+// the packet miss it, and otherwise tested ray by ray until the first ray that hits it. The rays before that one missed
+// the node, so they are skipped in its whole subtree. leafFunction(leaf, leafRays) is called with the rays of rayMask that
+// hit the box of a leaf, and returns the ones that it found a hit for. With AnyHit those rays are done after that.
+// Returns all rays that leafFunction found a hit for.
+template <bool AnyHit, typename LeafFunction>
+static uint64_t traversePacket(const std::vector<BoundingVolumeHierarchy::Node>& nodes, RayPacket& packet, uint64_t rayMask, const LeafFunction& leafFunction) {
+    struct StackEntry {
+        uint32_t node;
+        uint32_t firstRay; //The rays before this one missed an ancestor of the node
+    };
+    std::array<StackEntry, MaxTraversalDepth> stack;
+    size_t stackSize = 0;
+    if(nodes.empty() || rayMask == 0) return 0;
+
+    const auto hitsBox = [&](const BoundingVolumeHierarchy::Node& node, uint32_t ray) {
+        float tEntry, tExit;
+        return intersectRayWithBox(node.lower, node.upper, packet.inverses[ray], packet.rays[ray].t, tEntry, tExit);
+    };
+
+    uint64_t hitMask = 0;
+    stack[stackSize++] = StackEntry { 0, lowestRay(rayMask) };
+    while(stackSize > 0) {
+        const StackEntry current = stack[--stackSize];
+        const BoundingVolumeHierarchy::Node& node = nodes[current.node];
+        uint64_t candidates = rayMask & (~uint64_t(0) << current.firstRay);
+        //Counted once for every ray that is still active, so that the statistics stay per ray like those of single rays
+        currentRayCounters.nodesVisited += uint64_t(std::popcount(candidates));
+        if(packetMissesBox(packet, node)) continue;
+
+        while(candidates != 0 && !hitsBox(node, lowestRay(candidates))) candidates &= candidates - 1;
+        if(candidates == 0) continue;
+        const uint32_t firstRay = lowestRay(candidates);
+
+        if(node.isLeaf()) {
+            uint64_t leafRays = uint64_t(1) << firstRay;
+            for(uint64_t rest = candidates & (candidates - 1); rest != 0; rest &= rest - 1) {
+                if(hitsBox(node, lowestRay(rest))) leafRays |= rest & (~rest + 1);
+            }
+            const uint64_t leafHits = leafFunction(node, leafRays);
+            hitMask |= leafHits;
+            if constexpr(AnyHit) {
+                rayMask &= ~leafHits;
+                if(rayMask == 0) break;
+            } else if(leafHits != 0) {
+                //The rays that hit something got shorter, which may let the bounds of the packet cull more nodes
+                packet.tMax = 0.0f;
+                for(uint64_t rest = rayMask; rest != 0; rest &= rest - 1) packet.tMax = std::max(packet.tMax, packet.rays[lowestRay(rest)].t);
+            }
+            continue;
+        }
+
+        //Near child first, by the direction sign that all rays share on the axis along which the children lie furthest apart
+        const uint32_t left = current.node + 1;
+        const uint32_t right = node.offset;
+        const glm::vec3 separation = (nodes[right].lower + nodes[right].upper) - (nodes[left].lower + nodes[left].upper);
+        const glm::vec3 distance = glm::abs(separation);
+        const int axis = distance.x > distance.y ? (distance.x > distance.z ? 0 : 2) : (distance.y > distance.z ? 1 : 2);
+        const bool rightFirst = packet.negative[axis] ? separation[axis] > 0.0f : separation[axis] < 0.0f;
+        stack[stackSize++] = StackEntry { rightFirst ? left : right, firstRay };
+        stack[stackSize++] = StackEntry { rightFirst ? right : left, firstRay };
+    }
+    return hitMask;
+}
+
+static uint64_t packetMask(size_t numRays) {
+    return numRays == MaxPacketSize ? ~uint64_t(0) : (uint64_t(1) << numRays) - 1;
+}
+
+// Packet version of intersectInstance: returns the rays of rayMask that hit the mesh of the instance before their ray.t.
+uint64_t BoundingVolumeHierarchy::intersectInstancePacket(const Instance& instance, RayPacket& packet, uint64_t rayMask, std::span<DeferredHit> deferredHits) const {
+    const MeshBvh& meshBvh = meshBvhs[instance.meshIndex];
+    const auto meshLeaf = [&](RayPacket& meshPacket) {
+        return [&](const Node& leaf, uint64_t leafRays) {
+            uint64_t leafHits = 0;
+            for(; leafRays != 0; leafRays &= leafRays - 1) {
+                const uint32_t ray = lowestRay(leafRays);
+                if(intersectLeaf(instance.meshIndex, leaf, meshPacket.rays[ray], deferredHits[ray])) leafHits |= uint64_t(1) << ray;
+            }
+            return leafHits;
+        };
+    };
+    if(!instance.hasTransform) {
+        const uint64_t hitMask = traversePacket<false>(meshBvh.nodes, packet, rayMask, meshLeaf(packet));
+        for(uint64_t rest = hitMask; rest != 0; rest &= rest - 1) deferredHits[lowestRay(rest)].instance = &instance;
+        return hitMask;
+    }
+
+    //The transform can break up the shared direction signs, then every ray goes on its own
+    std::array<Ray, MaxPacketSize> localRays;
+    for(uint64_t rest = rayMask; rest != 0; rest &= rest - 1) {
+        const uint32_t ray = lowestRay(rest);
+        localRays[ray] = Ray { glm::vec3(instance.worldToObject * glm::vec4(packet.rays[ray].origin, 1.0f)), glm::mat3(instance.worldToObject) * packet.rays[ray].direction, packet.rays[ray].t };
+    }
+    RayPacket localPacket;
+    uint64_t hitMask = 0;
+    if(makeRayPacket(std::span(localRays.data(), packet.rays.size()), rayMask, localPacket)) {
+        hitMask = traversePacket<false>(meshBvh.nodes, localPacket, rayMask, meshLeaf(localPacket));
+    } else {
+        for(uint64_t rest = rayMask; rest != 0; rest &= rest - 1) {
+            const uint32_t ray = lowestRay(rest);
+            if(intersectMesh(instance.meshIndex, localRays[ray], deferredHits[ray])) hitMask |= uint64_t(1) << ray;
+        }
+    }
+
+    for(uint64_t rest = hitMask; rest != 0; rest &= rest - 1) {
+        const uint32_t ray = lowestRay(rest);
+        packet.rays[ray].t = localRays[ray].t;
+        deferredHits[ray].instance = &instance;
+    }
+    return hitMask;
+}
+
+// Packet version of occludedInstance: returns the rays of rayMask that hit the mesh of the instance before their ray.t.
+uint64_t BoundingVolumeHierarchy::occludedInstancePacket(const Instance& instance, RayPacket& packet, uint64_t rayMask) const {
+    const MeshBvh& meshBvh = meshBvhs[instance.meshIndex];
+    const auto meshLeaf = [&](const RayPacket& meshPacket) {
+        return [&](const Node& leaf, uint64_t leafRays) {
+            uint64_t leafHits = 0;
+            for(; leafRays != 0; leafRays &= leafRays - 1) {
+                const uint32_t ray = lowestRay(leafRays);
+                const Ray& localRay = meshPacket.rays[ray];
+                const std::optional<WatertightRay> watertightRay = settings.triangleTest == TriangleTest::Watertight ? std::optional(WatertightRay(localRay)) : std::nullopt;
+                if(occludedLeaf(settings, meshBvh, leaf, localRay, watertightRay ? &*watertightRay : nullptr)) leafHits |= uint64_t(1) << ray;
+            }
+            return leafHits;
+        };
+    };
+    if(!instance.hasTransform) return traversePacket<true>(meshBvh.nodes, packet, rayMask, meshLeaf(packet));
+
+    std::array<Ray, MaxPacketSize> localRays;
+    for(uint64_t rest = rayMask; rest != 0; rest &= rest - 1) {
+        const uint32_t ray = lowestRay(rest);
+        localRays[ray] = Ray { glm::vec3(instance.worldToObject * glm::vec4(packet.rays[ray].origin, 1.0f)), glm::mat3(instance.worldToObject) * packet.rays[ray].direction, packet.rays[ray].t };
+    }
+    RayPacket localPacket;
+    if(makeRayPacket(std::span(localRays.data(), packet.rays.size()), rayMask, localPacket)) return traversePacket<true>(meshBvh.nodes, localPacket, rayMask, meshLeaf(localPacket));
+
+    uint64_t hitMask = 0;
+    for(uint64_t rest = rayMask; rest != 0; rest &= rest - 1) {
+        const uint32_t ray = lowestRay(rest);
+        if(occludedInstance(instance, packet.rays[ray])) hitMask |= uint64_t(1) << ray;
+    }
+    return hitMask;
+}
+
+void BoundingVolumeHierarchy::intersectPacket(std::span<Ray> rays, std::span<HitInfo> hitInfos, std::span<bool> hits, RayKind rayKind) const {
+    const uint64_t allRays = packetMask(rays.size());
+    RayPacket packet;
+    if(rays.empty() || rays.size() > MaxPacketSize || !makeRayPacket(rays, allRays, packet)) {
+        //Too incoherent (or too large) to share the traversal, so every ray goes on its own
+        for(size_t i = 0; i < rays.size(); i++) hits[i] = intersect(rays[i], hitInfos[i], rayKind);
+        return;
+    }
+
+    uint64_t hitMask = traversePacket<false>(shapeBvh.nodes, packet, allRays, [&](const Node& leaf, uint64_t leafRays) {
+        uint64_t leafHits = 0;
+        for(; leafRays != 0; leafRays &= leafRays - 1) {
+            const uint32_t ray = lowestRay(leafRays);
+            if(intersectShapes(leaf, rays[ray], hitInfos[ray])) leafHits |= uint64_t(1) << ray;
+        }
+        return leafHits;
+    });
+    std::array<DeferredHit, MaxPacketSize> deferredHits;
+    hitMask |= traversePacket<false>(nodes, packet, allRays, [&](const Node& leaf, uint64_t leafRays) {
+        uint64_t leafHits = 0;
+        for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count; index++) {
+            leafHits |= intersectInstancePacket(instances[index], packet, leafRays, deferredHits);
+        }
+        return leafHits;
+    });
+    for(size_t i = 0; i < rays.size(); i++) {
+        hits[i] = (hitMask >> i & 1) != 0;
+        if(deferredHits[i].instance) resolveHit(deferredHits[i], rays[i], hitInfos[i]);
+    }
+    finishRayStatistics(rayKind, rays.size());
+}
+
+void BoundingVolumeHierarchy::occludedPacket(std::span<const Ray> rays, std::span<bool> isOccluded) const {
+    const uint64_t allRays = packetMask(rays.size());
+    thread_local std::array<Ray, MaxPacketSize> packetRays; //The traversal needs rays that it could shorten, though an any-hit traversal never does
+    RayPacket packet;
+    if(!rays.empty() && rays.size() <= MaxPacketSize) std::copy(rays.begin(), rays.end(), packetRays.begin());
+    if(rays.empty() || rays.size() > MaxPacketSize || !makeRayPacket(std::span(packetRays.data(), rays.size()), allRays, packet)) {
+        for(size_t i = 0; i < rays.size(); i++) isOccluded[i] = occluded(rays[i].origin, rays[i].direction, rays[i].t);
+        return;
+    }
+
+    uint64_t occludedMask = traversePacket<true>(shapeBvh.nodes, packet, allRays, [&](const Node& leaf, uint64_t leafRays) {
+        uint64_t leafHits = 0;
+        for(; leafRays != 0; leafRays &= leafRays - 1) {
+            const uint32_t ray = lowestRay(leafRays);
+            Ray shapeRay = packet.rays[ray]; //The shape tests shorten the ray on a hit
+            HitInfo scratch;
+            if(intersectShapes(leaf, shapeRay, scratch)) leafHits |= uint64_t(1) << ray;
+        }
+        return leafHits;
+    });
+    occludedMask |= traversePacket<true>(nodes, packet, allRays & ~occludedMask, [&](const Node& leaf, uint64_t leafRays) {
+        uint64_t leafHits = 0;
+        for(uint32_t index = leaf.offset; index < leaf.offset + leaf.count && leafHits != leafRays; index++) {
+            leafHits |= occludedInstancePacket(instances[index], packet, leafRays & ~leafHits);
+        }
+        return leafHits;
+    });
+    for(size_t i = 0; i < rays.size(); i++) isOccluded[i] = (occludedMask >> i & 1) != 0;
+    finishRayStatistics(RayKind::Shadow, rays.size());
+}
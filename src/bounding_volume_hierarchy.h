@@ -2,38 +2,273 @@
 #include "ray_tracing.h"
 #include "scene.h"
 #include <array>
+#include <cstdint>
+#include <filesystem>
 #include <span>
+#include <variant>
 #include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+
+enum class BvhBuilder {
+    Median, // Splits at the median triangle, alternating the axis per level.
+    BinnedSAH, // Picks the axis and split plane with the lowest surface area heuristic cost.
+    SpatialSplitSAH, // BinnedSAH that may also split triangles between both children where that lowers the cost (SBVH).
+    Linear // Sorts the triangles along a Morton curve and splits where the codes differ (LBVH). Fastest to build, but a worse tree.
+};
+
+enum class BvhTraversal {
+    Recursive, // Visits both children when both boxes are hit, in a fixed order.
+    Stack // Iterative, visits the nearer child first and skips nodes beyond the closest hit.
+};
+
+enum class BvhLayout {
+    Binary, // The built tree as it is, with two children per node.
+    Wide4, // Collapsed into nodes with up to 4 children, whose boxes are tested together with SSE.
+    Wide8, // Collapsed into nodes with up to 8 children, whose boxes are tested together with AVX2. Needs a CPU that supports AVX2.
+    WidestSupported, // Wide8 if the CPU supports AVX2, otherwise Wide4.
+    Wide4Compressed, // Wide4 with the child boxes quantized to 8 bits per coordinate, about half the size. The binary nodes are kept as well.
+    Wide8Compressed // Wide8 with the child boxes quantized to 8 bits per coordinate. Falls back to Wide4Compressed without AVX2.
+};
+
+enum class TriangleTest {
+    Original, // Intersects the plane of the triangle and then checks whether the point lies inside it.
+    Precomputed, // Möller–Trumbore on edges that are computed once with the tree (MeshBvh::triangleRecords).
+    Watertight, // Never lets a ray slip between two triangles that share an edge, at a slightly higher cost.
+    Precomputed4, // Precomputed on 4 triangles of a leaf at once with SSE (MeshBvh::trianglePackets4). Same hits as Precomputed.
+    Precomputed8 // Precomputed on 8 triangles of a leaf at once with AVX2. Falls back to Precomputed4 without AVX2.
+};
+
+// Kind of a traced ray. Only used to keep the traversal statistics of the different kinds apart.
+enum class RayKind {
+    Primary,
+    Shadow,
+    Reflection
+};
+
+// Work done by the traversal, summed over all rays of every kind (indexed by RayKind).
+struct TraversalStatistics {
+    struct Counters {
+        uint64_t numRays = 0;
+        uint64_t nodesVisited = 0; // Binary nodes, or wide nodes whose children were tested together. A packet visit counts for every active ray.
+        uint64_t trianglesTested = 0;
+    };
+    std::array<Counters, 3> rays;
+};
+
+// Traversal keeps one stack entry per level, so trees are never built deeper than this.
+constexpr int MaxTraversalDepth = 64;
+
+// Largest number of rays that BoundingVolumeHierarchy::intersectPacket and occludedPacket trace together (an 8x8 tile).
+constexpr size_t MaxPacketSize = 64;
+struct RayPacket; // Only used inside bounding_volume_hierarchy.cpp
+
+struct BvhSettings {
+    BvhBuilder builder = BvhBuilder::BinnedSAH;
+    BvhTraversal traversal = BvhTraversal::Stack; // Only used by the binary layout.
+    BvhLayout layout = BvhLayout::WidestSupported;
+    TriangleTest triangleTest = TriangleTest::Precomputed4;
+    int maxLevels = 32; // Upper bound on the number of levels in the tree (the root is level 0).
+    int maxLeafSize = 4; // Nodes with this many triangles or fewer always become leaves.
+    int numBins = 16; // Number of centroid bins per axis that the SAH builder evaluates.
+    float traversalCost = 1.0f; // SAH cost of visiting an inner node, relative to one triangle test.
+    float intersectionCost = 1.0f; // SAH cost of one ray/triangle test.
+    float maxDuplication = 0.3f; // SpatialSplitSAH adds at most this fraction of the number of triangles as extra triangle references.
+    bool optimizeTreelets = false; // Restructure the treelets of every mesh tree after the build for a lower SAH cost, see optimizeTreelets.
+    int treeletSize = 7; // Number of leaves of the treelets that optimizeTreelets restructures, at most MaxTreeletSize.
+    float rebuildCostRatio = 1.5f; // update() rebuilds instead of refitting once the SAH cost grew by this factor since the last build.
+    std::filesystem::path cacheDirectory; // Built trees are stored here and reused for the same geometry and settings. Empty disables the cache.
+};
+
+// Two-level hierarchy: every mesh of the scene gets its own tree over its triangles (the bottom level, in the coordinates
+// of the mesh), and one tree over all placed instances of the meshes (the top level, in world coordinates). Geometry that
+// is placed many times is stored and built only once, and moving instances only requires rebuilding the small top level.
 class BoundingVolumeHierarchy {
 public:
-    BoundingVolumeHierarchy(Scene* pScene);
+    BoundingVolumeHierarchy(Scene* pScene, const BvhSettings& settings = {});
+
+    // Nodes are stored depth-first: the first child of an inner node directly follows it in the array and the root is nodes[0].
+    // Two nodes fit in a 64 byte cache line and none of them own any heap memory.
+    struct alignas(32) Node {
+        static constexpr uint32_t InnerNode = 0xFFFFFFFF;
 
-    struct Node {
-        bool isLeaf;
-        std::vector<int> indices;
         glm::vec3 lower; //Lower coordinate of the AABB
+        uint32_t offset; //Leaf: index of the first triangle (or instance). Inner node: index of the second child.
         glm::vec3 upper; //Upper coordinate of the AABB
+        uint32_t count; //Leaf: number of triangles (or instances). Inner node: InnerNode.
+
+        bool isLeaf() const { return count != InnerNode; }
+    };
+    static_assert(sizeof(Node) == 32);
+
+    // Node of the tree collapsed to up to Width children per node. The boxes of the children are stored per coordinate
+    // (structure of arrays), so that a single SIMD instruction handles the same coordinate of all children.
+    // Unused child slots have an empty box (lower = +infinity, upper = -infinity) that no ray can hit.
+    template <size_t Width>
+    struct alignas(64) WideNode {
+        std::array<float, Width> lowerX, lowerY, lowerZ;
+        std::array<float, Width> upperX, upperY, upperZ;
+        std::array<uint32_t, Width> offset; // Leaf child: index of the first triangle (or instance). Inner child: index of its wide node.
+        std::array<uint32_t, Width> count; // Leaf child: number of triangles (or instances). Inner child: Node::InnerNode. Unused: 0.
     };
-    std::vector<Node> nodes;
-    int maxDepth; // Depth of the tree. The root starts at 0
 
-    std::vector<glm::mat3> allTriangles; //A triangle has 3 vertices and each vertex has xyz coordinates -> a 3x3 matrix
-    std::vector<int> meshIndices; //The i'th position corresponds to triangle i and the value at the i'th position is the mesh index.
-    std::vector<std::vector<Vertex>> vertexIndices; //The i'th position corresponds to triangle i with the 3 vertices
+    // WideNode with the child boxes stored as 8-bit coordinates on a grid of 255 cells per axis over the box of the node,
+    // which is about half the size. The child boxes are rounded outwards to the grid, so they always contain the
+    // exact boxes and traversal can never miss a hit, it only visits a child a bit more often.
+    // Unused child slots have lower = 255 and upper = 0.
+    template <size_t Width>
+    struct CompressedWideNode {
+        static constexpr uint8_t InnerChild = 255;
+        static constexpr uint32_t MaxLeafCount = 254;
+
+        glm::vec3 origin; // Grid coordinate q stands for origin + q * scale
+        glm::vec3 scale;
+        std::array<uint8_t, Width> lowerX, lowerY, lowerZ;
+        std::array<uint8_t, Width> upperX, upperY, upperZ;
+        std::array<uint32_t, Width> offset; // Same as WideNode::offset
+        std::array<uint8_t, Width> count; // Leaf child: number of triangles (or instances), at most MaxLeafCount. Inner child: InnerChild. Unused: 0.
+    };
+
+    // Triangles of one leaf stored per coordinate, so that a single SIMD instruction handles Width triangles. Lane i holds
+    // triangle firstTriangle + i (v0 and the edges of its TriangleRecord). A leaf with more triangles than Width is
+    // spread over several consecutive packets. Unused lanes are zero, which no ray can hit.
+    template <size_t Width>
+    struct alignas(32) TrianglePacket {
+        std::array<float, Width> v0X, v0Y, v0Z;
+        std::array<float, Width> edge1X, edge1Y, edge1Z;
+        std::array<float, Width> edge2X, edge2Y, edge2Z;
+        uint32_t firstTriangle;
+        uint32_t count; // Number of used lanes
+    };
+
+    // Bottom level: the tree over the triangles of one mesh.
+    struct MeshBvh {
+        std::vector<Node> nodes;
+        std::vector<WideNode<4>> wideNodes4; // nodes collapsed for BvhLayout::Wide4, empty for the other layouts
+        std::vector<WideNode<8>> wideNodes8; // nodes collapsed for BvhLayout::Wide8, empty for the other layouts
+        std::vector<CompressedWideNode<4>> compressedNodes4; // nodes collapsed for BvhLayout::Wide4Compressed, empty for the other layouts
+        std::vector<CompressedWideNode<8>> compressedNodes8; // nodes collapsed for BvhLayout::Wide8Compressed, empty for the other layouts
+        int maxDepth = 0; // Number of levels in the tree. The root starts at 0
+        float builtSahCost = 0.0f; // SAH cost right after the tree was built, used by update() to detect degradation
+        bool loadedFromCache = false; // True if the tree was read from settings.cacheDirectory instead of being built
+        size_t numMeshTriangles = 0; // Number of triangles of the mesh, which can be less than triangles.size() with spatial splits
+
+        // The triangle arrays below are sorted in BVH order, so the triangles of a leaf are the range [offset, offset + count).
+        // With BvhBuilder::SpatialSplitSAH a triangle can be stored more than once, once for every leaf that references it.
+        std::vector<glm::mat3> triangles; //A triangle has 3 vertices and each vertex has xyz coordinates -> a 3x3 matrix
+        std::vector<std::array<Vertex, 3>> triangleVertices; //The i'th position corresponds to triangle i with the 3 vertices
+        std::vector<int> meshTriangleIndices; //Index of triangle i in the triangle list of the mesh, used to refit from the scene.
+        std::vector<TriangleRecord> triangleRecords; // Built from triangles for TriangleTest::Precomputed, empty for the other tests
+        std::vector<TrianglePacket<4>> trianglePackets4; // Built from triangles for TriangleTest::Precomputed4, empty for the other tests
+        std::vector<TrianglePacket<8>> trianglePackets8; // Built from triangles for TriangleTest::Precomputed8, empty for the other tests
+        std::vector<uint32_t> trianglePacketIndices; // Packet that holds triangle i, if there are packets
+    };
+
+    // Top level: one placement of a mesh.
+    struct Instance {
+        uint32_t meshIndex;
+        bool hasTransform; // False if the instance is not transformed at all, then rays can be used as they are.
+        glm::mat4 objectToWorld;
+        glm::mat4 worldToObject;
+        glm::mat3 normalToWorld; // Inverse transpose of objectToWorld, for normals
+    };
+
+    // Nearest triangle hit found so far while a ray traverses the trees: only what is needed to look up the shading
+    // attributes (normal, material, texture) once the traversal is done, so that the candidates that a nearer hit
+    // replaces later on cost nothing beyond the triangle test. The distance is ray.t.
+    struct DeferredHit {
+        const Instance* instance = nullptr; // nullptr while no triangle was hit
+        uint32_t triangle; // Index into the triangle arrays of the tree of instance->meshIndex
+        float u, v; // Barycentric weights of the second and third vertex, not computed yet by TriangleTest::Original
+    };
+
+    // The analytic shapes of the scene (Scene::spheres and Scene::boxes) have a tree of their own, in world coordinates,
+    // which rays traverse next to the top level tree.
+    struct ShapeBvh {
+        std::vector<Node> nodes; // Its leaves reference ranges of shapes
+        std::vector<WideNode<4>> wideNodes4; // nodes collapsed for BvhLayout::Wide4, empty for the other layouts
+        std::vector<WideNode<8>> wideNodes8; // nodes collapsed for BvhLayout::Wide8, empty for the other layouts
+        std::vector<CompressedWideNode<4>> compressedNodes4; // nodes collapsed for BvhLayout::Wide4Compressed, empty for the other layouts
+        std::vector<CompressedWideNode<8>> compressedNodes8; // nodes collapsed for BvhLayout::Wide8Compressed, empty for the other layouts
+        std::vector<std::variant<Sphere, Box>> shapes; // Copies of the shapes of the scene, sorted in BVH order
+        int maxDepth = 0; // Number of levels in the tree. The root starts at 0
+    };
+
+    std::vector<Node> nodes; // Top level tree, its leaves reference ranges of instances
+    std::vector<WideNode<4>> wideNodes4; // Top level collapsed for BvhLayout::Wide4
+    std::vector<WideNode<8>> wideNodes8; // Top level collapsed for BvhLayout::Wide8
+    std::vector<CompressedWideNode<4>> compressedNodes4; // Top level collapsed for BvhLayout::Wide4Compressed
+    std::vector<CompressedWideNode<8>> compressedNodes8; // Top level collapsed for BvhLayout::Wide8Compressed
+    std::vector<Instance> instances; // Sorted in top level BVH order
+    std::vector<MeshBvh> meshBvhs; // Bottom level trees, with the same index as the mesh in Scene::meshes
+    ShapeBvh shapeBvh;
+    int maxDepth; // Number of levels in the top level tree. The root starts at 0
+    bool loadedFromCache = false; // True if every bottom level tree was read from settings.cacheDirectory
+    BvhSettings settings; // settings.layout is never WidestSupported, the constructor replaces it by the layout that is used
 
     // Implement these two functions for the Visual Debug.
     // The first function should return how many levels there are in the tree that you have constructed.
     // The second function should draw the bounding boxes of the nodes at the selected level.
+    // The levels of the top level tree come first, followed by the levels of the bottom level trees.
     int numLevels() const;
     void debugDraw(int level);
 
     // Return true if something is hit, returns false otherwise.
     // Only find hits if they are closer than t stored in the ray and the intersection
     // is on the correct side of the origin (the new t >= 0).
-    bool intersect(Ray& ray, HitInfo& hitInfo) const;
+    // The work is counted towards rayKind in the traversal statistics.
+    bool intersect(Ray& ray, HitInfo& hitInfo, RayKind rayKind = RayKind::Primary) const;
+
+    // Returns true if anything is hit between origin and origin + tMax * direction. Stops at the first hit found
+    // and does not compute any hit information, which makes it much cheaper than intersect for shadow rays.
+    // The work is counted towards RayKind::Shadow in the traversal statistics.
+    bool occluded(const glm::vec3& origin, const glm::vec3& direction, float tMax) const;
+
+    // Traces up to MaxPacketSize coherent rays together, such as the primary rays of a 2x2, 4x4 or 8x8 tile of pixels.
+    // Every node is visited once for the whole packet: it is skipped for all rays at once if the bounds of the packet
+    // (interval arithmetic over the origins and directions) miss its box, and otherwise only tested for the rays from the
+    // first one that hits it. Packets whose directions do not share their signs are traced one ray at a time. Gives the
+    // same hits as intersect, on the binary nodes whatever the layout. hits[i] tells whether rays[i] hit anything.
+    void intersectPacket(std::span<Ray> rays, std::span<HitInfo> hitInfos, std::span<bool> hits, RayKind rayKind = RayKind::Primary) const;
 
+    // occluded for a packet of rays, each up to its own ray.t. Meant for the shadow rays of the hits of a packet toward one light.
+    void occludedPacket(std::span<const Ray> rays, std::span<bool> isOccluded) const;
 
+    // Traversal work of all rays traced by any hierarchy on any thread since the last reset. Every thread counts into its
+    // own counters, so only call these while no rays are being traced (e.g. before and after a render). The nodes that
+    // a packet visits are counted once for the whole packet.
+    static TraversalStatistics traversalStatistics();
+    static void resetTraversalStatistics();
+
+    // Recomputes all boxes bottom-up from the current vertex positions in the scene, without changing the bottom level trees
+    // themselves, and rebuilds the top level. Much cheaper than a rebuild, but the trees get worse as the geometry moves away
+    // from the state it was built for. The meshes and their triangle lists must be the same as when the trees were built.
+    void refit();
+
+    // Rebuilds only the top level tree from the current Scene::instances, and the tree over the spheres and boxes of the
+    // scene. Use this after moving instances or shapes around.
+    void rebuildTopLevel();
+
+    // Sum of the expected costs of a random ray through each bottom level tree according to the surface area heuristic,
+    // in units of one triangle test.
+    float sahCost() const;
+
+    // Brings the hierarchy up to date after vertices or instances of the scene moved. Every bottom level tree is refitted,
+    // or rebuilt if the triangles of its mesh changed or if refitting made its SAH cost more than settings.rebuildCostRatio
+    // times the cost of its last build. The top level is always rebuilt. Returns true if any bottom level tree was rebuilt.
+    bool update();
 
 private:
+    void refitMesh(size_t meshIndex);
+    bool intersectInstance(const Instance& instance, Ray& ray, DeferredHit& deferredHit) const;
+    bool intersectMesh(size_t meshIndex, Ray& ray, DeferredHit& deferredHit) const;
+    bool intersectLeaf(size_t meshIndex, const Node& leaf, Ray& ray, DeferredHit& deferredHit) const;
+    bool intersectRecursive(size_t meshIndex, size_t rootIndex, const RayInverse& rayInverse, Ray& ray, DeferredHit& deferredHit) const;
+    void resolveHit(const DeferredHit& deferredHit, const Ray& ray, HitInfo& hitInfo) const;
+    bool occludedInstance(const Instance& instance, const Ray& ray) const;
+    void rebuildShapes();
+    bool intersectShapes(const Node& leaf, Ray& ray, HitInfo& hitInfo) const;
+    uint64_t intersectInstancePacket(const Instance& instance, RayPacket& packet, uint64_t rayMask, std::span<DeferredHit> deferredHits) const;
+    uint64_t occludedInstancePacket(const Instance& instance, RayPacket& packet, uint64_t rayMask) const;
+
     Scene* m_pScene;
 };
@@ -0,0 +1,212 @@
+#include "bvh_cache.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <span>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+// Bump this whenever the node layout, the builders or the file layout change, so that old files are rebuilt.
+static constexpr uint32_t CacheVersion = 5;
+static constexpr std::array<char, 8> CacheMagic { 'C', 'G', 'B', 'V', 'H', 'C', 'A', 'C' };
+
+// Fixed size header at the start of every cache file, followed by the nodes and then the triangle order (one entry per reference).
+struct CacheHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t key;
+    uint64_t numNodes;
+    uint64_t numTriangles;
+    uint64_t numReferences; // Larger than numTriangles if spatial splits duplicated triangles
+    int32_t maxDepth;
+    uint32_t unused;
+    uint64_t checksum; // Of the nodes and the triangle order
+};
+
+// 64-bit FNV-1a, continued from hash.
+static uint64_t hashBytes(std::span<const std::byte> bytes, uint64_t hash = 14695981039346656037ull)
+{
+    for (std::byte byte : bytes) {
+        hash ^= uint64_t(byte);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename T>
+static uint64_t hashValues(std::span<const T> values, uint64_t hash)
+{
+    return hashBytes(std::as_bytes(values), hash);
+}
+
+template <typename T>
+static uint64_t hashValue(const T& value, uint64_t hash)
+{
+    return hashValues(std::span<const T>(&value, 1), hash);
+}
+
+uint64_t bvhCacheKey(const Mesh& mesh, const BvhSettings& settings)
+{
+    uint64_t hash = hashValue(CacheVersion, 14695981039346656037ull);
+    hash = hashValue(settings.builder, hash);
+    hash = hashValue(settings.maxLevels, hash);
+    hash = hashValue(settings.maxLeafSize, hash);
+    hash = hashValue(settings.numBins, hash);
+    hash = hashValue(settings.traversalCost, hash);
+    hash = hashValue(settings.intersectionCost, hash);
+    hash = hashValue(settings.maxDuplication, hash);
+    hash = hashValue(settings.optimizeTreelets, hash);
+    hash = hashValue(settings.treeletSize, hash);
+    // Only the positions and the triangles determine the tree; normals, texture coordinates and materials do not.
+    hash = hashValue(mesh.vertices.size(), hash);
+    for (const Vertex& vertex : mesh.vertices)
+        hash = hashValue(vertex.position, hash);
+    hash = hashValue(mesh.triangles.size(), hash);
+    hash = hashValues(std::span(mesh.triangles), hash);
+    return hash;
+}
+
+std::filesystem::path bvhCacheFile(const std::filesystem::path& cacheDirectory, uint64_t key)
+{
+    std::ostringstream fileName;
+    fileName << "bvh_" << std::hex << key << ".bin";
+    return cacheDirectory / fileName.str();
+}
+
+static uint64_t payloadChecksum(const std::vector<BoundingVolumeHierarchy::Node>& nodes, const std::vector<int>& triangleOrder)
+{
+    return hashValues(std::span(triangleOrder), hashValues(std::span(nodes), 14695981039346656037ull));
+}
+
+// Makes sure that traversing the tree cannot read outside of the node and triangle arrays or overflow the traversal
+// stack: walking from the root reaches every node exactly once, and the tree has exactly entry.maxDepth levels.
+static bool isValidTree(const BvhCacheEntry& entry, size_t numTriangles)
+{
+    const size_t numNodes = entry.nodes.size();
+    const size_t numReferences = entry.triangleOrder.size();
+    if (numNodes == 0 || entry.maxDepth < 1 || entry.maxDepth > MaxTraversalDepth)
+        return false;
+
+    std::vector<bool> reached(numNodes, false);
+    size_t numReached = 0;
+    int numLevels = 0;
+    std::vector<std::pair<size_t, int>> stack { { 0, 0 } }; // Node index and depth, the root is at depth 0
+    while (!stack.empty()) {
+        const auto [nodeIndex, depth] = stack.back();
+        stack.pop_back();
+        // A node with two parents would be traversed twice, and refit assumes that every node has a single parent.
+        if (depth >= entry.maxDepth || reached[nodeIndex])
+            return false;
+        reached[nodeIndex] = true;
+        numReached++;
+        numLevels = std::max(numLevels, depth + 1);
+
+        const BoundingVolumeHierarchy::Node& node = entry.nodes[nodeIndex];
+        if (node.isLeaf()) {
+            if (size_t(node.offset) + size_t(node.count) > numReferences)
+                return false;
+            continue;
+        }
+        if (nodeIndex + 1 >= numNodes || node.offset <= nodeIndex || node.offset >= numNodes)
+            return false;
+        stack.push_back({ node.offset, depth + 1 });
+        stack.push_back({ nodeIndex + 1, depth + 1 });
+    }
+    // Refit goes over the whole node array, so nodes that the root does not reach are not allowed either.
+    if (numReached != numNodes || numLevels != entry.maxDepth)
+        return false;
+
+    // Every triangle has to be referenced at least once. Spatial splits reference some triangles from several leaves, so
+    // the order does not have to be a permutation.
+    std::vector<bool> seen(numTriangles, false);
+    for (int index : entry.triangleOrder) {
+        if (index < 0 || size_t(index) >= numTriangles)
+            return false;
+        seen[size_t(index)] = true;
+    }
+    return std::find(seen.begin(), seen.end(), false) == seen.end();
+}
+
+std::optional<BvhCacheEntry> readBvhCache(const std::filesystem::path& file, uint64_t key, size_t numTriangles)
+{
+    std::error_code error;
+    const uintmax_t fileSize = std::filesystem::file_size(file, error);
+    if (error)
+        return {}; // No cached tree yet.
+
+    std::ifstream stream { file, std::ios::binary };
+    CacheHeader header;
+    if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != CacheMagic || header.version != CacheVersion || header.nodeSize != sizeof(BoundingVolumeHierarchy::Node)) {
+        std::cerr << "Ignoring BVH cache " << file << ": written by another version" << std::endl;
+        return {};
+    }
+    if (header.key != key || header.numTriangles != numTriangles) {
+        std::cerr << "Ignoring BVH cache " << file << ": it belongs to another mesh" << std::endl;
+        return {};
+    }
+    // Check the size before allocating anything, a damaged header could claim an enormous number of nodes.
+    const uintmax_t expectedSize = sizeof(CacheHeader) + header.numNodes * sizeof(BoundingVolumeHierarchy::Node) + header.numReferences * sizeof(int);
+    if (header.numNodes > fileSize || header.numReferences > fileSize || fileSize != expectedSize) {
+        std::cerr << "Ignoring BVH cache " << file << ": the file is truncated or damaged" << std::endl;
+        return {};
+    }
+
+    BvhCacheEntry entry;
+    entry.nodes.resize(header.numNodes);
+    entry.triangleOrder.resize(header.numReferences);
+    entry.maxDepth = header.maxDepth;
+    stream.read(reinterpret_cast<char*>(entry.nodes.data()), std::streamsize(entry.nodes.size() * sizeof(BoundingVolumeHierarchy::Node)));
+    stream.read(reinterpret_cast<char*>(entry.triangleOrder.data()), std::streamsize(entry.triangleOrder.size() * sizeof(int)));
+    if (!stream || payloadChecksum(entry.nodes, entry.triangleOrder) != header.checksum || !isValidTree(entry, numTriangles)) {
+        std::cerr << "Ignoring BVH cache " << file << ": the file is truncated or damaged" << std::endl;
+        return {};
+    }
+    return entry;
+}
+
+void writeBvhCache(const std::filesystem::path& file, uint64_t key, size_t numTriangles, const BvhCacheEntry& entry)
+{
+    std::error_code error;
+    std::filesystem::create_directories(file.parent_path(), error);
+
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = CacheMagic;
+    header.version = CacheVersion;
+    header.nodeSize = sizeof(BoundingVolumeHierarchy::Node);
+    header.key = key;
+    header.numNodes = entry.nodes.size();
+    header.numTriangles = numTriangles;
+    header.numReferences = entry.triangleOrder.size();
+    header.maxDepth = entry.maxDepth;
+    header.checksum = payloadChecksum(entry.nodes, entry.triangleOrder);
+
+    // Write to a temporary file first, so that a crash halfway through never leaves a half written cache file behind. Its
+    // name is random, because other threads of the same build or other processes may be writing the same key right now.
+    std::filesystem::path temporaryFile = file;
+    temporaryFile += "." + std::to_string(std::random_device {}()) + ".tmp";
+    {
+        std::ofstream stream { temporaryFile, std::ios::binary | std::ios::trunc };
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char*>(entry.nodes.data()), std::streamsize(entry.nodes.size() * sizeof(BoundingVolumeHierarchy::Node)));
+        stream.write(reinterpret_cast<const char*>(entry.triangleOrder.data()), std::streamsize(entry.triangleOrder.size() * sizeof(int)));
+        if (!stream) {
+            std::cerr << "Could not write BVH cache " << temporaryFile << std::endl;
+            stream.close();
+            std::filesystem::remove(temporaryFile, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporaryFile, file, error);
+    if (error) {
+        std::cerr << "Could not write BVH cache " << file << ": " << error.message() << std::endl;
+        std::filesystem::remove(temporaryFile, error);
+    }
+}
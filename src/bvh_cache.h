@@ -0,0 +1,27 @@
+#pragma once
+#include "bounding_volume_hierarchy.h"
+#include "scene.h"
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+// Everything a BVH build produces that cannot be cheaply derived from the scene again.
+struct BvhCacheEntry {
+    std::vector<BoundingVolumeHierarchy::Node> nodes;
+    std::vector<int> triangleOrder; // Original triangle index for every position in the BVH-ordered triangle arrays. Can contain duplicates.
+    int maxDepth;
+};
+
+// Hash of the triangle geometry of one mesh and of every setting that changes the built tree.
+uint64_t bvhCacheKey(const Mesh& mesh, const BvhSettings& settings);
+
+// File in which the tree with the given key is stored.
+std::filesystem::path bvhCacheFile(const std::filesystem::path& cacheDirectory, uint64_t key);
+
+// Returns the cached tree, or nothing if the file is missing, was written by another version, belongs to another key
+// or is damaged. numTriangles is the number of triangles of the mesh, used to validate the triangle order.
+std::optional<BvhCacheEntry> readBvhCache(const std::filesystem::path& file, uint64_t key, size_t numTriangles);
+
+// Stores the tree. Failures are reported on the console but are not fatal, the tree is simply rebuilt next time.
+void writeBvhCache(const std::filesystem::path& file, uint64_t key, size_t numTriangles, const BvhCacheEntry& entry);
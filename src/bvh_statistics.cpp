@@ -0,0 +1,149 @@
+#include "bvh_statistics.h"
+// Suppress warnings in third-party code.
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/vector_relational.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <array>
+#include <utility>
+
+using Node = BoundingVolumeHierarchy::Node;
+
+static void countInHistogram(std::vector<size_t>& histogram, size_t value)
+{
+    if (histogram.size() <= value)
+        histogram.resize(value + 1, 0);
+    histogram[value]++;
+}
+
+static BvhTreeStatistics computeTreeStatistics(const std::vector<Node>& nodes, const BvhSettings& settings)
+{
+    BvhTreeStatistics statistics;
+    if (nodes.empty())
+        return statistics;
+
+    // Every node is visited with a probability equal to its area relative to the root, see treeSahCost.
+    const float rootArea = surfaceArea(nodes[0].lower, nodes[0].upper);
+    std::vector<std::pair<uint32_t, size_t>> stack { { 0, 0 } }; // Node index and depth
+    while (!stack.empty()) {
+        const auto [nodeIndex, depth] = stack.back();
+        stack.pop_back();
+        const Node& node = nodes[nodeIndex];
+        const float relativeArea = rootArea > 0.0f ? surfaceArea(node.lower, node.upper) / rootArea : 0.0f;
+        if (node.isLeaf()) {
+            statistics.numLeaves++;
+            statistics.numReferences += node.count;
+            countInHistogram(statistics.leavesPerDepth, depth);
+            countInHistogram(statistics.leavesPerSize, node.count);
+            statistics.sahCost += settings.intersectionCost * float(node.count) * relativeArea;
+            continue;
+        }
+
+        statistics.numInnerNodes++;
+        statistics.sahCost += settings.traversalCost * relativeArea;
+        const Node& first = nodes[nodeIndex + 1];
+        const Node& second = nodes[node.offset];
+        // Children that are apart along any axis do not overlap at all, even though the clamped box between them can
+        // still have area on its other faces.
+        const glm::vec3 overlapLower = glm::max(first.lower, second.lower);
+        const glm::vec3 overlapUpper = glm::min(first.upper, second.upper);
+        if (rootArea > 0.0f && !glm::any(glm::lessThan(overlapUpper, overlapLower)))
+            statistics.siblingOverlap += surfaceArea(overlapLower, overlapUpper) / rootArea;
+        stack.push_back({ node.offset, depth + 1 });
+        stack.push_back({ nodeIndex + 1, depth + 1 });
+    }
+    return statistics;
+}
+
+template <typename T>
+static size_t vectorBytes(const std::vector<T>& values)
+{
+    return values.size() * sizeof(T);
+}
+
+// The binary nodes plus the collapsed nodes of whichever layout is used. Tree is a MeshBvh or the top level.
+template <typename Tree>
+static size_t nodeBytes(const Tree& tree)
+{
+    return vectorBytes(tree.nodes) + vectorBytes(tree.wideNodes4) + vectorBytes(tree.wideNodes8) + vectorBytes(tree.compressedNodes4) + vectorBytes(tree.compressedNodes8);
+}
+
+BvhStatistics computeBvhStatistics(const BoundingVolumeHierarchy& bvh)
+{
+    BvhStatistics statistics;
+    statistics.topLevel = computeTreeStatistics(bvh.nodes, bvh.settings);
+    statistics.topLevel.nodeBytes = nodeBytes(bvh);
+    statistics.topLevel.primitiveBytes = bvh.instances.size() * sizeof(BoundingVolumeHierarchy::Instance);
+    for (const BoundingVolumeHierarchy::MeshBvh& meshBvh : bvh.meshBvhs) {
+        BvhTreeStatistics meshStatistics = computeTreeStatistics(meshBvh.nodes, bvh.settings);
+        meshStatistics.nodeBytes = nodeBytes(meshBvh);
+        meshStatistics.primitiveBytes = meshBvh.triangles.size() * sizeof(glm::mat3) + meshBvh.triangleVertices.size() * sizeof(std::array<Vertex, 3>)
+            + meshBvh.meshTriangleIndices.size() * sizeof(int) + vectorBytes(meshBvh.triangleRecords)
+            + vectorBytes(meshBvh.trianglePackets4) + vectorBytes(meshBvh.trianglePackets8) + vectorBytes(meshBvh.trianglePacketIndices);
+        statistics.meshes.push_back(std::move(meshStatistics));
+    }
+    statistics.shapes = computeTreeStatistics(bvh.shapeBvh.nodes, bvh.settings);
+    statistics.shapes.nodeBytes = nodeBytes(bvh.shapeBvh);
+    statistics.shapes.primitiveBytes = vectorBytes(bvh.shapeBvh.shapes);
+    return statistics;
+}
+
+static void printHistogram(std::ostream& stream, const char* name, const std::vector<size_t>& histogram)
+{
+    stream << "    " << name << ":";
+    for (size_t value = 0; value < histogram.size(); value++) {
+        if (histogram[value] > 0)
+            stream << " " << value << ":" << histogram[value];
+    }
+    stream << "\n";
+}
+
+static void printTreeStatistics(std::ostream& stream, const char* name, size_t index, const BvhTreeStatistics& statistics, const char* primitiveName)
+{
+    stream << "  " << name;
+    if (index != size_t(-1))
+        stream << " " << index;
+    stream << ": " << statistics.numInnerNodes << " inner nodes, " << statistics.numLeaves << " leaves, " << statistics.leavesPerDepth.size() << " levels, "
+           << statistics.numReferences << " " << primitiveName << " references, SAH cost " << statistics.sahCost << ", sibling overlap " << statistics.siblingOverlap
+           << ", " << float(statistics.nodeBytes) / 1024.0f << " KB nodes, " << float(statistics.primitiveBytes) / 1024.0f << " KB " << primitiveName << "s\n";
+    printHistogram(stream, "leaves per depth", statistics.leavesPerDepth);
+    printHistogram(stream, "leaves per size", statistics.leavesPerSize);
+}
+
+void printBvhStatistics(std::ostream& stream, const BvhStatistics& statistics)
+{
+    stream << "BVH statistics\n";
+    printTreeStatistics(stream, "top level", size_t(-1), statistics.topLevel, "instance");
+    if (statistics.shapes.numLeaves > 0)
+        printTreeStatistics(stream, "shapes", size_t(-1), statistics.shapes, "shape");
+    BvhTreeStatistics total;
+    for (size_t meshIndex = 0; meshIndex < statistics.meshes.size(); meshIndex++) {
+        const BvhTreeStatistics& mesh = statistics.meshes[meshIndex];
+        printTreeStatistics(stream, "mesh", meshIndex, mesh, "triangle");
+        total.numInnerNodes += mesh.numInnerNodes;
+        total.numLeaves += mesh.numLeaves;
+        total.numReferences += mesh.numReferences;
+        total.sahCost += mesh.sahCost;
+        total.nodeBytes += mesh.nodeBytes;
+        total.primitiveBytes += mesh.primitiveBytes;
+    }
+    stream << "  all meshes: " << total.numInnerNodes << " inner nodes, " << total.numLeaves << " leaves, " << total.numReferences << " triangle references, SAH cost "
+           << total.sahCost << ", " << float(total.nodeBytes + statistics.topLevel.nodeBytes + statistics.shapes.nodeBytes + total.primitiveBytes + statistics.topLevel.primitiveBytes + statistics.shapes.primitiveBytes) / 1024.0f << " KB in total" << std::endl;
+}
+
+void printTraversalStatistics(std::ostream& stream, const TraversalStatistics& statistics)
+{
+    constexpr std::array names { "primary", "shadow", "reflection" };
+    stream << "Traversal statistics\n";
+    for (size_t kind = 0; kind < statistics.rays.size(); kind++) {
+        const TraversalStatistics::Counters& counters = statistics.rays[kind];
+        stream << "  " << counters.numRays << " " << names[kind] << " rays";
+        if (counters.numRays > 0) {
+            const double numRays = double(counters.numRays);
+            stream << ": " << double(counters.nodesVisited) / numRays << " nodes visited and " << double(counters.trianglesTested) / numRays << " triangles tested per ray";
+        }
+        stream << "\n";
+    }
+    stream << std::flush;
+}
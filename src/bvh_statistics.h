@@ -0,0 +1,33 @@
+#pragma once
+#include "bounding_volume_hierarchy.h"
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+// Shape and size of one binary tree of the hierarchy: a bottom level tree or the top level.
+struct BvhTreeStatistics {
+    size_t numInnerNodes = 0;
+    size_t numLeaves = 0;
+    size_t numReferences = 0; // Sum of the primitive counts of all leaves
+    std::vector<size_t> leavesPerDepth; // Number of leaves at every depth, the root is at depth 0
+    std::vector<size_t> leavesPerSize; // Number of leaves with 0, 1, 2, ... primitives
+    float sahCost = 0.0f; // Same as BoundingVolumeHierarchy::sahCost for a bottom level tree
+    float siblingOverlap = 0.0f; // Surface area of the overlap of the two children of every inner node, summed and relative to the root
+    size_t nodeBytes = 0; // Binary nodes and the wide nodes of the layout
+    size_t primitiveBytes = 0; // Triangle arrays (bottom level) or instances (top level)
+};
+
+struct BvhStatistics {
+    BvhTreeStatistics topLevel;
+    std::vector<BvhTreeStatistics> meshes; // With the same index as BoundingVolumeHierarchy::meshBvhs
+    BvhTreeStatistics shapes; // Tree over the spheres and boxes
+};
+
+// Walks all trees of the hierarchy. Cheap compared to a build, but not meant to be called every frame.
+BvhStatistics computeBvhStatistics(const BoundingVolumeHierarchy& bvh);
+
+// Prints the statistics of every tree, including the depth and leaf size histograms, and the totals over all meshes.
+void printBvhStatistics(std::ostream& stream, const BvhStatistics& statistics);
+
+// Prints the average number of nodes visited and triangles tested per primary, shadow and reflection ray.
+void printTraversalStatistics(std::ostream& stream, const TraversalStatistics& statistics);
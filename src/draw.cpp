@@ -101,10 +101,10 @@ static void drawSphereInternal(const glm::vec3& center, float radius)
     glPopMatrix();
 }
 
-void drawSphere(const Sphere& sphere)
+void drawSphere(const Sphere& sphere, const Material& material)
 {
     glPushAttrib(GL_ALL_ATTRIB_BITS);
-    setMaterial(sphere.material);
+    setMaterial(material);
     drawSphereInternal(sphere.center, sphere.radius);
     glPopAttrib();
 }
@@ -187,12 +187,20 @@ void drawAABB(const AxisAlignedBox& box, DrawMode drawMode, const glm::vec3& col
 
 void drawScene(const Scene& scene)
 {
-    for (const auto& mesh : scene.meshes)
-        drawMesh(mesh);
+    if (scene.instances.empty()) {
+        for (const auto& mesh : scene.meshes)
+            drawMesh(mesh);
+    }
+    for (const auto& instance : scene.instances) {
+        glPushMatrix();
+        glMultMatrixf(glm::value_ptr(instance.transform));
+        drawMesh(scene.meshes[instance.meshIndex]);
+        glPopMatrix();
+    }
     for (const auto& sphere : scene.spheres)
-        drawSphere(sphere);
-    //for (const auto& box : scene.boxes)
-    //	drawShape(box);
+        drawSphere(sphere, scene.materials[sphere.materialId]);
+    for (const auto& box : scene.boxes)
+        drawAABB(box.shape, DrawMode::Filled, scene.materials[box.materialId].kd);
 }
 
 void drawRay(const Ray& ray, const glm::vec3& color)
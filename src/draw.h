@@ -23,7 +23,7 @@ void drawAABB(const AxisAlignedBox& box, DrawMode drawMode = DrawMode::Filled, c
 void drawMesh(const Mesh& mesh);
 void drawATriangle(glm::vec3 v0, glm::vec3 v1, glm::vec3 v2);
 void drawTriangles(std::vector<int> indices, glm::vec3 color, std::vector<glm::mat3> allTriangles);
-void drawSphere(const Sphere& sphere);
+void drawSphere(const Sphere& sphere, const Material& material);
 void drawSphere(const glm::vec3& center, float radius, const glm::vec3& color = glm::vec3(1.0f));
 void drawScene(const Scene& scene);
 
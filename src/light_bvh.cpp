@@ -0,0 +1,165 @@
+#include "light_bvh.h"
+// Suppress warnings in third-party code.
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+DISABLE_WARNINGS_POP()
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+using Node = LightBvh::Node;
+
+// The importance of a node never drops below its power times this: the specular highlight of a light at a grazing angle
+// does not go to 0 with the cosine, and every light that can contribute needs a probability above 0 to keep the
+// estimate unbiased.
+static constexpr float MinCosine = 0.05f;
+
+// Largest number below 1, so that u stays in [0, 1) after it is rescaled on the way down.
+static constexpr float OneMinusEpsilon = 0x1.fffffep-1f;
+
+namespace {
+// A light during the build: its bounds and power, and where it came from.
+struct LightPrimitive {
+    glm::vec3 lower, upper;
+    glm::vec3 centroid;
+    float power;
+    uint32_t lightIndex;
+};
+}
+
+float lightPower(const Light& light)
+{
+    const auto average = [](const glm::vec3& color) { return (color.r + color.g + color.b) / 3.0f; };
+    if (std::holds_alternative<PointLight>(light))
+        return average(std::get<PointLight>(light).color);
+    if (std::holds_alternative<SegmentLight>(light)) {
+        const SegmentLight& segmentLight = std::get<SegmentLight>(light);
+        return glm::length(segmentLight.endpoint1 - segmentLight.endpoint0) * average(0.5f * (segmentLight.color0 + segmentLight.color1));
+    }
+    const ParallelogramLight& parallelogramLight = std::get<ParallelogramLight>(light);
+    const float area = glm::length(glm::cross(parallelogramLight.edge01, parallelogramLight.edge02));
+    return area * average(0.25f * (parallelogramLight.color0 + parallelogramLight.color1 + parallelogramLight.color2 + parallelogramLight.color3));
+}
+
+static LightPrimitive makeLightPrimitive(const Light& light, uint32_t lightIndex)
+{
+    LightPrimitive primitive;
+    if (std::holds_alternative<PointLight>(light)) {
+        primitive.lower = primitive.upper = std::get<PointLight>(light).position;
+    } else if (std::holds_alternative<SegmentLight>(light)) {
+        const SegmentLight& segmentLight = std::get<SegmentLight>(light);
+        primitive.lower = glm::min(segmentLight.endpoint0, segmentLight.endpoint1);
+        primitive.upper = glm::max(segmentLight.endpoint0, segmentLight.endpoint1);
+    } else {
+        const ParallelogramLight& parallelogramLight = std::get<ParallelogramLight>(light);
+        const glm::vec3 v1 = parallelogramLight.v0 + parallelogramLight.edge01;
+        const glm::vec3 v2 = parallelogramLight.v0 + parallelogramLight.edge02;
+        const glm::vec3 v3 = v1 + parallelogramLight.edge02;
+        primitive.lower = glm::min(glm::min(parallelogramLight.v0, v1), glm::min(v2, v3));
+        primitive.upper = glm::max(glm::max(parallelogramLight.v0, v1), glm::max(v2, v3));
+    }
+    primitive.centroid = 0.5f * (primitive.lower + primitive.upper);
+    primitive.power = lightPower(light);
+    primitive.lightIndex = lightIndex;
+    return primitive;
+}
+
+// Appends the subtree over primitives[begin, end) to nodes, depth-first. Splits at the median along the axis in which the
+// centroids are spread the most, so the tree is balanced and every pick visits about log2(number of lights) nodes.
+static void buildNode(std::vector<Node>& nodes, std::vector<LightPrimitive>& primitives, size_t begin, size_t end)
+{
+    glm::vec3 lower = primitives[begin].lower, upper = primitives[begin].upper;
+    glm::vec3 centroidLower = primitives[begin].centroid;
+    glm::vec3 centroidUpper = primitives[begin].centroid;
+    float power = 0.0f;
+    for (size_t i = begin; i < end; i++) {
+        lower = glm::min(lower, primitives[i].lower);
+        upper = glm::max(upper, primitives[i].upper);
+        centroidLower = glm::min(centroidLower, primitives[i].centroid);
+        centroidUpper = glm::max(centroidUpper, primitives[i].centroid);
+        power += primitives[i].power;
+    }
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back(Node { 0.5f * (lower + upper), 0.5f * glm::length(upper - lower), power, 0, false });
+
+    if (end - begin == 1) {
+        nodes[nodeIndex].offset = primitives[begin].lightIndex;
+        nodes[nodeIndex].isLeaf = true;
+        return;
+    }
+
+    const glm::vec3 extent = centroidUpper - centroidLower;
+    const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    const size_t middle = begin + (end - begin) / 2;
+    std::nth_element(primitives.begin() + std::ptrdiff_t(begin), primitives.begin() + std::ptrdiff_t(middle), primitives.begin() + std::ptrdiff_t(end),
+        [axis](const LightPrimitive& lhs, const LightPrimitive& rhs) { return lhs.centroid[axis] < rhs.centroid[axis]; });
+
+    buildNode(nodes, primitives, begin, middle);
+    nodes[nodeIndex].offset = uint32_t(nodes.size());
+    buildNode(nodes, primitives, middle, end);
+}
+
+LightBvh::LightBvh(const std::vector<Light>& lights)
+    : m_numLights(lights.size())
+{
+    if (lights.empty())
+        return;
+    std::vector<LightPrimitive> primitives;
+    primitives.reserve(lights.size());
+    for (size_t lightIndex = 0; lightIndex < lights.size(); lightIndex++)
+        primitives.push_back(makeLightPrimitive(lights[lightIndex], uint32_t(lightIndex)));
+    m_nodes.reserve(2 * lights.size() - 1);
+    buildNode(m_nodes, primitives, 0, primitives.size());
+}
+
+// Upper bound of what the lights of the node can contribute at the point: their power, times the largest cosine between
+// the normal (on either side, the shading is two-sided) and a direction from the point into the sphere around the node.
+static float importance(const Node& node, const glm::vec3& point, const glm::vec3& normal)
+{
+    const glm::vec3 toCenter = node.center - point;
+    const float distance = glm::length(toCenter);
+    if (distance <= node.radius)
+        return node.power;
+
+    // The directions into the sphere form a cone around toCenter. The cosine is largest for the direction in the cone
+    // that is closest to the normal: the angle to the normal shrinks by the opening angle of the cone.
+    const float sinCone = node.radius / distance;
+    const float cosCone = std::sqrt(1.0f - sinCone * sinCone);
+    const float cosNormal = std::min(std::abs(glm::dot(normal, toCenter)) / distance, 1.0f);
+    const float sinNormal = std::sqrt(1.0f - cosNormal * cosNormal);
+    const float cosBound = cosNormal >= cosCone ? 1.0f : cosNormal * cosCone + sinNormal * sinCone;
+    return node.power * std::max(cosBound, MinCosine);
+}
+
+std::optional<LightBvh::Selection> LightBvh::sample(const glm::vec3& point, const glm::vec3& normal, float u) const
+{
+    if (m_nodes.empty())
+        return std::nullopt;
+
+    uint32_t nodeIndex = 0;
+    float probability = 1.0f;
+    while (!m_nodes[nodeIndex].isLeaf) {
+        const uint32_t firstChild = nodeIndex + 1;
+        const uint32_t secondChild = m_nodes[nodeIndex].offset;
+        const float firstImportance = importance(m_nodes[firstChild], point, normal);
+        const float totalImportance = firstImportance + importance(m_nodes[secondChild], point, normal);
+        if (!(totalImportance > 0.0f))
+            return std::nullopt;
+
+        // Take the first child for u below its share, and stretch the part of u that was used back to [0, 1).
+        const float firstProbability = firstImportance / totalImportance;
+        if (u < firstProbability) {
+            nodeIndex = firstChild;
+            probability *= firstProbability;
+            u = u / firstProbability;
+        } else {
+            nodeIndex = secondChild;
+            probability *= 1.0f - firstProbability;
+            u = (u - firstProbability) / (1.0f - firstProbability);
+        }
+        u = std::min(u, OneMinusEpsilon);
+    }
+    return Selection { m_nodes[nodeIndex].offset, probability };
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "scene.h"
+// Suppress warnings in third-party code.
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/vec3.hpp>
+DISABLE_WARNINGS_POP()
+#include <cstdint>
+#include <optional>
+#include <variant>
+#include <vector>
+
+// An element of Scene::lights.
+using Light = std::variant<PointLight, SegmentLight, ParallelogramLight>;
+
+// Binary tree over the lights of a scene, for scenes with more lights than can be shaded at every point. Every node
+// stores the bounds and the total power of the lights below it, so that a shading point can pick one light by walking
+// down from the root, choosing between the two children of every node in proportion to how much they can contribute.
+// The cost of a pick grows with the depth of the tree, the logarithm of the number of lights.
+//
+// The lights of this ray tracer do not fall off with distance and shine equally in all directions, so the importance of
+// a node is its power times the largest cosine between the normal of the shading point and a direction into its bounds.
+class LightBvh {
+public:
+    // A flat depth-first tree like BoundingVolumeHierarchy::Node: the first child of an inner node directly follows it.
+    // The bounds are the sphere around the box of the lights, which is all that the importance needs.
+    struct Node {
+        glm::vec3 center;
+        float radius;
+        float power; // Sum of the power of the lights below
+        uint32_t offset; // Inner node: index of the second child. Leaf: index of the light in Scene::lights.
+        bool isLeaf;
+    };
+
+    // A light that was picked for a shading point, and the probability with which it was picked.
+    struct Selection {
+        uint32_t lightIndex;
+        float probability;
+    };
+
+    LightBvh() = default;
+    explicit LightBvh(const std::vector<Light>& lights);
+
+    // Picks a light for the shading point with the given normal. u is a number in [0, 1), which is used up bit by bit
+    // on the way down; consecutive (or stratified) values of u pick lights in the same order as their cumulative
+    // importance. Returns nothing if no light can contribute, in which case the direct light at the point is 0.
+    std::optional<Selection> sample(const glm::vec3& point, const glm::vec3& normal, float u) const;
+
+    size_t numLights() const { return m_numLights; }
+    const std::vector<Node>& nodes() const { return m_nodes; }
+
+private:
+    std::vector<Node> m_nodes;
+    size_t m_numLights = 0;
+};
+
+// Power of a light: its color averaged over the channels, times its length or area for segment and parallelogram lights,
+// because those give off their color per unit of length or area (see how they are sampled in main.cpp).
+float lightPower(const Light& light);
@@ -1,7 +1,11 @@
+#include "benchmark.h"
 #include "bounding_volume_hierarchy.h"
+#include "bvh_statistics.h"
 #include "draw.h"
+#include "light_bvh.h"
 #include "ray_tracing.h"
 #include "screen.h"
+#include "treelet_optimization.h"
 // Suppress warnings in third-party code.
 #include <framework/disable_all_warnings.h>
 DISABLE_WARNINGS_PUSH()
@@ -15,6 +19,7 @@ DISABLE_WARNINGS_PUSH()
 #include <tbb/blocked_range2d.h>
 #include <tbb/parallel_for.h>
 DISABLE_WARNINGS_POP()
+#include <bit>
 #include <chrono>
 #include <cstdlib>
 #include <filesystem>
@@ -33,17 +38,44 @@ DISABLE_WARNINGS_POP()
 
 constexpr glm::ivec2 windowResolution { 800, 800 };
 const std::filesystem::path dataPath { DATA_DIR };
+const std::filesystem::path bvhCacheDirectory { std::filesystem::temp_directory_path() / "final_project_bvh_cache" };
 bool blur = false;
+// Width and height in pixels of the tiles whose camera and shadow rays are traced as one packet, 1 traces every ray on its own.
+// Packets always traverse the binary nodes, also when a wide layout is selected.
+int rayPacketSize = 8;
+// Number of times that a ray can be reflected.
+int maxReflectionDepth = 5;
+// Reflections whose contribution to the pixel (the product of ks along the way) drops below this are continued with
+// Russian roulette, or stopped if russianRoulette is off. Weakly reflective materials then stop long before the depth cap.
+float minReflectionThroughput = 0.05f;
+bool russianRoulette = true;
+// Number of points at which every segment and parallelogram light is sampled per shading point (so per pixel without
+// reflections). The soft shadows get less noisy with more samples, each of which costs a shadow ray.
+int areaLightSamples = 16;
+// Number of lights that are shaded at every point when the scene has more lights than this. They are picked with the light
+// BVH, so the shading cost stays about the same no matter how many lights there are.
+int lightSamples = 8;
 
 enum class ViewMode {
     Rasterization = 0,
     RayTracing = 1
 };
 
-static glm::vec3 getFinalColor(const Scene& scene, const BoundingVolumeHierarchy& bvh, Ray ray, int recursion);
+// lightBvh is built over scene.lights for every render (and for the debug ray), because the lights can be changed in the UI at any time.
+static glm::vec3 getFinalColor(const Scene& scene, const BoundingVolumeHierarchy& bvh, const LightBvh& lightBvh, Ray ray, int recursion, RayKind rayKind = RayKind::Primary, const glm::vec3& throughput = glm::vec3(1.0f));
 
-static glm::vec3 calculatePhongShading(const Ray ray, const PointLight& light, HitInfo& hitInfo, const Scene& scene, const BoundingVolumeHierarchy& bvh, int recursion) {
-    glm::vec3 reflectivity = hitInfo.material.ks;
+// The shadow ray from vertexPos towards the light, with ray.t the distance to the light.
+static Ray makeShadowRay(const glm::vec3& vertexPos, const glm::vec3& lightPosition) {
+    Ray shadowRay;
+    shadowRay.direction = glm::normalize(lightPosition - vertexPos);
+    shadowRay.origin = vertexPos + 0.0001f * shadowRay.direction; //small offset to avoid self shadowing
+    shadowRay.t = glm::length(lightPosition - shadowRay.origin);
+    return shadowRay;
+}
+
+// knownOcclusion is the result of the shadow ray if it was already traced (in a packet), otherwise it is traced here.
+static glm::vec3 calculatePhongShading(const Ray ray, const PointLight& light, const HitInfo& hitInfo, const Scene& scene, const BoundingVolumeHierarchy& bvh, std::optional<bool> knownOcclusion = std::nullopt) {
+    const Material& material = scene.materials[hitInfo.materialId];
     glm::vec3 vertexPos = ray.origin + ray.t * ray.direction;
     glm::vec3 lightVector = glm::normalize(light.position - vertexPos);
     glm::vec3 normal = (glm::dot(lightVector, hitInfo.normal) < 0) ? -1.0f * hitInfo.normal : hitInfo.normal;
@@ -51,14 +83,14 @@ static glm::vec3 calculatePhongShading(const Ray ray, const PointLight& light, H
     drawRay({ vertexPos, normal, 0.1 }, glm::vec3 (1,1,0));
 
     //Diffuse    
-    glm::vec3 diffuse = light.color * hitInfo.material.kd * glm::max(0.0f, glm::dot(lightVector, normal));
+    glm::vec3 diffuse = light.color * hitInfo.kd * glm::max(0.0f, glm::dot(lightVector, normal));
 
     //Specular
     glm::vec3 viewVector = glm::normalize(ray.origin - vertexPos);
     glm::vec3 reflectionVector = glm::normalize((2.0f * normal * glm::dot(normal, lightVector)) - lightVector);
     //debug reflection ray
     //drawRay({ vertexPos, {2.0f * normal * glm::dot(normal, viewVector) - viewVector}, 0.5 }, glm::vec3(1, 0, 1));
-    glm::vec3 specular = light.color * hitInfo.material.ks * (glm::pow(glm::max(0.0f, glm::dot(reflectionVector, viewVector)), hitInfo.material.shininess));
+    glm::vec3 specular = light.color * material.ks * (glm::pow(glm::max(0.0f, glm::dot(reflectionVector, viewVector)), material.shininess));
 
     glm::vec3 phong = (glm::dot(viewVector, normal) < 0.0f && glm::dot(lightVector, normal) > 0.0f) ? glm::vec3(0) : diffuse + specular;
 
@@ -66,42 +98,98 @@ static glm::vec3 calculatePhongShading(const Ray ray, const PointLight& light, H
     //Hard Shadows - Works
 
     //the shadow ray which starts at the point on the mesh and goes towards the light
-    Ray shadowRay;
-    shadowRay.direction = glm::normalize(light.position - vertexPos);
-    shadowRay.origin = vertexPos + 0.0001f * shadowRay.direction; //small offset to avoid self shadowing
-
-    //when the shadow ray intersects something
-    if (bvh.intersect(shadowRay, hitInfo)) {
-        glm::vec3 nextIntersect = shadowRay.origin + (shadowRay.direction * shadowRay.t) - vertexPos; //vector from the vertex to the first intersection of the shadow ray
-        //if the shadow ray intersects something before reaching the light, then the vertex is in shadow
-        if (glm::length(light.position - vertexPos) > glm::length(nextIntersect)) {
-            //red debug shadow ray drawn when point is in shadow
-            phong = glm::vec3{ 0.0f };
-            drawRay(shadowRay, glm::vec3{ 1.0f, 0.0f, 0.0f });
-        }
-        else {
-            //if the lights is before the intersection then draw light ray to light
-            drawRay({ vertexPos, light.position - vertexPos, 1.0f }, light.color);
-        }
+    const Ray shadowRay = makeShadowRay(vertexPos, light.position);
+
+    //if the shadow ray is blocked before reaching the light, then the vertex is in shadow
+    const float lightDistance = shadowRay.t;
+    if (knownOcclusion ? *knownOcclusion : bvh.occluded(shadowRay.origin, shadowRay.direction, lightDistance)) {
+        //red debug shadow ray drawn when point is in shadow
+        phong = glm::vec3{ 0.0f };
+        drawRay({ shadowRay.origin, shadowRay.direction, lightDistance }, glm::vec3{ 1.0f, 0.0f, 0.0f });
     }
     else {
-        //if there is no intersection at all, draw light ray to light
+        //if nothing blocks the light, draw light ray to light
         drawRay({ vertexPos, light.position - vertexPos, 1.0f }, light.color);
     }
 
+    return phong;
+}
+
+// Radical inverse in base 2 (van der Corput sequence): mirrors the bits of the index around the binary point.
+static float radicalInverse(uint32_t index)
+{
+    index = (index << 16) | (index >> 16);
+    index = ((index & 0x00ff00ffu) << 8) | ((index & 0xff00ff00u) >> 8);
+    index = ((index & 0x0f0f0f0fu) << 4) | ((index & 0xf0f0f0f0u) >> 4);
+    index = ((index & 0x33333333u) << 2) | ((index & 0xccccccccu) >> 2);
+    index = ((index & 0x55555555u) << 1) | ((index & 0xaaaaaaaau) >> 1);
+    return float(index >> 8) * 0x1p-24f;
+}
+
+// Random offset of the sample pattern of a light at a shading point, or any other random numbers that the shading point
+// needs (seed tells them apart). It is a hash of the point instead of a random number generator, so the image does not
+// depend on the order in which (or the packets in which) the pixels are traced.
+static glm::vec2 sampleRotation(const glm::vec3& vertexPos, uint32_t seed)
+{
+    uint32_t hash = seed * 0x9e3779b9u;
+    for (int axis = 0; axis < 3; axis++) {
+        hash ^= std::bit_cast<uint32_t>(vertexPos[axis]);
+        hash *= 0x85ebca6bu;
+        hash ^= hash >> 13;
+        hash *= 0xc2b2ae35u;
+        hash ^= hash >> 16;
+    }
+    const uint32_t hash2 = (hash ^ (hash >> 15)) * 0x2c1b3c6du;
+    return glm::vec2(float(hash >> 8), float(hash2 >> 8)) * 0x1p-24f;
+}
+
+// Sample index of numSamples on the unit square: a Hammersley point set, shifted by rotation and wrapped around. Each of
+// the numSamples columns holds exactly one sample, and the rows are filled as evenly as the sample count allows, so the
+// points cover the light far more evenly than random points, without the banding of a fixed grid.
+static glm::vec2 areaLightSample(uint32_t index, uint32_t numSamples, const glm::vec2& rotation)
+{
+    const glm::vec2 sample = glm::vec2((float(index) + 0.5f) / float(numSamples), radicalInverse(index)) + rotation;
+    return sample - glm::floor(sample);
+}
+
+// Reflection at the hit: traced once per shading point, after the light of all lights has been added up, because the
+// mirror direction does not depend on the light. throughput is how much the color of the hit adds to the pixel.
+static glm::vec3 calculateReflection(const Ray& ray, const HitInfo& hitInfo, const Scene& scene, const BoundingVolumeHierarchy& bvh, const LightBvh& lightBvh, int recursion, const glm::vec3& throughput) {
+    glm::vec3 color = glm::vec3(0);
+    glm::vec3 reflectivity = scene.materials[hitInfo.materialId].ks;
+    glm::vec3 vertexPos = ray.origin + ray.t * ray.direction;
+    glm::vec3 viewVector = glm::normalize(ray.origin - vertexPos);
+    //the side of the normal does not matter, it is used twice
+    glm::vec3 normal = hitInfo.normal;
 
     // Regular Reflections - Works
     if (reflectivity != glm::vec3(0) && recursion > 0) {
+        //how much the reflected ray adds to the pixel
+        glm::vec3 weight = reflectivity;
+        glm::vec3 reflectedThroughput = throughput * reflectivity;
+        const float maxThroughput = glm::max(glm::max(reflectedThroughput.x, reflectedThroughput.y), reflectedThroughput.z);
+        if (maxThroughput < minReflectionThroughput) {
+            if (!russianRoulette)
+                return color;
+            //Russian roulette: continue with a probability that shrinks with the contribution, and divide the paths that
+            //survive by that probability to make up for the ones that were stopped, so the expected color stays the same
+            const float survival = maxThroughput / minReflectionThroughput;
+            if (sampleRotation(vertexPos, ~uint32_t(recursion)).x >= survival) //seeds from the top, the lights use the bottom
+                return color;
+            weight /= survival;
+            reflectedThroughput /= survival;
+        }
+
         //the reflection vector to the view vector
         glm::vec3 reflection = 2.0f * normal * glm::dot(normal, viewVector) - viewVector;
         Ray reflectedRay = { vertexPos + (0.0001f * reflection), reflection,  std::numeric_limits<float>::max() };
         //the shading will be the same shading as what the reflected ray would have
-        phong = phong + reflectivity * getFinalColor(scene, bvh, reflectedRay, recursion - 1);
+        color = color + weight * getFinalColor(scene, bvh, lightBvh, reflectedRay, recursion - 1, RayKind::Reflection, reflectedThroughput);
     }
 
 
     // Glossy Reflection - works
-    // Replaces the regular reflection that is commented out between lines 92 and 101. 
+    // Replaces the regular reflection above.
     // If you want to test reflection alone comment out the if statement below and uncomment the if statement above marked as "reflection"
     // Takes account the shininess when calculating the reflection to give it a glossy reflection look.
     // Check that shininess is above 0 on top of the other checks of reflection to avoid dividing by zero inside the loop
@@ -147,89 +235,97 @@ static glm::vec3 calculatePhongShading(const Ray ray, const PointLight& light, H
 //
 //        //the shading will be the same shading as what the reflected ray would have been but the color is replaced by the new glossy color
 //        // the color is divided by the count to make sure that the ignored iterations aren't calculated in the average
-//        phong = phong + glm::vec3{ glossyColor.x / count, glossyColor.y / count, glossyColor.z / count };
+//        color = color + glm::vec3{ glossyColor.x / count, glossyColor.y / count, glossyColor.z / count };
 //    }
 
-    return phong;
+    return color;
 }
 
-static glm::vec3 getFinalColor(const Scene& scene, const BoundingVolumeHierarchy& bvh, Ray ray, int recursion) {
-    HitInfo hitInfo;
-    if (bvh.intersect(ray, hitInfo)) {
-        glm::vec3 color = glm::vec3(0);
-        glm::vec3 vertexPos = ray.origin + ray.t * ray.direction;
-        for (const auto& light : scene.lights) {
-            if (std::holds_alternative<PointLight>(light)) {
-                const PointLight pointLight = std::get<PointLight>(light);
-                
-                color += calculatePhongShading(ray, pointLight, hitInfo, scene, bvh, recursion);
-            }
-            else if (std::holds_alternative<SegmentLight>(light)) {
-                const SegmentLight segmentLight = std::get<SegmentLight>(light);
-                float lengthOfSegLight = glm::length(segmentLight.endpoint0 - segmentLight.endpoint1);
-                //if the light is 1 unit long then there will be 10 lights on it
-                int numLights = glm::floor(lengthOfSegLight * 10);
-                glm::vec3 segmentVector = segmentLight.endpoint1 - segmentLight.endpoint0;
-
-                //loop over to generate point lights along the segment light
-                for (int i = 0; i <= numLights; i++) {
-                    //the position of the light will be a fraction of the segment light length defined by the number of lights.
-                    glm::vec3 currentPos = segmentLight.endpoint0 + (lengthOfSegLight / numLights) * i * glm::normalize(segmentVector);
-                    
-                    //weights of each endpoint of the segment light
-                    float lengthOfAlpha = glm::length(currentPos - segmentLight.endpoint0);
-                    float lengthOfBeta = lengthOfSegLight - lengthOfAlpha;
-                    glm::vec3 currentPosColor = ((lengthOfAlpha * segmentLight.color1 / lengthOfSegLight) + (lengthOfBeta * segmentLight.color0 / lengthOfSegLight)) / 10.0f;
-                    
-                    //drawRay({ currentPos, currentPos - vertexPos, 1.0f }, currentPosColor);
-
-                    const PointLight pointLightCurrent = { currentPos, currentPosColor };
-                    //calculate phong for each of the point lights
-                    color += calculatePhongShading(ray, pointLightCurrent, hitInfo, scene, bvh, recursion);
-                }
-            }
-            else if (std::holds_alternative<ParallelogramLight>(light)) {
-                const ParallelogramLight parallelogramLight = std::get<ParallelogramLight>(light);
-                
-                glm::vec3 v1 = parallelogramLight.edge01 + parallelogramLight.v0;
-                glm::vec3 v2 = parallelogramLight.edge02 + parallelogramLight.v0;
-                glm::vec3 v3 = parallelogramLight.edge01 + parallelogramLight.edge01 + parallelogramLight.v0;
-
-                float edge01Length = glm::length(parallelogramLight.edge01);
-                float edge02Length = glm::length(parallelogramLight.edge02);
-                //for every unit of length on both edges, there will be 20 generated lights
-                int numLightsEdge01 = glm::floor(edge01Length * 20);
-                int numLightsEdge02 = glm::floor(edge02Length * 20);
-                
-                //generate the point lights one column at a time
-                for (int i = 0; i <= numLightsEdge01; i++) {
-                    for (int j = 0; j <= numLightsEdge02; j++) {
-                        glm::vec3 currentPos01 = parallelogramLight.v0 + (edge01Length / numLightsEdge01) * i * glm::normalize(parallelogramLight.edge01);
-                        glm::vec3 currentPos02 = parallelogramLight.v0 + (edge02Length / numLightsEdge02) * j * glm::normalize(parallelogramLight.edge02);
-                        glm::vec3 currentPos = currentPos01 + currentPos02 - parallelogramLight.v0;
-
-                        // drawRay({currentPos, glm::vec3(1,1,1), 0.1 }, glm::vec3(1, 0, 0));
-                        //areas of sub-parallelograms and the total parallelogram
-                        float totalArea = glm::length(glm::cross(parallelogramLight.edge01, parallelogramLight.edge02));
-
-                        float area3 = glm::length(glm::cross(currentPos01 - parallelogramLight.v0, currentPos02 - parallelogramLight.v0));
-                        float area0 = glm::length(glm::cross(currentPos01 + parallelogramLight.edge02 - v3, currentPos02 + parallelogramLight.edge01 - v3));
-                        float area2 = glm::length(glm::cross(currentPos01 - v1, currentPos02 + parallelogramLight.edge01 - v1));
-                        float area1 = glm::length(glm::cross(currentPos02 - v2, currentPos01 + parallelogramLight.edge02 - v2));
-                        //color calculated with the weights of each vertex color
-                        glm::vec3 currentPosColor = ((area0 * parallelogramLight.color0 / totalArea) + (area1 * parallelogramLight.color1 / totalArea) + (area2 * parallelogramLight.color2 / totalArea) + (area3 * parallelogramLight.color3 / totalArea)) / 400.f;
-                        //drawRay({ vertexPos, currentPos - vertexPos, 1.0f }, currentPosColor);
-
-                        const PointLight pointLightCurrent = { currentPos, currentPosColor };
-                        color += calculatePhongShading(ray, pointLightCurrent, hitInfo, scene, bvh, recursion);
-                    }
-                }
+// True if every shading point is lit by all lights of the scene, false if it only shades lightSamples lights that are picked
+// with the light BVH.
+static bool shadesEveryLight(const Scene& scene)
+{
+    return scene.lights.size() <= size_t(lightSamples);
+}
 
-            }
+// Light from scene.lights[lightIndex] at the hit. knownOcclusion is the result of the shadow ray if it is a point light
+// and that was already traced.
+static glm::vec3 shadeLight(const Scene& scene, const BoundingVolumeHierarchy& bvh, const Ray& ray, const HitInfo& hitInfo, size_t lightIndex, std::optional<bool> knownOcclusion) {
+    glm::vec3 color = glm::vec3(0);
+    glm::vec3 vertexPos = ray.origin + ray.t * ray.direction;
+    const auto& light = scene.lights[lightIndex];
+    if (std::holds_alternative<PointLight>(light)) {
+        const PointLight pointLight = std::get<PointLight>(light);
+        color += calculatePhongShading(ray, pointLight, hitInfo, scene, bvh, knownOcclusion);
+    }
+    else if (std::holds_alternative<SegmentLight>(light)) {
+        const SegmentLight segmentLight = std::get<SegmentLight>(light);
+        const glm::vec3 segmentVector = segmentLight.endpoint1 - segmentLight.endpoint0;
+        //every sample stands for an equal part of the segment, so the light gives off its color per unit of length
+        const float sampleWeight = glm::length(segmentVector) / float(areaLightSamples);
+        const glm::vec2 rotation = sampleRotation(vertexPos, uint32_t(lightIndex));
+        for (int i = 0; i < areaLightSamples; i++) {
+            const float alpha = areaLightSample(uint32_t(i), uint32_t(areaLightSamples), rotation).x;
+            const glm::vec3 currentPos = segmentLight.endpoint0 + alpha * segmentVector;
+            //the color is interpolated between the endpoints
+            const glm::vec3 currentPosColor = sampleWeight * ((1.0f - alpha) * segmentLight.color0 + alpha * segmentLight.color1);
+
+            const PointLight pointLightCurrent = { currentPos, currentPosColor };
+            color += calculatePhongShading(ray, pointLightCurrent, hitInfo, scene, bvh);
         }
+    }
+    else if (std::holds_alternative<ParallelogramLight>(light)) {
+        const ParallelogramLight parallelogramLight = std::get<ParallelogramLight>(light);
+        //every sample stands for an equal part of the area, so the light gives off its color per unit of area
+        const float totalArea = glm::length(glm::cross(parallelogramLight.edge01, parallelogramLight.edge02));
+        const float sampleWeight = totalArea / float(areaLightSamples);
+        const glm::vec2 rotation = sampleRotation(vertexPos, uint32_t(lightIndex));
+        for (int i = 0; i < areaLightSamples; i++) {
+            const glm::vec2 sample = areaLightSample(uint32_t(i), uint32_t(areaLightSamples), rotation);
+            const glm::vec3 currentPos = parallelogramLight.v0 + sample.x * parallelogramLight.edge01 + sample.y * parallelogramLight.edge02;
+            //bilinear interpolation of the colors of the corners v0, v1 = v0 + edge01, v2 = v0 + edge02 and v0 + edge01 + edge02
+            const glm::vec3 currentPosColor = sampleWeight * ((1.0f - sample.x) * (1.0f - sample.y) * parallelogramLight.color0 + sample.x * (1.0f - sample.y) * parallelogramLight.color1 + (1.0f - sample.x) * sample.y * parallelogramLight.color2 + sample.x * sample.y * parallelogramLight.color3);
+
+            const PointLight pointLightCurrent = { currentPos, currentPosColor };
+            color += calculatePhongShading(ray, pointLightCurrent, hitInfo, scene, bvh);
+        }
+    }
+    return color;
+}
+
+// Shading of a ray that hit something. pointLightsOccluded can hold the result of the shadow ray towards every point light,
+// indexed like scene.lights, if those were already traced.
+static glm::vec3 shadeHit(const Scene& scene, const BoundingVolumeHierarchy& bvh, const LightBvh& lightBvh, const Ray& ray, const HitInfo& hitInfo, int recursion, const glm::vec3& throughput, const uint8_t* pointLightsOccluded = nullptr) {
+    glm::vec3 color = glm::vec3(0);
+    if (shadesEveryLight(scene)) {
+        for (size_t lightIndex = 0; lightIndex < scene.lights.size(); lightIndex++) {
+            const bool isPointLight = std::holds_alternative<PointLight>(scene.lights[lightIndex]);
+            const std::optional<bool> knownOcclusion = pointLightsOccluded && isPointLight ? std::optional(pointLightsOccluded[lightIndex] != 0) : std::nullopt;
+            color += shadeLight(scene, bvh, ray, hitInfo, lightIndex, knownOcclusion);
+        }
+    } else {
+        // Too many lights to shade them all: pick lightSamples of them, in proportion to how much they can contribute, and
+        // divide each by the probability of picking it. The k-th pick uses a number from the k-th of lightSamples equal
+        // parts of [0, 1), so the picks are spread over the lights instead of piling up on the brightest one.
+        const glm::vec3 vertexPos = ray.origin + ray.t * ray.direction;
+        const float rotation = sampleRotation(vertexPos, uint32_t(scene.lights.size())).x;
+        for (int i = 0; i < lightSamples; i++) {
+            const std::optional<LightBvh::Selection> selection = lightBvh.sample(vertexPos, hitInfo.normal, (float(i) + rotation) / float(lightSamples));
+            if (!selection)
+                break; // No light can contribute at this point
+            color += shadeLight(scene, bvh, ray, hitInfo, selection->lightIndex, std::nullopt) / (float(lightSamples) * selection->probability);
+        }
+    }
+    color += calculateReflection(ray, hitInfo, scene, bvh, lightBvh, recursion, throughput);
 
-        drawRay(ray, color);
-        return color;
+    drawRay(ray, color);
+    return color;
+}
+
+static glm::vec3 getFinalColor(const Scene& scene, const BoundingVolumeHierarchy& bvh, const LightBvh& lightBvh, Ray ray, int recursion, RayKind rayKind, const glm::vec3& throughput) {
+    HitInfo hitInfo;
+    if (bvh.intersect(ray, hitInfo, rayKind)) {
+        return shadeHit(scene, bvh, lightBvh, ray, hitInfo, recursion, throughput);
     } else {
         drawRay(ray, glm::vec3(1.0f, 0.0f, 0.0f)); // Draw a red debug ray if the ray missed.
         return glm::vec3(0.0f); // Set the color of the pixel to black if the ray misses.
@@ -267,21 +363,81 @@ static glm::vec3 getFinalColor(const Scene& scene, const BoundingVolumeHierarchy
 }
 
 static void setOpenGLMatrices(const Trackball& camera);
+static BoundingVolumeHierarchy buildBVH(Scene& scene, const BvhSettings& settings);
 static void drawLightsOpenGL(const Scene& scene, const Trackball& camera, int selectedLight);
 static void drawSceneOpenGL(const Scene& scene);
+static void printSceneStatistics(SceneType sceneType);
 
-glm::vec3 motionBlur(Ray camera, const Scene& scene, const BoundingVolumeHierarchy& bvh) {
+glm::vec3 motionBlur(Ray camera, const Scene& scene, const BoundingVolumeHierarchy& bvh, const LightBvh& lightBvh) {
     glm::vec3 average{ 0 };
     for(int i = 0; i < 10; i++) {
         camera.origin.x += 0.004f;
         camera.origin.y += 0.004f;
-        average += getFinalColor(scene, bvh, camera, 5);
+        average += getFinalColor(scene, bvh, lightBvh, camera, maxReflectionDepth);
     }
     return average / 10.0f;
 }
 
+// Renders the tile of rayPacketSize x rayPacketSize pixels that starts at (tileX, tileY). The camera rays of the tile are
+// traced as one packet, and so are the shadow rays of the hit pixels towards every point light. Coherent rays visit
+// mostly the same nodes, so the packet loads every node once instead of once per ray. The rest of the shading (area
+// lights and reflections) is done ray by ray. Gives the same image as getFinalColor for every pixel.
+static void renderTile(const Scene& scene, const Trackball& camera, const BoundingVolumeHierarchy& bvh, const LightBvh& lightBvh, Screen& screen, int tileX, int tileY)
+{
+    // Reused between the tiles of a thread, so that small tiles do not spend their time constructing 64 rays and hits.
+    thread_local std::array<Ray, MaxPacketSize> cameraRays;
+    thread_local std::array<HitInfo, MaxPacketSize> hitInfos;
+    std::array<bool, MaxPacketSize> hits;
+    std::array<glm::ivec2, MaxPacketSize> pixels;
+    size_t numRays = 0;
+    for (int y = tileY; y < std::min(tileY + rayPacketSize, windowResolution.y); y++) {
+        for (int x = tileX; x < std::min(tileX + rayPacketSize, windowResolution.x); x++) {
+            // NOTE: (-1, -1) at the bottom left of the screen, (+1, +1) at the top right of the screen.
+            const glm::vec2 normalizedPixelPos {
+                float(x) / windowResolution.x * 2.0f - 1.0f,
+                float(y) / windowResolution.y * 2.0f - 1.0f
+            };
+            pixels[numRays] = glm::ivec2(x, y);
+            hitInfos[numRays] = HitInfo {};
+            cameraRays[numRays++] = camera.generateRay(normalizedPixelPos);
+        }
+    }
+    bvh.intersectPacket(std::span(cameraRays.data(), numRays), std::span(hitInfos.data(), numRays), std::span(hits.data(), numRays));
+
+    // Occlusion of the point lights, per pixel indexed like scene.lights. Only if every light is shaded, otherwise each pixel
+    // picks its own lights.
+    const size_t numLights = shadesEveryLight(scene) ? scene.lights.size() : 0;
+    thread_local std::vector<uint8_t> pointLightsOccluded;
+    pointLightsOccluded.assign(numRays * numLights, 0);
+    thread_local std::array<Ray, MaxPacketSize> shadowRays;
+    std::array<size_t, MaxPacketSize> shadowRayPixels;
+    std::array<bool, MaxPacketSize> occluded;
+    for (size_t lightIndex = 0; lightIndex < numLights; lightIndex++) {
+        if (!std::holds_alternative<PointLight>(scene.lights[lightIndex]))
+            continue;
+        const PointLight& pointLight = std::get<PointLight>(scene.lights[lightIndex]);
+        size_t numShadowRays = 0;
+        for (size_t i = 0; i < numRays; i++) {
+            if (!hits[i])
+                continue;
+            const glm::vec3 vertexPos = cameraRays[i].origin + cameraRays[i].t * cameraRays[i].direction;
+            shadowRayPixels[numShadowRays] = i;
+            shadowRays[numShadowRays++] = makeShadowRay(vertexPos, pointLight.position);
+        }
+        bvh.occludedPacket(std::span(shadowRays.data(), numShadowRays), std::span(occluded.data(), numShadowRays));
+        for (size_t i = 0; i < numShadowRays; i++)
+            pointLightsOccluded[shadowRayPixels[i] * numLights + lightIndex] = occluded[i];
+    }
+
+    for (size_t i = 0; i < numRays; i++) {
+        const glm::vec3 color = hits[i] ? shadeHit(scene, bvh, lightBvh, cameraRays[i], hitInfos[i], maxReflectionDepth, glm::vec3(1.0f), numLights ? pointLightsOccluded.data() + i * numLights : nullptr) : glm::vec3(0.0f);
+        screen.setPixel(pixels[i].x, pixels[i].y, color);
+    }
+}
+
 // This is the main rendering function. You are free to change this function in any way (including the function signature).
 static void renderRayTracing(const Scene& scene, const Trackball& camera, const BoundingVolumeHierarchy& bvh, Screen& screen) {
+    const LightBvh lightBvh { scene.lights };
     if(blur) {
     #ifndef NDEBUG
         // Single threaded in debug mode
@@ -293,7 +449,7 @@ static void renderRayTracing(const Scene& scene, const Trackball& camera, const
                         float(y) / windowResolution.y * 2.0f - 1.0f
                 };
                 const Ray cameraRay = camera.generateRay(normalizedPixelPos);
-                screen.setPixel(x, y, motionBlur(cameraRay,scene, bvh));
+                screen.setPixel(x, y, motionBlur(cameraRay,scene, bvh, lightBvh));
             }
         }
     #else
@@ -308,11 +464,30 @@ static void renderRayTracing(const Scene& scene, const Trackball& camera, const
                     float(y) / windowResolution.y * 2.0f - 1.0f
                 };
                 const Ray cameraRay = camera.generateRay(normalizedPixelPos);
-                screen.setPixel(x, y, motionBlur(cameraRay, scene, bvh));
+                screen.setPixel(x, y, motionBlur(cameraRay, scene, bvh, lightBvh));
             }
         }
     });
     #endif
+    } else if (rayPacketSize > 1) {
+    #ifndef NDEBUG
+        // Single threaded in debug mode
+        for (int y = 0; y < windowResolution.y; y += rayPacketSize) {
+            for (int x = 0; x < windowResolution.x; x += rayPacketSize)
+                renderTile(scene, camera, bvh, lightBvh, screen, x, y);
+        }
+    #else
+        // Multi-threaded in release mode, one task per range of tiles
+        const int numTilesY = (windowResolution.y + rayPacketSize - 1) / rayPacketSize;
+        const int numTilesX = (windowResolution.x + rayPacketSize - 1) / rayPacketSize;
+        const tbb::blocked_range2d<int, int> tileRange { 0, numTilesY, 0, numTilesX };
+        tbb::parallel_for(tileRange, [&](tbb::blocked_range2d<int, int> localRange) {
+            for (int tileY = std::begin(localRange.rows()); tileY != std::end(localRange.rows()); tileY++) {
+                for (int tileX = std::begin(localRange.cols()); tileX != std::end(localRange.cols()); tileX++)
+                    renderTile(scene, camera, bvh, lightBvh, screen, tileX * rayPacketSize, tileY * rayPacketSize);
+            }
+        });
+    #endif
     } else {
         #ifndef NDEBUG
         // Single threaded in debug mode
@@ -324,7 +499,7 @@ static void renderRayTracing(const Scene& scene, const Trackball& camera, const
                         float(y) / windowResolution.y * 2.0f - 1.0f
                 };
                 const Ray cameraRay = camera.generateRay(normalizedPixelPos);
-                screen.setPixel(x, y, getFinalColor(scene, bvh, cameraRay, 5));
+                screen.setPixel(x, y, getFinalColor(scene, bvh, lightBvh, cameraRay, maxReflectionDepth));
             }
         }
         #else
@@ -339,7 +514,7 @@ static void renderRayTracing(const Scene& scene, const Trackball& camera, const
                         float(y) / windowResolution.y * 2.0f - 1.0f
                     };
                     const Ray cameraRay = camera.generateRay(normalizedPixelPos);
-                    screen.setPixel(x, y, getFinalColor(scene, bvh, cameraRay, 5));
+                    screen.setPixel(x, y, getFinalColor(scene, bvh, lightBvh, cameraRay, maxReflectionDepth));
                 }
             }
         });
@@ -349,6 +524,21 @@ static void renderRayTracing(const Scene& scene, const Trackball& camera, const
 
 int main(int argc, char** argv)
 {
+    if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+        runBenchmarks(dataPath);
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bvh-statistics") {
+        // Either the scene with the given number (in the order of the scene list in the UI), or every scene.
+        if (argc > 2) {
+            printSceneStatistics(SceneType(std::stoi(argv[2])));
+        } else {
+            for (SceneType sceneType : { SingleTriangle, Cube, CornellBox, CornellBoxParallelogramLight, Monkey, Teapot, Spheres, InstancedTeapots, ManyShapes, ManyLights })
+                printSceneStatistics(sceneType);
+        }
+        return 0;
+    }
+
     Trackball::printHelp();
     std::cout << "\n Press the [R] key on your keyboard to create a ray towards the mouse cursor" << std::endl
               << std::endl;
@@ -361,7 +551,9 @@ int main(int argc, char** argv)
     SceneType sceneType { SceneType::SingleTriangle };
     std::optional<Ray> optDebugRay;
     Scene scene = loadScene(sceneType, dataPath);
-    BoundingVolumeHierarchy bvh { &scene };
+    BvhSettings bvhSettings {};
+    bvhSettings.cacheDirectory = bvhCacheDirectory;
+    BoundingVolumeHierarchy bvh = buildBVH(scene, bvhSettings);
 
     int bvhDebugLevel = 0;
     bool debugBVH { false };
@@ -390,12 +582,13 @@ int main(int argc, char** argv)
         // === Setup the UI ===
         ImGui::Begin("Final Project");
         {
-            constexpr std::array items { "SingleTriangle", "Cube (segment light)", "Cornell Box (with mirror)", "Cornell Box (parallelogram light and mirror)", "Monkey", "Teapot", "Dragon", /* "AABBs",*/ "Spheres", /*"Mixed",*/ "Custom" };
+            constexpr std::array items { "SingleTriangle", "Cube (segment light)", "Cornell Box (with mirror)", "Cornell Box (parallelogram light and mirror)", "Monkey", "Teapot", "Dragon", /* "AABBs",*/ "Spheres", /*"Mixed",*/ "Custom", "Teapots (instanced)", "Spheres and boxes (8000)", "Cornell Box (1024 point lights)" };
             if (ImGui::Combo("Scenes", reinterpret_cast<int*>(&sceneType), items.data(), int(items.size()))) {
                 optDebugRay.reset();
                 scene = loadScene(sceneType, dataPath);
                 selectedLightIdx = scene.lights.empty() ? -1 : 0;
-                bvh = BoundingVolumeHierarchy(&scene);
+                bvh = buildBVH(scene, bvhSettings);
+                bvhDebugLevel = std::min(bvhDebugLevel, bvh.numLevels() - 1);
                 if (optDebugRay) {
                     HitInfo dummy {};
                     bvh.intersect(*optDebugRay, dummy);
@@ -406,6 +599,11 @@ int main(int argc, char** argv)
             constexpr std::array items { "Rasterization", "Ray Traced" };
             ImGui::Combo("View mode", reinterpret_cast<int*>(&viewMode), items.data(), int(items.size()));
         }
+        ImGui::SliderInt("Area light samples", &areaLightSamples, 1, 256);
+        ImGui::SliderInt("Light samples", &lightSamples, 1, 64);
+        ImGui::SliderInt("Max reflection depth", &maxReflectionDepth, 0, 16);
+        ImGui::SliderFloat("Min reflection throughput", &minReflectionThroughput, 0.0f, 0.5f);
+        ImGui::Checkbox("Russian roulette", &russianRoulette);
         if (ImGui::Button("Render to file")) {
             // Show a file picker.
             nfdchar_t* pOutPath = nullptr;
@@ -417,15 +615,64 @@ int main(int argc, char** argv)
 
                 // Perform a new render and measure the time it took to generate the image.
                 using clock = std::chrono::high_resolution_clock;
+                BoundingVolumeHierarchy::resetTraversalStatistics();
                 const auto start = clock::now();
                 renderRayTracing(scene, camera, bvh, screen);
                 const auto end = clock::now();
                 std::cout << "Time to render image: " << std::chrono::duration<float, std::milli>(end - start).count() << " milliseconds" << std::endl;
+                printTraversalStatistics(std::cout, BoundingVolumeHierarchy::traversalStatistics());
 
                 // Store the new image.
                 screen.writeBitmapToFile(outPath);
             }
         }
+        ImGui::Spacing();
+        ImGui::Separator();
+        ImGui::Text("Acceleration structure");
+        {
+            bool rebuild = false;
+            constexpr std::array builders { "Median split", "Binned SAH", "Binned SAH + spatial splits", "Linear (Morton codes)" };
+            rebuild |= ImGui::Combo("BVH builder", reinterpret_cast<int*>(&bvhSettings.builder), builders.data(), int(builders.size()));
+            rebuild |= ImGui::SliderInt("Max levels", &bvhSettings.maxLevels, 1, 64);
+            rebuild |= ImGui::SliderInt("Max leaf size", &bvhSettings.maxLeafSize, 1, 64);
+            if (bvhSettings.builder == BvhBuilder::BinnedSAH || bvhSettings.builder == BvhBuilder::SpatialSplitSAH) {
+                rebuild |= ImGui::SliderInt("SAH bins", &bvhSettings.numBins, 2, 64);
+                rebuild |= ImGui::SliderFloat("Traversal cost", &bvhSettings.traversalCost, 0.0f, 8.0f);
+                rebuild |= ImGui::SliderFloat("Intersection cost", &bvhSettings.intersectionCost, 0.1f, 8.0f);
+            }
+            if (bvhSettings.builder == BvhBuilder::SpatialSplitSAH)
+                rebuild |= ImGui::SliderFloat("Max duplication", &bvhSettings.maxDuplication, 0.0f, 2.0f);
+            rebuild |= ImGui::Checkbox("Optimize treelets", &bvhSettings.optimizeTreelets);
+            if (bvhSettings.optimizeTreelets)
+                rebuild |= ImGui::SliderInt("Treelet size", &bvhSettings.treeletSize, 3, MaxTreeletSize);
+            bool useCache = !bvhSettings.cacheDirectory.empty();
+            if (ImGui::Checkbox("Cache BVH on disk", &useCache))
+                bvhSettings.cacheDirectory = useCache ? bvhCacheDirectory : std::filesystem::path {};
+            constexpr std::array layouts { "Binary", "4-wide (SSE)", "8-wide (AVX2)", "Widest supported", "4-wide compressed", "8-wide compressed (AVX2)" };
+            rebuild |= ImGui::Combo("BVH layout", reinterpret_cast<int*>(&bvhSettings.layout), layouts.data(), int(layouts.size()));
+            if (bvhSettings.layout == BvhLayout::Binary) {
+                constexpr std::array traversals { "Recursive", "Stack (front-to-back)" };
+                if (ImGui::Combo("BVH traversal", reinterpret_cast<int*>(&bvhSettings.traversal), traversals.data(), int(traversals.size())))
+                    bvh.settings.traversal = bvhSettings.traversal;
+            }
+            constexpr std::array triangleTests { "Original", "Precomputed (Moller-Trumbore)", "Watertight", "Precomputed, 4 per leaf test (SSE)", "Precomputed, 8 per leaf test (AVX2)" };
+            // Rebuilds, because only the precomputed tests keep the edges of the triangles.
+            rebuild |= ImGui::Combo("Triangle test", reinterpret_cast<int*>(&bvhSettings.triangleTest), triangleTests.data(), int(triangleTests.size()));
+            constexpr std::array packetSizes { "Off (ray by ray)", "2x2 pixels", "4x4 pixels", "8x8 pixels" };
+            int packetSizeIndex = std::countr_zero(unsigned(rayPacketSize));
+            if (ImGui::Combo("Ray packets", &packetSizeIndex, packetSizes.data(), int(packetSizes.size())))
+                rayPacketSize = 1 << packetSizeIndex;
+            if (rebuild) {
+                bvh = buildBVH(scene, bvhSettings);
+                bvhDebugLevel = std::min(bvhDebugLevel, bvh.numLevels() - 1);
+            }
+            if (ImGui::Button("Print BVH statistics")) {
+                // Includes the traversal work of all rays traced since the last render to file.
+                printBvhStatistics(std::cout, computeBvhStatistics(bvh));
+                printTraversalStatistics(std::cout, BoundingVolumeHierarchy::traversalStatistics());
+            }
+        }
+
         ImGui::Spacing();
         ImGui::Separator();
         ImGui::Text("Debugging");
@@ -552,7 +799,7 @@ int main(int argc, char** argv)
                 // Call getFinalColor for the debug ray. Ignore the result but tell the function that it should
                 // draw the rays instead.
                 enableDrawRay = true;
-                (void)getFinalColor(scene, bvh, *optDebugRay, 5);
+                (void)getFinalColor(scene, bvh, LightBvh(scene.lights), *optDebugRay, maxReflectionDepth);
                 enableDrawRay = false;
             }
             glPopAttrib();
@@ -592,6 +839,45 @@ int main(int argc, char** argv)
     return 0;
 }
 
+static BoundingVolumeHierarchy buildBVH(Scene& scene, const BvhSettings& settings)
+{
+    // Build the BVH and measure the time it took, so that builders can be compared.
+    using clock = std::chrono::high_resolution_clock;
+    const auto start = clock::now();
+    BoundingVolumeHierarchy bvh { &scene, settings };
+    const auto end = clock::now();
+    std::cout << "Time to " << (bvh.loadedFromCache ? "load cached" : "build") << " BVH: " << std::chrono::duration<float, std::milli>(end - start).count() << " milliseconds (" << bvh.numLevels() << " levels)" << std::endl;
+    return bvh;
+}
+
+// Prints the statistics of the trees of the scene, and of the traversal while ray tracing one image of it from the same
+// position as the camera of the UI before it is rotated (at z = -3 looking towards +z).
+static void printSceneStatistics(SceneType sceneType)
+{
+    std::cout << "Scene " << int(sceneType) << std::endl;
+    Scene scene = loadScene(sceneType, dataPath);
+    const BoundingVolumeHierarchy bvh = buildBVH(scene, BvhSettings {});
+    const LightBvh lightBvh { scene.lights };
+    printBvhStatistics(std::cout, computeBvhStatistics(bvh));
+
+    BoundingVolumeHierarchy::resetTraversalStatistics();
+    const float halfScreenPlaneSize = std::tan(glm::radians(50.0f) / 2.0f);
+    const tbb::blocked_range2d<int, int> windowRange { 0, windowResolution.y, 0, windowResolution.x };
+    tbb::parallel_for(windowRange, [&](tbb::blocked_range2d<int, int> localRange) {
+        for (int y = std::begin(localRange.rows()); y != std::end(localRange.rows()); y++) {
+            for (int x = std::begin(localRange.cols()); x != std::end(localRange.cols()); x++) {
+                const glm::vec2 normalizedPixelPos {
+                    float(x) / windowResolution.x * 2.0f - 1.0f,
+                    float(y) / windowResolution.y * 2.0f - 1.0f
+                };
+                const glm::vec3 direction { -normalizedPixelPos.x * halfScreenPlaneSize, normalizedPixelPos.y * halfScreenPlaneSize, 1.0f };
+                getFinalColor(scene, bvh, lightBvh, Ray { glm::vec3(0.0f, 0.0f, -3.0f), glm::normalize(direction) }, maxReflectionDepth);
+            }
+        }
+    });
+    printTraversalStatistics(std::cout, BoundingVolumeHierarchy::traversalStatistics());
+}
+
 static void setOpenGLMatrices(const Trackball& camera)
 {
     // Load view matrix.
@@ -53,6 +53,89 @@ bool intersectRayWithTriangle(const glm::vec3& v0, const glm::vec3& v1, const gl
     } return false;
 }
 
+TriangleRecord makeTriangleRecord(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2)
+{
+    return TriangleRecord { v0, v1 - v0, v2 - v0 };
+}
+
+bool intersectRayWithTriangle(const TriangleRecord& triangle, const Ray& ray, TriangleHit& hit)
+{
+    const glm::vec3 p = glm::cross(ray.direction, triangle.edge2);
+    const float determinant = glm::dot(triangle.edge1, p);
+    if (determinant == 0.0f)
+        return false; // The ray is parallel to the triangle
+    const float invDeterminant = 1.0f / determinant;
+
+    const glm::vec3 toOrigin = ray.origin - triangle.v0;
+    const float u = glm::dot(toOrigin, p) * invDeterminant;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+    const glm::vec3 q = glm::cross(toOrigin, triangle.edge1);
+    const float v = glm::dot(ray.direction, q) * invDeterminant;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+    const float t = glm::dot(triangle.edge2, q) * invDeterminant;
+    if (!(t > 0.0f && t < ray.t))
+        return false;
+    hit = TriangleHit { t, u, v };
+    return true;
+}
+
+WatertightRay::WatertightRay(const Ray& ray)
+    : origin(ray.origin)
+{
+    const glm::vec3 size = glm::abs(ray.direction);
+    kz = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    // Keep the winding of the triangles the same after the permutation.
+    if (ray.direction[kz] < 0.0f)
+        std::swap(kx, ky);
+    shear = glm::vec3(ray.direction[kx] / ray.direction[kz], ray.direction[ky] / ray.direction[kz], 1.0f / ray.direction[kz]);
+}
+
+bool intersectRayWithTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const WatertightRay& ray, float tMax, TriangleHit& hit)
+{
+    const glm::vec3 a = v0 - ray.origin;
+    const glm::vec3 b = v1 - ray.origin;
+    const glm::vec3 c = v2 - ray.origin;
+    const float ax = a[ray.kx] - ray.shear.x * a[ray.kz];
+    const float ay = a[ray.ky] - ray.shear.y * a[ray.kz];
+    const float bx = b[ray.kx] - ray.shear.x * b[ray.kz];
+    const float by = b[ray.ky] - ray.shear.y * b[ray.kz];
+    const float cx = c[ray.kx] - ray.shear.x * c[ray.kz];
+    const float cy = c[ray.ky] - ray.shear.y * c[ray.kz];
+
+    // Scaled barycentric coordinates: the signed areas of the edges as seen along the ray.
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    // Exactly on an edge the sign decides which triangle is hit, so compute it without rounding errors.
+    if (u == 0.0f || v == 0.0f || w == 0.0f) {
+        u = float(double(cx) * double(by) - double(cy) * double(bx));
+        v = float(double(ax) * double(cy) - double(ay) * double(cx));
+        w = float(double(bx) * double(ay) - double(by) * double(ax));
+    }
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+        return false;
+    const float determinant = u + v + w;
+    if (determinant == 0.0f)
+        return false;
+
+    const float az = ray.shear.z * a[ray.kz];
+    const float bz = ray.shear.z * b[ray.kz];
+    const float cz = ray.shear.z * c[ray.kz];
+    const float scaledT = u * az + v * bz + w * cz;
+    // Compare before dividing: both sides of the triangle count, so flip the signs for a negative determinant.
+    const float sign = determinant < 0.0f ? -1.0f : 1.0f;
+    if (!(sign * scaledT > 0.0f && sign * scaledT < tMax * sign * determinant))
+        return false;
+
+    const float invDeterminant = 1.0f / determinant;
+    hit = TriangleHit { scaledT * invDeterminant, v * invDeterminant, w * invDeterminant };
+    return true;
+}
+
 /// Input: a sphere with the following attributes: sphere.radius, sphere.center
 /// Output: if intersects then modify the hit parameter ray.t and return true, otherwise return false
 bool intersectRayWithShape(const Sphere& sphere, Ray& ray, HitInfo& hitInfo)
@@ -70,6 +153,7 @@ bool intersectRayWithShape(const Sphere& sphere, Ray& ray, HitInfo& hitInfo)
         if ((-B) / (2 * A) > 0 && (-B) / (2 * A) < ray.t) { //the intersection is in front of the camera and nearer than the previous intersection
             ray.t = (-B) / (2 * A);
             hitInfo.normal = glm::normalize((ray.origin + ray.t * ray.direction) - sphere.center);
+            hitInfo.materialId = sphere.materialId;
             return true;
         }
         else return false;
@@ -81,19 +165,19 @@ bool intersectRayWithShape(const Sphere& sphere, Ray& ray, HitInfo& hitInfo)
         if (first < 0 && second > 0 && second < ray.t) { //if the origin is in the sphere, choose the intersection in front
             ray.t = second;
             hitInfo.normal = glm::normalize((ray.origin + ray.t * ray.direction) - sphere.center);
-            hitInfo.material = sphere.material;
+            hitInfo.materialId = sphere.materialId;
             return true;
         }
         else if (second < 0 && first > 0 && first < ray.t) { //if the origin is in the sphere, choose the intersection in front
             ray.t = first;
             hitInfo.normal = glm::normalize((ray.origin + ray.t * ray.direction) - sphere.center);
-            hitInfo.material = sphere.material;
+            hitInfo.materialId = sphere.materialId;
             return true;
         }
         else if (first > 0 && second > 0 && glm::min(first, second) < ray.t) { //both of the intersections are in front of the camera
             ray.t = glm::min(first, second); //choose the smallest one if it's nearer than the previous intersection.
             hitInfo.normal = glm::normalize((ray.origin + ray.t * ray.direction) - sphere.center);
-            hitInfo.material = sphere.material;
+            hitInfo.materialId = sphere.materialId;
             return true;
         }
         else {
@@ -102,9 +186,57 @@ bool intersectRayWithShape(const Sphere& sphere, Ray& ray, HitInfo& hitInfo)
     }
 }
 
+RayInverse::RayInverse(const Ray& ray)
+    : origin(ray.origin)
+    , invDirection(1.0f / ray.direction)
+    , negative(glm::lessThan(invDirection, glm::vec3(0.0f)))
+{
+}
+
 /// Input: an axis-aligned bounding box with the following parameters: minimum coordinates box.lower and maximum coordinates box.upper
 /// Output: if intersects then modify the hit parameter ray.t and return true, otherwise return false
 bool intersectRayWithShape(const AxisAlignedBox& box, Ray& ray)
+{
+    float tEntry, tExit;
+    if (!intersectRayWithBox(box.lower, box.upper, RayInverse(ray), ray.t, tEntry, tExit))
+        return false;
+
+    // Like the other shapes, report the first surface in front of the origin: the exit point if the ray starts inside.
+    const float t = tEntry > 0.0f ? tEntry : tExit;
+    if (t <= 0.0f || t >= ray.t)
+        return false;
+    ray.t = t;
+    return true;
+}
+
+bool intersectRayWithShape(const Box& box, Ray& ray, HitInfo& hitInfo)
+{
+    if (!intersectRayWithShape(box.shape, ray))
+        return false;
+
+    // The hit point lies on the face that it is closest to, the normal points out of that face.
+    const glm::vec3 point = ray.origin + ray.t * ray.direction;
+    const glm::vec3 toLower = glm::abs(point - box.shape.lower);
+    const glm::vec3 toUpper = glm::abs(point - box.shape.upper);
+    float closest = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++) {
+        if (toLower[axis] < closest) {
+            closest = toLower[axis];
+            hitInfo.normal = glm::vec3(0.0f);
+            hitInfo.normal[axis] = -1.0f;
+        }
+        if (toUpper[axis] < closest) {
+            closest = toUpper[axis];
+            hitInfo.normal = glm::vec3(0.0f);
+            hitInfo.normal[axis] = 1.0f;
+        }
+    }
+    hitInfo.materialId = box.materialId;
+    return true;
+}
+
+/// The original box test: splits the box into 12 triangles and intersects each of them. Only used as a baseline by the box test benchmark.
+bool intersectRayWithBoxTriangles(const AxisAlignedBox& box, Ray& ray)
 {
     glm::vec3 min = box.lower;
     glm::vec3 max = box.upper;
@@ -1,10 +1,12 @@
 #pragma once
 #include "scene.h"
 #include "glm/mat3x3.hpp"
+#include <algorithm>
 
 struct HitInfo {
     glm::vec3 normal;
-    Material material;
+    uint32_t materialId; // Index into Scene::materials
+    glm::vec3 kd; // Diffuse color at the hit: the texel of the texture if the material has one, otherwise Material::kd
     glm::mat3 finalTriangleVertices;
 };
 
@@ -16,5 +18,71 @@ bool pointInTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3&
 Plane trianglePlane(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
 
 bool intersectRayWithTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, Ray& ray, HitInfo& hitInfo);
+// Distance and barycentric weights of a ray/triangle hit, as returned by the fused triangle tests below. The first
+// vertex has weight 1 - u - v.
+struct TriangleHit {
+    float t;
+    float u; // Weight of the second vertex
+    float v; // Weight of the third vertex
+};
+
+// Per-triangle data for the Möller–Trumbore test, computed once when the BVH is built: the first vertex and the two
+// edges from it.
+struct TriangleRecord {
+    glm::vec3 v0;
+    glm::vec3 edge1; // v1 - v0
+    glm::vec3 edge2; // v2 - v0
+};
+TriangleRecord makeTriangleRecord(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
+
+// Möller–Trumbore: returns true if the ray hits the triangle (from either side) at a distance in (0, ray.t) and
+// stores the hit in hit. Does not modify the ray. Much cheaper than intersectRayWithTriangle, but a ray through an
+// edge shared by two triangles can slip between them because of rounding.
+bool intersectRayWithTriangle(const TriangleRecord& triangle, const Ray& ray, TriangleHit& hit);
+
+// Per-ray data for the watertight test, computed once and reused for every triangle that the ray is tested against.
+struct WatertightRay {
+    WatertightRay(const Ray& ray);
+
+    glm::vec3 origin;
+    int kx, ky, kz; // Axes permuted so that kz is the largest component of the direction
+    glm::vec3 shear; // Shear that maps the direction onto the kz axis, and 1 / direction[kz]
+};
+
+// Watertight ray/triangle test (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection"): the triangle is
+// moved into a space where the ray runs along an axis, so that every edge is tested in the same way by both of its
+// triangles and a ray through a shared edge or vertex always hits at least one of them. Same results as above otherwise.
+bool intersectRayWithTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const WatertightRay& ray, float tMax, TriangleHit& hit);
+
 bool intersectRayWithShape(const Sphere& sphere, Ray& ray, HitInfo& hitInfo);
 bool intersectRayWithShape(const AxisAlignedBox& box, Ray& ray);
+bool intersectRayWithShape(const Box& box, Ray& ray, HitInfo& hitInfo);
+bool intersectRayWithBoxTriangles(const AxisAlignedBox& box, Ray& ray);
+
+// Per-ray data for the slab test, computed once and reused for every box that the ray is tested against.
+struct RayInverse {
+    RayInverse() = default;
+    RayInverse(const Ray& ray);
+
+    glm::vec3 origin;
+    glm::vec3 invDirection; // 1 / ray.direction (infinite for axis-parallel directions)
+    glm::bvec3 negative; // Sign mask: per axis, whether the ray travels towards lower coordinates (also set for -0)
+};
+
+// Slab test: returns true if the ray overlaps the box somewhere in [0, tMax] and stores the distances at which
+// it enters and leaves the box. tEntry is 0 when the ray starts inside the box.
+inline bool intersectRayWithBox(const glm::vec3& lower, const glm::vec3& upper, const RayInverse& ray, float tMax, float& tEntry, float& tExit)
+{
+    // The sign mask picks the slab plane that the ray crosses first on each axis, so no min/max swaps are needed.
+    const float nearX = ((ray.negative.x ? upper.x : lower.x) - ray.origin.x) * ray.invDirection.x;
+    const float farX = ((ray.negative.x ? lower.x : upper.x) - ray.origin.x) * ray.invDirection.x;
+    const float nearY = ((ray.negative.y ? upper.y : lower.y) - ray.origin.y) * ray.invDirection.y;
+    const float farY = ((ray.negative.y ? lower.y : upper.y) - ray.origin.y) * ray.invDirection.y;
+    const float nearZ = ((ray.negative.z ? upper.z : lower.z) - ray.origin.z) * ray.invDirection.z;
+    const float farZ = ((ray.negative.z ? lower.z : upper.z) - ray.origin.z) * ray.invDirection.z;
+
+    // The accumulated value is the first argument so that a NaN slab (0 * infinity) is ignored instead of propagated.
+    tEntry = std::max(std::max(std::max(0.0f, nearX), nearY), nearZ);
+    tExit = std::min(std::min(std::min(tMax, farX), farY), farZ);
+    return tEntry <= tExit;
+}
@@ -1,5 +1,12 @@
 #include "scene.h"
+// Suppress warnings in third-party code.
+#include <framework/disable_all_warnings.h>
+DISABLE_WARNINGS_PUSH()
+#include <glm/common.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+DISABLE_WARNINGS_POP()
 #include <iostream>
+#include <random>
 
 Scene loadScene(SceneType type, const std::filesystem::path& dataDir)
 {
@@ -71,9 +78,9 @@ Scene loadScene(SceneType type, const std::filesystem::path& dataDir)
         //scene.boxes.push_back(AxisAlignedBox { glm::vec3(0.5f, 0.5f, 2.0f), glm::vec3(0.9f, 0.9f, 2.5f) });
     } break;*/
     case Spheres: {
-        scene.spheres.push_back(Sphere { glm::vec3(3.0f, -2.0f, 10.2f), 1.0f, Material { glm::vec3(0.8f, 0.2f, 0.2f) } });
-        scene.spheres.push_back(Sphere { glm::vec3(-2.0f, 2.0f, 4.0f), 2.0f, Material { glm::vec3(0.6f, 0.8f, 0.2f) } });
-        scene.spheres.push_back(Sphere { glm::vec3(0.0f, 0.0f, 6.0f), 0.75f, Material { glm::vec3(0.2f, 0.2f, 0.8f) } });
+        scene.spheres.push_back(Sphere { glm::vec3(3.0f, -2.0f, 10.2f), 1.0f, addMaterial(scene, Material { glm::vec3(0.8f, 0.2f, 0.2f) }) });
+        scene.spheres.push_back(Sphere { glm::vec3(-2.0f, 2.0f, 4.0f), 2.0f, addMaterial(scene, Material { glm::vec3(0.6f, 0.8f, 0.2f) }) });
+        scene.spheres.push_back(Sphere { glm::vec3(0.0f, 0.0f, 6.0f), 0.75f, addMaterial(scene, Material { glm::vec3(0.2f, 0.2f, 0.8f) }) });
         scene.lights.push_back(PointLight { glm::vec3(3, 0, 3), glm::vec3(1) });
     } break;
     case Custom: {
@@ -85,7 +92,77 @@ Scene loadScene(SceneType type, const std::filesystem::path& dataDir)
         // Spherical light: position, radius, color
         //scene.lights.push_back(SphericalLight{ glm::vec3(0, 1.5f, 0), 0.2f, glm::vec3(1) });
     } break;
+    case InstancedTeapots: {
+        // A 10x10x10 grid of randomly rotated copies of the teapot, which all share the geometry of a single mesh.
+        auto subMeshes = loadMesh(dataDir / "teapot.obj", true);
+        std::move(std::begin(subMeshes), std::end(subMeshes), std::back_inserter(scene.meshes));
+        std::mt19937 rng { 1234 };
+        std::uniform_real_distribution<float> angle { 0.0f, glm::radians(360.0f) };
+        for (int x = 0; x < 10; x++) {
+            for (int y = 0; y < 10; y++) {
+                for (int z = 0; z < 10; z++) {
+                    glm::mat4 transform = glm::translate(glm::mat4(1.0f), 0.3f * glm::vec3(float(x) - 4.5f, float(y) - 4.5f, float(z) - 4.5f));
+                    transform = glm::rotate(transform, angle(rng), glm::vec3(0, 1, 0));
+                    transform = glm::scale(transform, glm::vec3(0.1f));
+                    for (size_t meshIndex = 0; meshIndex < scene.meshes.size(); meshIndex++)
+                        scene.instances.push_back(MeshInstance { meshIndex, transform });
+                }
+            }
+        }
+        scene.lights.push_back(PointLight { glm::vec3(-3, 3, -3), glm::vec3(1) });
+    } break;
+    case ManyShapes: {
+        // A 20x20x20 grid of small spheres and boxes with random colors, jittered a bit so that they do not line up.
+        std::mt19937 rng { 1234 };
+        std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+        for (int x = 0; x < 20; x++) {
+            for (int y = 0; y < 20; y++) {
+                for (int z = 0; z < 20; z++) {
+                    const glm::vec3 center = 0.1f * glm::vec3(float(x) - 9.5f, float(y) - 9.5f, float(z) - 9.5f) + 0.02f * glm::vec3(unit(rng), unit(rng), unit(rng));
+                    const uint32_t materialId = addMaterial(scene, Material { glm::vec3(unit(rng), unit(rng), unit(rng)) });
+                    if ((x + y + z) % 4 == 0)
+                        scene.boxes.push_back(Box { AxisAlignedBox { center - 0.025f, center + 0.025f }, materialId });
+                    else
+                        scene.spheres.push_back(Sphere { center, 0.03f, materialId });
+                }
+            }
+        }
+        scene.lights.push_back(PointLight { glm::vec3(-3, 3, -3), glm::vec3(1) });
+    } break;
+    case ManyLights: {
+        // The Cornell box, lit by a 32x32 grid of small point lights with random colors below the ceiling instead of a
+        // single one. Together they are about as bright as the white light of the CornellBox scene.
+        auto subMeshes = loadMesh(dataDir / "CornellBox-Mirror-Rotated.obj", true);
+        std::move(std::begin(subMeshes), std::end(subMeshes), std::back_inserter(scene.meshes));
+        std::mt19937 rng { 1234 };
+        std::uniform_real_distribution<float> unit { 0.0f, 1.0f };
+        for (int x = 0; x < 32; x++) {
+            for (int z = 0; z < 32; z++) {
+                const glm::vec3 position { 0.8f * (float(x) - 15.5f) / 31.0f, 0.5f, 0.8f * (float(z) - 15.5f) / 31.0f };
+                scene.lights.push_back(PointLight { position, (2.0f / 1024.0f) * glm::vec3(unit(rng), unit(rng), unit(rng)) });
+            }
+        }
+    } break;
     };
 
+    addMeshMaterials(scene);
     return scene;
 }
+
+uint32_t addMaterial(Scene& scene, const Material& material)
+{
+    scene.materials.push_back(material);
+    return uint32_t(scene.materials.size() - 1);
+}
+
+void addMeshMaterials(Scene& scene)
+{
+    for (size_t meshIndex = scene.meshMaterialIds.size(); meshIndex < scene.meshes.size(); meshIndex++)
+        scene.meshMaterialIds.push_back(addMaterial(scene, scene.meshes[meshIndex].material));
+}
+
+float surfaceArea(const glm::vec3& lower, const glm::vec3& upper)
+{
+    const glm::vec3 size = glm::max(upper - lower, glm::vec3(0.0f));
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
@@ -2,6 +2,7 @@
 // Suppress warnings in third-party code.
 #include <framework/disable_all_warnings.h>
 DISABLE_WARNINGS_PUSH()
+#include <glm/mat4x4.hpp>
 #include <glm/vec3.hpp>
 DISABLE_WARNINGS_POP()
 #include <filesystem>
@@ -22,7 +23,10 @@ enum SceneType {
     //AABBs,
     Spheres,
     //Mixed,
-    Custom
+    Custom,
+    InstancedTeapots,
+    ManyShapes,
+    ManyLights
 };
 
 struct Plane {
@@ -35,10 +39,20 @@ struct AxisAlignedBox {
     glm::vec3 upper { 1.0f };
 };
 
+// Surface area of the box between lower and upper, which the SAH uses as the chance that a ray passes through it.
+// Negative extents count as 0, so an empty box (lower above upper) has no area.
+float surfaceArea(const glm::vec3& lower, const glm::vec3& upper);
+
 struct Sphere {
     glm::vec3 center { 0.0f };
     float radius = 1.0f;
-    Material material;
+    uint32_t materialId = 0; // Index into Scene::materials
+};
+
+// Solid box placed in the scene. AxisAlignedBox itself is only the shape, which is also used for bounding boxes.
+struct Box {
+    AxisAlignedBox shape;
+    uint32_t materialId = 0; // Index into Scene::materials
 };
 
 struct PointLight {
@@ -60,13 +74,33 @@ struct ParallelogramLight {
 
 };
 
+// Places one of the meshes of the scene in the world. A mesh can be placed any number of times while its
+// vertices are only stored (and its BVH only built) once.
+struct MeshInstance {
+    size_t meshIndex;
+    glm::mat4 transform { 1.0f }; // From the coordinates of the mesh to world coordinates
+};
+
 struct Scene {
     std::vector<Mesh> meshes;
+    std::vector<MeshInstance> instances; // If empty, every mesh is placed once at its own coordinates.
     std::vector<Sphere> spheres;
-    //std::vector<AxisAlignedBox> boxes;
+    std::vector<Box> boxes;
+
+    // Material table: every material is stored once, and the meshes, shapes and ray hits refer to it by index.
+    std::vector<Material> materials;
+    // Material of every mesh in materials, see addMeshMaterials. Mesh::material is only used for rasterization.
+    std::vector<uint32_t> meshMaterialIds;
 
     std::vector<std::variant<PointLight, SegmentLight, ParallelogramLight>> lights;
 };
 
 // Load a prebuilt scene.
 Scene loadScene(SceneType type, const std::filesystem::path& dataDir);
+
+// Appends a material to the material table of the scene and returns its index.
+uint32_t addMaterial(Scene& scene, const Material& material);
+
+// Adds Mesh::material of the meshes that are not in meshMaterialIds yet to the material table. Called by loadScene and by
+// the BoundingVolumeHierarchy constructor, so meshes that are added by hand get a material as well.
+void addMeshMaterials(Scene& scene);
@@ -0,0 +1,182 @@
+#include "treelet_optimization.h"
+#include <tbb/parallel_invoke.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+
+using Node = BoundingVolumeHierarchy::Node;
+
+// Subtrees above this depth are optimized in parallel, deeper ones by the thread that reached them.
+static constexpr int ParallelDepth = 8;
+// Every round starts from the result of the previous one; most of the gain comes from the first round.
+static constexpr int NumRounds = 3;
+
+// Node of the tree while it is being restructured. The children are stored explicitly, so that the topology can change
+// without moving nodes around. The tree is written back in depth-first order at the end.
+struct TreeletNode {
+    glm::vec3 lower;
+    glm::vec3 upper;
+    uint32_t left; // Inner node: index of the first child
+    uint32_t right; // Inner node: index of the second child
+    uint32_t offset; // Leaf: same as Node::offset
+    uint32_t count; // Same as Node::count
+    float cost; // SAH cost of the subtree, not divided by the area of the root
+    int levels; // Number of levels of the subtree, 1 for a leaf
+};
+
+// Rebuilds the treelet below rootIndex with the topology of the lowest SAH cost, if that is cheaper than the current one.
+// The subtrees below the leaves of the treelet have to be final already. Returns true if the topology changed.
+static bool restructureTreelet(std::vector<TreeletNode>& tree, uint32_t rootIndex, int depth, const BvhSettings& settings)
+{
+    const size_t treeletSize = size_t(std::clamp(settings.treeletSize, 2, MaxTreeletSize));
+    const TreeletNode& root = tree[rootIndex];
+
+    // Grow the treelet by opening up the leaf with the largest area, which is the one that is visited most often.
+    std::array<uint32_t, MaxTreeletSize> leaves { root.left, root.right };
+    std::array<uint32_t, MaxTreeletSize - 1> innerNodes { rootIndex };
+    size_t numLeaves = 2;
+    size_t numInnerNodes = 1;
+    while (numLeaves < treeletSize) {
+        size_t largest = numLeaves;
+        float largestArea = -1.0f;
+        for (size_t i = 0; i < numLeaves; i++) {
+            const TreeletNode& leaf = tree[leaves[i]];
+            const float area = surfaceArea(leaf.lower, leaf.upper);
+            if (leaf.count == Node::InnerNode && area > largestArea) {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest == numLeaves)
+            break; // Only real leaves left
+        const uint32_t opened = leaves[largest];
+        innerNodes[numInnerNodes++] = opened;
+        leaves[largest] = tree[opened].left;
+        leaves[numLeaves++] = tree[opened].right;
+    }
+    if (numLeaves < 3)
+        return false; // Two leaves can only be combined in one way
+
+    // Box, cost and levels of the best subtree over every subset of the treelet leaves (bit i stands for leaves[i]).
+    // The subsets of a subset are smaller numbers, so they are always done before the subset itself.
+    constexpr size_t MaxSubsets = size_t(1) << MaxTreeletSize;
+    std::array<glm::vec3, MaxSubsets> lower, upper;
+    std::array<float, MaxSubsets> cost;
+    std::array<int, MaxSubsets> levels;
+    std::array<uint32_t, MaxSubsets> leftSubset; // Leaves that go below the first child
+    const uint32_t numSubsets = 1u << numLeaves;
+    for (uint32_t subset = 1; subset < numSubsets; subset++) {
+        const uint32_t firstLeaf = subset & (~subset + 1);
+        const uint32_t rest = subset ^ firstLeaf;
+        const TreeletNode& leaf = tree[leaves[uint32_t(std::countr_zero(subset))]];
+        if (rest == 0) {
+            lower[subset] = leaf.lower;
+            upper[subset] = leaf.upper;
+            cost[subset] = leaf.cost;
+            levels[subset] = leaf.levels;
+            continue;
+        }
+        lower[subset] = glm::min(lower[rest], leaf.lower);
+        upper[subset] = glm::max(upper[rest], leaf.upper);
+
+        // Only the partitions in which the first leaf goes left; the mirrored ones cost the same.
+        float bestCost = std::numeric_limits<float>::infinity();
+        uint32_t bestLeft = firstLeaf;
+        for (uint32_t part = rest;; part = (part - 1) & rest) {
+            const uint32_t left = firstLeaf | part;
+            const uint32_t right = subset ^ left;
+            if (right != 0 && cost[left] + cost[right] < bestCost) {
+                bestCost = cost[left] + cost[right];
+                bestLeft = left;
+            }
+            if (part == 0)
+                break;
+        }
+        cost[subset] = settings.traversalCost * surfaceArea(lower[subset], upper[subset]) + bestCost;
+        levels[subset] = 1 + std::max(levels[bestLeft], levels[subset ^ bestLeft]);
+        leftSubset[subset] = bestLeft;
+    }
+
+    // Keep the tree within maxLevels, counting the levels above the treelet. A tree that was already deeper may keep its depth.
+    const uint32_t allLeaves = numSubsets - 1;
+    const int maxLevels = std::max(settings.maxLevels - depth, root.levels);
+    if (!(cost[allLeaves] < root.cost * 0.9999f) || levels[allLeaves] > maxLevels)
+        return false;
+
+    // Reuse the inner nodes of the old treelet. The root comes first and keeps its index, so its parent stays valid.
+    size_t nextInnerNode = 0;
+    const auto build = [&](const auto& self, uint32_t subset) -> uint32_t {
+        if (std::has_single_bit(subset))
+            return leaves[uint32_t(std::countr_zero(subset))];
+        const uint32_t index = innerNodes[nextInnerNode++];
+        const uint32_t left = self(self, leftSubset[subset]);
+        const uint32_t right = self(self, subset ^ leftSubset[subset]);
+        tree[index] = TreeletNode { lower[subset], upper[subset], left, right, 0, Node::InnerNode, cost[subset], levels[subset] };
+        return index;
+    };
+    build(build, allLeaves);
+    return true;
+}
+
+// Optimizes the treelets of all inner nodes below index (bottom-up) and then the one of index itself. Also updates the
+// cost and the levels of every node. Returns true if anything changed.
+static bool optimizeSubtree(std::vector<TreeletNode>& tree, uint32_t index, int depth, const BvhSettings& settings)
+{
+    TreeletNode& node = tree[index];
+    if (node.count != Node::InnerNode) {
+        node.cost = settings.intersectionCost * float(node.count) * surfaceArea(node.lower, node.upper);
+        node.levels = 1;
+        return false;
+    }
+
+    bool leftChanged, rightChanged;
+    if (depth < ParallelDepth) {
+        tbb::parallel_invoke(
+            [&]() { leftChanged = optimizeSubtree(tree, node.left, depth + 1, settings); },
+            [&]() { rightChanged = optimizeSubtree(tree, node.right, depth + 1, settings); });
+    } else {
+        leftChanged = optimizeSubtree(tree, node.left, depth + 1, settings);
+        rightChanged = optimizeSubtree(tree, node.right, depth + 1, settings);
+    }
+    const TreeletNode& left = tree[node.left];
+    const TreeletNode& right = tree[node.right];
+    node.cost = settings.traversalCost * surfaceArea(node.lower, node.upper) + left.cost + right.cost;
+    node.levels = 1 + std::max(left.levels, right.levels);
+    const bool changed = restructureTreelet(tree, index, depth, settings);
+    return changed || leftChanged || rightChanged;
+}
+
+// Appends the subtree below index to nodes in depth-first order, with the first child right after its parent.
+static void writeSubtree(const std::vector<TreeletNode>& tree, uint32_t index, std::vector<Node>& nodes)
+{
+    const TreeletNode& node = tree[index];
+    const size_t position = nodes.size();
+    nodes.push_back(Node { node.lower, node.offset, node.upper, node.count });
+    if (node.count == Node::InnerNode) {
+        writeSubtree(tree, node.left, nodes);
+        nodes[position].offset = uint32_t(nodes.size());
+        writeSubtree(tree, node.right, nodes);
+    }
+}
+
+int optimizeTreelets(std::vector<Node>& nodes, const BvhSettings& settings)
+{
+    if (nodes.empty())
+        return 0;
+
+    std::vector<TreeletNode> tree(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const Node& node = nodes[i];
+        tree[i] = TreeletNode { node.lower, node.upper, uint32_t(i + 1), node.offset, node.offset, node.count, 0.0f, 0 };
+    }
+    for (int round = 0; round < NumRounds; round++) {
+        if (!optimizeSubtree(tree, 0, 0, settings))
+            break;
+    }
+
+    nodes.clear();
+    writeSubtree(tree, 0, nodes);
+    return tree[0].levels;
+}
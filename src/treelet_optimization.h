@@ -0,0 +1,14 @@
+#pragma once
+#include "bounding_volume_hierarchy.h"
+#include <vector>
+
+// Largest treelet that optimizeTreelets accepts. The work per treelet grows with 3^size.
+constexpr int MaxTreeletSize = 8;
+
+// Post-pass over a built binary tree (Karras and Aila, "Fast Parallel Construction of High-Quality Bounding Volume
+// Hierarchies"): for every inner node, bottom-up, the settings.treeletSize nodes with the largest area below it are
+// taken as the leaves of a treelet, and the treelet is rebuilt with the topology of the lowest SAH cost. The leaves of
+// the tree are left as they are, so the triangle order stays valid. Several rounds are run in parallel with TBB.
+// The nodes must not be padded yet. Returns the number of levels of the optimized tree, which stays within
+// settings.maxLevels (or the levels of the input tree if that was already deeper).
+int optimizeTreelets(std::vector<BoundingVolumeHierarchy::Node>& nodes, const BvhSettings& settings);
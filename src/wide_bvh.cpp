@@ -0,0 +1,573 @@
+#include "wide_bvh.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define WIDE_BVH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC allows AVX2 intrinsics in any function, the instructions are only executed if the CPU check passed.
+#define TARGET_AVX2
+#else
+// GCC and Clang only accept AVX2 intrinsics in functions that are compiled for AVX2.
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using Node = BoundingVolumeHierarchy::Node;
+template <size_t Width>
+using WideNode = BoundingVolumeHierarchy::WideNode<Width>;
+template <size_t Width>
+using CompressedWideNode = BoundingVolumeHierarchy::CompressedWideNode<Width>;
+template <size_t Width>
+using TrianglePacket = BoundingVolumeHierarchy::TrianglePacket<Width>;
+
+bool cpuSupportsAvx2()
+{
+#if !defined(WIDE_BVH_X86)
+    return false;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    std::array<int, 4> info;
+    __cpuid(info.data(), 0);
+    if (info[0] < 7)
+        return false;
+    // The operating system also has to save the AVX registers on context switches (OSXSAVE and XCR0 bits 1 and 2).
+    __cpuid(info.data(), 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info.data(), 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+BvhLayout resolveBvhLayout(BvhLayout layout)
+{
+    static const bool hasAvx2 = cpuSupportsAvx2();
+    if (layout == BvhLayout::WidestSupported)
+        return hasAvx2 ? BvhLayout::Wide8 : BvhLayout::Wide4;
+    if (layout == BvhLayout::Wide8 && !hasAvx2)
+        return BvhLayout::Wide4;
+    if (layout == BvhLayout::Wide8Compressed && !hasAvx2)
+        return BvhLayout::Wide4Compressed;
+    return layout;
+}
+
+TriangleTest resolveTriangleTest(TriangleTest triangleTest)
+{
+    static const bool hasAvx2 = cpuSupportsAvx2();
+    if (triangleTest == TriangleTest::Precomputed8 && !hasAvx2)
+        return TriangleTest::Precomputed4;
+    return triangleTest;
+}
+
+// Creates the wide node for the binary node nodes[binaryIndex] and, recursively, for all of its inner descendants
+// that do not get collapsed into it. Returns the index of the new wide node.
+template <size_t Width>
+static uint32_t collapseNode(const std::vector<Node>& nodes, uint32_t binaryIndex, std::vector<WideNode<Width>>& wideNodes)
+{
+    // Start with the two children (or the node itself if the whole tree is a single leaf) and keep opening the largest
+    // inner child, which is the one that rays are most likely to enter.
+    std::array<uint32_t, Width> children;
+    size_t numChildren = 0;
+    const Node& binaryNode = nodes[binaryIndex];
+    if (binaryNode.isLeaf()) {
+        children[numChildren++] = binaryIndex;
+    } else {
+        children[numChildren++] = binaryIndex + 1;
+        children[numChildren++] = binaryNode.offset;
+    }
+    while (numChildren < Width) {
+        size_t largest = numChildren;
+        float largestArea = -1.0f;
+        for (size_t i = 0; i < numChildren; i++) {
+            const Node& child = nodes[children[i]];
+            if (!child.isLeaf() && surfaceArea(child.lower, child.upper) > largestArea) {
+                largest = i;
+                largestArea = surfaceArea(child.lower, child.upper);
+            }
+        }
+        if (largest == numChildren)
+            break; // Only leaves left.
+        const uint32_t opened = children[largest];
+        children[largest] = opened + 1;
+        children[numChildren++] = nodes[opened].offset;
+    }
+
+    const uint32_t wideIndex = uint32_t(wideNodes.size());
+    WideNode<Width> wideNode;
+    wideNode.lowerX.fill(std::numeric_limits<float>::infinity());
+    wideNode.lowerY.fill(std::numeric_limits<float>::infinity());
+    wideNode.lowerZ.fill(std::numeric_limits<float>::infinity());
+    wideNode.upperX.fill(-std::numeric_limits<float>::infinity());
+    wideNode.upperY.fill(-std::numeric_limits<float>::infinity());
+    wideNode.upperZ.fill(-std::numeric_limits<float>::infinity());
+    wideNode.offset.fill(0);
+    wideNode.count.fill(0);
+    wideNodes.push_back(wideNode);
+
+    for (size_t i = 0; i < numChildren; i++) {
+        const Node& child = nodes[children[i]];
+        // Recurse first: push_back may move the array, so the new node is only written through its index.
+        const uint32_t offset = child.isLeaf() ? child.offset : collapseNode(nodes, children[i], wideNodes);
+        WideNode<Width>& target = wideNodes[wideIndex];
+        target.lowerX[i] = child.lower.x;
+        target.lowerY[i] = child.lower.y;
+        target.lowerZ[i] = child.lower.z;
+        target.upperX[i] = child.upper.x;
+        target.upperY[i] = child.upper.y;
+        target.upperZ[i] = child.upper.z;
+        target.offset[i] = offset;
+        target.count[i] = child.count;
+    }
+    return wideIndex;
+}
+
+template <size_t Width>
+static std::vector<WideNode<Width>> collapseBvh(const std::vector<Node>& nodes)
+{
+    std::vector<WideNode<Width>> wideNodes;
+    if (nodes.empty())
+        return wideNodes;
+    wideNodes.reserve(nodes.size() / (Width - 1) + 1);
+    collapseNode(nodes, 0, wideNodes);
+    return wideNodes;
+}
+
+std::vector<WideNode<4>> collapseBvh4(const std::vector<Node>& nodes)
+{
+    return collapseBvh<4>(nodes);
+}
+
+std::vector<WideNode<8>> collapseBvh8(const std::vector<Node>& nodes)
+{
+    return collapseBvh<8>(nodes);
+}
+
+// Largest grid coordinate q for which origin + q * scale is at most value.
+static uint8_t quantizeLower(float value, float origin, float scale)
+{
+    if (scale <= 0.0f)
+        return 0;
+    int q = std::clamp(int(std::floor((value - origin) / scale)), 0, 255);
+    // The division rounds, so check the value that the traversal decodes, with exactly the same operations.
+    while (q > 0 && origin + float(q) * scale > value)
+        q--;
+    return uint8_t(q);
+}
+
+// Smallest grid coordinate q for which origin + q * scale is at least value.
+static uint8_t quantizeUpper(float value, float origin, float scale)
+{
+    if (scale <= 0.0f)
+        return 0;
+    int q = std::clamp(int(std::ceil((value - origin) / scale)), 0, 255);
+    while (q < 255 && origin + float(q) * scale < value)
+        q++;
+    return uint8_t(q);
+}
+
+template <size_t Width>
+static void compressNode(const WideNode<Width>& wideNode, size_t index, std::vector<CompressedWideNode<Width>>& compressedNodes);
+
+// Splits a leaf child that has too many triangles for CompressedWideNode::count into children with the same box, in a
+// new node at the end of compressedNodes. Returns the index of that node.
+template <size_t Width>
+static uint32_t appendLeafChunks(const WideNode<Width>& parent, size_t child, std::vector<CompressedWideNode<Width>>& compressedNodes)
+{
+    WideNode<Width> chunks;
+    chunks.lowerX.fill(std::numeric_limits<float>::infinity());
+    chunks.lowerY.fill(std::numeric_limits<float>::infinity());
+    chunks.lowerZ.fill(std::numeric_limits<float>::infinity());
+    chunks.upperX.fill(-std::numeric_limits<float>::infinity());
+    chunks.upperY.fill(-std::numeric_limits<float>::infinity());
+    chunks.upperZ.fill(-std::numeric_limits<float>::infinity());
+    chunks.offset.fill(0);
+    chunks.count.fill(0);
+
+    uint32_t offset = parent.offset[child];
+    uint32_t remaining = parent.count[child];
+    for (size_t i = 0; i < Width && remaining > 0; i++) {
+        // The last slot takes whatever is left, compressNode splits it up again if it is still too large.
+        const uint32_t count = i == Width - 1 ? remaining : std::min(remaining, CompressedWideNode<Width>::MaxLeafCount);
+        chunks.lowerX[i] = parent.lowerX[child];
+        chunks.lowerY[i] = parent.lowerY[child];
+        chunks.lowerZ[i] = parent.lowerZ[child];
+        chunks.upperX[i] = parent.upperX[child];
+        chunks.upperY[i] = parent.upperY[child];
+        chunks.upperZ[i] = parent.upperZ[child];
+        chunks.offset[i] = offset;
+        chunks.count[i] = count;
+        offset += count;
+        remaining -= count;
+    }
+
+    const size_t index = compressedNodes.size();
+    compressedNodes.emplace_back();
+    compressNode(chunks, index, compressedNodes);
+    return uint32_t(index);
+}
+
+// Quantizes the child boxes of wideNode on a grid over the union of the child boxes and stores the result in compressedNodes[index].
+template <size_t Width>
+static void compressNode(const WideNode<Width>& wideNode, size_t index, std::vector<CompressedWideNode<Width>>& compressedNodes)
+{
+    glm::vec3 lower { std::numeric_limits<float>::infinity() };
+    glm::vec3 upper { -std::numeric_limits<float>::infinity() };
+    for (size_t i = 0; i < Width; i++) {
+        if (wideNode.count[i] == 0)
+            continue;
+        lower = glm::min(lower, glm::vec3(wideNode.lowerX[i], wideNode.lowerY[i], wideNode.lowerZ[i]));
+        upper = glm::max(upper, glm::vec3(wideNode.upperX[i], wideNode.upperY[i], wideNode.upperZ[i]));
+    }
+
+    CompressedWideNode<Width> node;
+    node.origin = lower;
+    node.scale = (upper - lower) / 255.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        // The division rounds as well, make sure that the last grid coordinate still reaches the upper side.
+        while (node.origin[axis] + 255.0f * node.scale[axis] < upper[axis])
+            node.scale[axis] = std::nextafter(node.scale[axis], std::numeric_limits<float>::infinity());
+    }
+    node.lowerX.fill(255);
+    node.lowerY.fill(255);
+    node.lowerZ.fill(255);
+    node.upperX.fill(0);
+    node.upperY.fill(0);
+    node.upperZ.fill(0);
+    node.offset.fill(0);
+    node.count.fill(0);
+
+    for (size_t i = 0; i < Width; i++) {
+        uint32_t offset = wideNode.offset[i];
+        uint32_t count = wideNode.count[i];
+        if (count == 0)
+            continue;
+        if (count != Node::InnerNode && count > CompressedWideNode<Width>::MaxLeafCount) {
+            offset = appendLeafChunks(wideNode, i, compressedNodes);
+            count = Node::InnerNode;
+        }
+        node.lowerX[i] = quantizeLower(wideNode.lowerX[i], node.origin.x, node.scale.x);
+        node.lowerY[i] = quantizeLower(wideNode.lowerY[i], node.origin.y, node.scale.y);
+        node.lowerZ[i] = quantizeLower(wideNode.lowerZ[i], node.origin.z, node.scale.z);
+        node.upperX[i] = quantizeUpper(wideNode.upperX[i], node.origin.x, node.scale.x);
+        node.upperY[i] = quantizeUpper(wideNode.upperY[i], node.origin.y, node.scale.y);
+        node.upperZ[i] = quantizeUpper(wideNode.upperZ[i], node.origin.z, node.scale.z);
+        node.offset[i] = offset;
+        node.count[i] = count == Node::InnerNode ? CompressedWideNode<Width>::InnerChild : uint8_t(count);
+    }
+    compressedNodes[index] = node;
+}
+
+template <size_t Width>
+static std::vector<CompressedWideNode<Width>> compressBvh(const std::vector<WideNode<Width>>& wideNodes)
+{
+    std::vector<CompressedWideNode<Width>> compressedNodes(wideNodes.size());
+    for (size_t i = 0; i < wideNodes.size(); i++)
+        compressNode(wideNodes[i], i, compressedNodes);
+    return compressedNodes;
+}
+
+std::vector<CompressedWideNode<4>> compressBvh4(const std::vector<WideNode<4>>& wideNodes)
+{
+    return compressBvh<4>(wideNodes);
+}
+
+std::vector<CompressedWideNode<8>> compressBvh8(const std::vector<WideNode<8>>& wideNodes)
+{
+    return compressBvh<8>(wideNodes);
+}
+
+template <size_t Width>
+static std::vector<TrianglePacket<Width>> buildTrianglePackets(const std::vector<Node>& nodes, const std::vector<glm::mat3>& triangles, std::vector<uint32_t>& packetIndices)
+{
+    std::vector<TrianglePacket<Width>> packets;
+    packetIndices.assign(triangles.size(), 0);
+    for (const Node& node : nodes) {
+        if (!node.isLeaf())
+            continue;
+        // Every leaf starts a new packet, so the packets of a leaf never hold triangles of another leaf.
+        for (uint32_t first = node.offset; first < node.offset + node.count; first += uint32_t(Width)) {
+            TrianglePacket<Width> packet {};
+            packet.firstTriangle = first;
+            packet.count = std::min(uint32_t(Width), node.offset + node.count - first);
+            for (uint32_t lane = 0; lane < packet.count; lane++) {
+                const TriangleRecord record = makeTriangleRecord(triangles[first + lane][0], triangles[first + lane][1], triangles[first + lane][2]);
+                packet.v0X[lane] = record.v0.x;
+                packet.v0Y[lane] = record.v0.y;
+                packet.v0Z[lane] = record.v0.z;
+                packet.edge1X[lane] = record.edge1.x;
+                packet.edge1Y[lane] = record.edge1.y;
+                packet.edge1Z[lane] = record.edge1.z;
+                packet.edge2X[lane] = record.edge2.x;
+                packet.edge2Y[lane] = record.edge2.y;
+                packet.edge2Z[lane] = record.edge2.z;
+                packetIndices[first + lane] = uint32_t(packets.size());
+            }
+            packets.push_back(packet);
+        }
+    }
+    return packets;
+}
+
+std::vector<TrianglePacket<4>> buildTrianglePackets4(const std::vector<Node>& nodes, const std::vector<glm::mat3>& triangles, std::vector<uint32_t>& packetIndices)
+{
+    return buildTrianglePackets<4>(nodes, triangles, packetIndices);
+}
+
+std::vector<TrianglePacket<8>> buildTrianglePackets8(const std::vector<Node>& nodes, const std::vector<glm::mat3>& triangles, std::vector<uint32_t>& packetIndices)
+{
+    return buildTrianglePackets<8>(nodes, triangles, packetIndices);
+}
+
+// Like in intersectRayWithBox, the sign mask picks the near and far plane per axis, so near and far are loaded from
+// either the lower or the upper array without any per-child swaps. The max and min instructions return their second
+// operand if either one is NaN, so the accumulated value is passed second to ignore a NaN slab (0 * infinity).
+uint32_t intersectRayWithWideNode(const WideNode<4>& node, const RayInverse& ray, float tMax, float* tEntry)
+{
+#if defined(WIDE_BVH_X86)
+    const __m128 nearX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.negative.x ? node.upperX.data() : node.lowerX.data()), _mm_set1_ps(ray.origin.x)), _mm_set1_ps(ray.invDirection.x));
+    const __m128 farX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.negative.x ? node.lowerX.data() : node.upperX.data()), _mm_set1_ps(ray.origin.x)), _mm_set1_ps(ray.invDirection.x));
+    const __m128 nearY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.negative.y ? node.upperY.data() : node.lowerY.data()), _mm_set1_ps(ray.origin.y)), _mm_set1_ps(ray.invDirection.y));
+    const __m128 farY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.negative.y ? node.lowerY.data() : node.upperY.data()), _mm_set1_ps(ray.origin.y)), _mm_set1_ps(ray.invDirection.y));
+    const __m128 nearZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.negative.z ? node.upperZ.data() : node.lowerZ.data()), _mm_set1_ps(ray.origin.z)), _mm_set1_ps(ray.invDirection.z));
+    const __m128 farZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.negative.z ? node.lowerZ.data() : node.upperZ.data()), _mm_set1_ps(ray.origin.z)), _mm_set1_ps(ray.invDirection.z));
+
+    const __m128 entry = _mm_max_ps(nearZ, _mm_max_ps(nearY, _mm_max_ps(nearX, _mm_setzero_ps())));
+    const __m128 exit = _mm_min_ps(farZ, _mm_min_ps(farY, _mm_min_ps(farX, _mm_set1_ps(tMax))));
+    _mm_store_ps(tEntry, entry);
+    return uint32_t(_mm_movemask_ps(_mm_cmple_ps(entry, exit)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < 4; i++) {
+        float tExit;
+        const glm::vec3 lower { node.lowerX[i], node.lowerY[i], node.lowerZ[i] };
+        const glm::vec3 upper { node.upperX[i], node.upperY[i], node.upperZ[i] };
+        if (intersectRayWithBox(lower, upper, ray, tMax, tEntry[i], tExit))
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+#if defined(WIDE_BVH_X86)
+TARGET_AVX2 uint32_t intersectRayWithWideNode(const WideNode<8>& node, const RayInverse& ray, float tMax, float* tEntry)
+{
+    const __m256 nearX = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(ray.negative.x ? node.upperX.data() : node.lowerX.data()), _mm256_set1_ps(ray.origin.x)), _mm256_set1_ps(ray.invDirection.x));
+    const __m256 farX = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(ray.negative.x ? node.lowerX.data() : node.upperX.data()), _mm256_set1_ps(ray.origin.x)), _mm256_set1_ps(ray.invDirection.x));
+    const __m256 nearY = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(ray.negative.y ? node.upperY.data() : node.lowerY.data()), _mm256_set1_ps(ray.origin.y)), _mm256_set1_ps(ray.invDirection.y));
+    const __m256 farY = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(ray.negative.y ? node.lowerY.data() : node.upperY.data()), _mm256_set1_ps(ray.origin.y)), _mm256_set1_ps(ray.invDirection.y));
+    const __m256 nearZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(ray.negative.z ? node.upperZ.data() : node.lowerZ.data()), _mm256_set1_ps(ray.origin.z)), _mm256_set1_ps(ray.invDirection.z));
+    const __m256 farZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(ray.negative.z ? node.lowerZ.data() : node.upperZ.data()), _mm256_set1_ps(ray.origin.z)), _mm256_set1_ps(ray.invDirection.z));
+
+    const __m256 entry = _mm256_max_ps(nearZ, _mm256_max_ps(nearY, _mm256_max_ps(nearX, _mm256_setzero_ps())));
+    const __m256 exit = _mm256_min_ps(farZ, _mm256_min_ps(farY, _mm256_min_ps(farX, _mm256_set1_ps(tMax))));
+    _mm256_store_ps(tEntry, entry);
+    return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ)));
+}
+#else
+uint32_t intersectRayWithWideNode(const WideNode<8>&, const RayInverse&, float, float*)
+{
+    return 0; // Never used: resolveBvhLayout never picks Wide8 without AVX2.
+}
+#endif
+
+#if defined(WIDE_BVH_X86)
+// origin + q * scale for 4 grid coordinates. SSE2 has no single instruction that widens bytes to 32 bits, so they are
+// unpacked with zeros twice.
+static __m128 decodeGridCoordinates(const std::array<uint8_t, 4>& coordinates, float origin, float scale)
+{
+    int packed;
+    std::memcpy(&packed, coordinates.data(), sizeof(packed));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i widened = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(widened), _mm_set1_ps(scale)));
+}
+
+TARGET_AVX2 static __m256 decodeGridCoordinates(const std::array<uint8_t, 8>& coordinates, float origin, float scale)
+{
+    const __m256i widened = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(coordinates.data())));
+    return _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(_mm256_cvtepi32_ps(widened), _mm256_set1_ps(scale)));
+}
+#endif
+
+// The decoded child boxes go through the same slab test as the boxes of the uncompressed nodes.
+uint32_t intersectRayWithWideNode(const CompressedWideNode<4>& node, const RayInverse& ray, float tMax, float* tEntry)
+{
+#if defined(WIDE_BVH_X86)
+    const __m128 nearX = _mm_mul_ps(_mm_sub_ps(decodeGridCoordinates(ray.negative.x ? node.upperX : node.lowerX, node.origin.x, node.scale.x), _mm_set1_ps(ray.origin.x)), _mm_set1_ps(ray.invDirection.x));
+    const __m128 farX = _mm_mul_ps(_mm_sub_ps(decodeGridCoordinates(ray.negative.x ? node.lowerX : node.upperX, node.origin.x, node.scale.x), _mm_set1_ps(ray.origin.x)), _mm_set1_ps(ray.invDirection.x));
+    const __m128 nearY = _mm_mul_ps(_mm_sub_ps(decodeGridCoordinates(ray.negative.y ? node.upperY : node.lowerY, node.origin.y, node.scale.y), _mm_set1_ps(ray.origin.y)), _mm_set1_ps(ray.invDirection.y));
+    const __m128 farY = _mm_mul_ps(_mm_sub_ps(decodeGridCoordinates(ray.negative.y ? node.lowerY : node.upperY, node.origin.y, node.scale.y), _mm_set1_ps(ray.origin.y)), _mm_set1_ps(ray.invDirection.y));
+    const __m128 nearZ = _mm_mul_ps(_mm_sub_ps(decodeGridCoordinates(ray.negative.z ? node.upperZ : node.lowerZ, node.origin.z, node.scale.z), _mm_set1_ps(ray.origin.z)), _mm_set1_ps(ray.invDirection.z));
+    const __m128 farZ = _mm_mul_ps(_mm_sub_ps(decodeGridCoordinates(ray.negative.z ? node.lowerZ : node.upperZ, node.origin.z, node.scale.z), _mm_set1_ps(ray.origin.z)), _mm_set1_ps(ray.invDirection.z));
+
+    const __m128 entry = _mm_max_ps(nearZ, _mm_max_ps(nearY, _mm_max_ps(nearX, _mm_setzero_ps())));
+    const __m128 exit = _mm_min_ps(farZ, _mm_min_ps(farY, _mm_min_ps(farX, _mm_set1_ps(tMax))));
+    _mm_store_ps(tEntry, entry);
+    return uint32_t(_mm_movemask_ps(_mm_cmple_ps(entry, exit)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < 4; i++) {
+        float tExit;
+        const AxisAlignedBox box = decodeChildBox(node, i);
+        if (intersectRayWithBox(box.lower, box.upper, ray, tMax, tEntry[i], tExit))
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+#if defined(WIDE_BVH_X86)
+TARGET_AVX2 uint32_t intersectRayWithWideNode(const CompressedWideNode<8>& node, const RayInverse& ray, float tMax, float* tEntry)
+{
+    const __m256 nearX = _mm256_mul_ps(_mm256_sub_ps(decodeGridCoordinates(ray.negative.x ? node.upperX : node.lowerX, node.origin.x, node.scale.x), _mm256_set1_ps(ray.origin.x)), _mm256_set1_ps(ray.invDirection.x));
+    const __m256 farX = _mm256_mul_ps(_mm256_sub_ps(decodeGridCoordinates(ray.negative.x ? node.lowerX : node.upperX, node.origin.x, node.scale.x), _mm256_set1_ps(ray.origin.x)), _mm256_set1_ps(ray.invDirection.x));
+    const __m256 nearY = _mm256_mul_ps(_mm256_sub_ps(decodeGridCoordinates(ray.negative.y ? node.upperY : node.lowerY, node.origin.y, node.scale.y), _mm256_set1_ps(ray.origin.y)), _mm256_set1_ps(ray.invDirection.y));
+    const __m256 farY = _mm256_mul_ps(_mm256_sub_ps(decodeGridCoordinates(ray.negative.y ? node.lowerY : node.upperY, node.origin.y, node.scale.y), _mm256_set1_ps(ray.origin.y)), _mm256_set1_ps(ray.invDirection.y));
+    const __m256 nearZ = _mm256_mul_ps(_mm256_sub_ps(decodeGridCoordinates(ray.negative.z ? node.upperZ : node.lowerZ, node.origin.z, node.scale.z), _mm256_set1_ps(ray.origin.z)), _mm256_set1_ps(ray.invDirection.z));
+    const __m256 farZ = _mm256_mul_ps(_mm256_sub_ps(decodeGridCoordinates(ray.negative.z ? node.lowerZ : node.upperZ, node.origin.z, node.scale.z), _mm256_set1_ps(ray.origin.z)), _mm256_set1_ps(ray.invDirection.z));
+
+    const __m256 entry = _mm256_max_ps(nearZ, _mm256_max_ps(nearY, _mm256_max_ps(nearX, _mm256_setzero_ps())));
+    const __m256 exit = _mm256_min_ps(farZ, _mm256_min_ps(farY, _mm256_min_ps(farX, _mm256_set1_ps(tMax))));
+    _mm256_store_ps(tEntry, entry);
+    return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ)));
+}
+#else
+uint32_t intersectRayWithWideNode(const CompressedWideNode<8>&, const RayInverse&, float, float*)
+{
+    return 0; // Never used: resolveBvhLayout never picks Wide8Compressed without AVX2.
+}
+#endif
+
+// Picks the nearest of the hits in mask from the distances and weights of all lanes. Lanes are visited in order and only
+// a strictly nearer hit replaces the current one, like the scalar loop over the triangles of a leaf does.
+static int nearestLane(uint32_t mask, const float* t, const float* u, const float* v, TriangleHit& hit)
+{
+    int nearest = -1;
+    for (; mask != 0; mask &= mask - 1) {
+        const int lane = std::countr_zero(mask);
+        if (nearest < 0 || t[lane] < t[nearest])
+            nearest = lane;
+    }
+    if (nearest >= 0)
+        hit = TriangleHit { t[nearest], u[nearest], v[nearest] };
+    return nearest;
+}
+
+// The operations are done in the same order as glm::cross and glm::dot in the scalar test, and the comparisons treat
+// NaN the same way, so both give bit for bit the same hits.
+int intersectRayWithTrianglePacket(const TrianglePacket<4>& packet, const Ray& ray, uint32_t laneMask, TriangleHit& hit)
+{
+#if defined(WIDE_BVH_X86)
+    const __m128 directionX = _mm_set1_ps(ray.direction.x), directionY = _mm_set1_ps(ray.direction.y), directionZ = _mm_set1_ps(ray.direction.z);
+    const __m128 edge1X = _mm_load_ps(packet.edge1X.data()), edge1Y = _mm_load_ps(packet.edge1Y.data()), edge1Z = _mm_load_ps(packet.edge1Z.data());
+    const __m128 edge2X = _mm_load_ps(packet.edge2X.data()), edge2Y = _mm_load_ps(packet.edge2Y.data()), edge2Z = _mm_load_ps(packet.edge2Z.data());
+
+    // p = cross(direction, edge2)
+    const __m128 pX = _mm_sub_ps(_mm_mul_ps(directionY, edge2Z), _mm_mul_ps(edge2Y, directionZ));
+    const __m128 pY = _mm_sub_ps(_mm_mul_ps(directionZ, edge2X), _mm_mul_ps(edge2Z, directionX));
+    const __m128 pZ = _mm_sub_ps(_mm_mul_ps(directionX, edge2Y), _mm_mul_ps(edge2X, directionY));
+    const __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, pX), _mm_mul_ps(edge1Y, pY)), _mm_mul_ps(edge1Z, pZ));
+    const __m128 invDeterminant = _mm_div_ps(_mm_set1_ps(1.0f), determinant);
+
+    const __m128 toOriginX = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(packet.v0X.data()));
+    const __m128 toOriginY = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(packet.v0Y.data()));
+    const __m128 toOriginZ = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(packet.v0Z.data()));
+    const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(toOriginX, pX), _mm_mul_ps(toOriginY, pY)), _mm_mul_ps(toOriginZ, pZ)), invDeterminant);
+    // q = cross(toOrigin, edge1)
+    const __m128 qX = _mm_sub_ps(_mm_mul_ps(toOriginY, edge1Z), _mm_mul_ps(edge1Y, toOriginZ));
+    const __m128 qY = _mm_sub_ps(_mm_mul_ps(toOriginZ, edge1X), _mm_mul_ps(edge1Z, toOriginX));
+    const __m128 qZ = _mm_sub_ps(_mm_mul_ps(toOriginX, edge1Y), _mm_mul_ps(edge1X, toOriginY));
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, qX), _mm_mul_ps(directionY, qY)), _mm_mul_ps(directionZ, qZ)), invDeterminant);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)), invDeterminant);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 accepted = _mm_cmpneq_ps(determinant, zero);
+    accepted = _mm_and_ps(accepted, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+    accepted = _mm_and_ps(accepted, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+    accepted = _mm_and_ps(accepted, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, _mm_set1_ps(ray.t))));
+    const uint32_t mask = uint32_t(_mm_movemask_ps(accepted)) & laneMask;
+    if (mask == 0)
+        return -1;
+
+    alignas(16) std::array<float, 4> tLanes, uLanes, vLanes;
+    _mm_store_ps(tLanes.data(), t);
+    _mm_store_ps(uLanes.data(), u);
+    _mm_store_ps(vLanes.data(), v);
+    return nearestLane(mask, tLanes.data(), uLanes.data(), vLanes.data(), hit);
+#else
+    std::array<float, 4> tLanes, uLanes, vLanes;
+    uint32_t mask = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        const TriangleRecord record {
+            glm::vec3(packet.v0X[lane], packet.v0Y[lane], packet.v0Z[lane]),
+            glm::vec3(packet.edge1X[lane], packet.edge1Y[lane], packet.edge1Z[lane]),
+            glm::vec3(packet.edge2X[lane], packet.edge2Y[lane], packet.edge2Z[lane])
+        };
+        TriangleHit laneHit;
+        if ((laneMask >> lane & 1) && intersectRayWithTriangle(record, ray, laneHit)) {
+            mask |= 1u << lane;
+            tLanes[lane] = laneHit.t;
+            uLanes[lane] = laneHit.u;
+            vLanes[lane] = laneHit.v;
+        }
+    }
+    return nearestLane(mask, tLanes.data(), uLanes.data(), vLanes.data(), hit);
+#endif
+}
+
+#if defined(WIDE_BVH_X86)
+TARGET_AVX2 int intersectRayWithTrianglePacket(const TrianglePacket<8>& packet, const Ray& ray, uint32_t laneMask, TriangleHit& hit)
+{
+    const __m256 directionX = _mm256_set1_ps(ray.direction.x), directionY = _mm256_set1_ps(ray.direction.y), directionZ = _mm256_set1_ps(ray.direction.z);
+    const __m256 edge1X = _mm256_load_ps(packet.edge1X.data()), edge1Y = _mm256_load_ps(packet.edge1Y.data()), edge1Z = _mm256_load_ps(packet.edge1Z.data());
+    const __m256 edge2X = _mm256_load_ps(packet.edge2X.data()), edge2Y = _mm256_load_ps(packet.edge2Y.data()), edge2Z = _mm256_load_ps(packet.edge2Z.data());
+
+    const __m256 pX = _mm256_sub_ps(_mm256_mul_ps(directionY, edge2Z), _mm256_mul_ps(edge2Y, directionZ));
+    const __m256 pY = _mm256_sub_ps(_mm256_mul_ps(directionZ, edge2X), _mm256_mul_ps(edge2Z, directionX));
+    const __m256 pZ = _mm256_sub_ps(_mm256_mul_ps(directionX, edge2Y), _mm256_mul_ps(edge2X, directionY));
+    const __m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1X, pX), _mm256_mul_ps(edge1Y, pY)), _mm256_mul_ps(edge1Z, pZ));
+    const __m256 invDeterminant = _mm256_div_ps(_mm256_set1_ps(1.0f), determinant);
+
+    const __m256 toOriginX = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_load_ps(packet.v0X.data()));
+    const __m256 toOriginY = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_load_ps(packet.v0Y.data()));
+    const __m256 toOriginZ = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_load_ps(packet.v0Z.data()));
+    const __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(toOriginX, pX), _mm256_mul_ps(toOriginY, pY)), _mm256_mul_ps(toOriginZ, pZ)), invDeterminant);
+    const __m256 qX = _mm256_sub_ps(_mm256_mul_ps(toOriginY, edge1Z), _mm256_mul_ps(edge1Y, toOriginZ));
+    const __m256 qY = _mm256_sub_ps(_mm256_mul_ps(toOriginZ, edge1X), _mm256_mul_ps(edge1Z, toOriginX));
+    const __m256 qZ = _mm256_sub_ps(_mm256_mul_ps(toOriginX, edge1Y), _mm256_mul_ps(edge1X, toOriginY));
+    const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(directionX, qX), _mm256_mul_ps(directionY, qY)), _mm256_mul_ps(directionZ, qZ)), invDeterminant);
+    const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge2X, qX), _mm256_mul_ps(edge2Y, qY)), _mm256_mul_ps(edge2Z, qZ)), invDeterminant);
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 accepted = _mm256_cmp_ps(determinant, zero, _CMP_NEQ_UQ);
+    accepted = _mm256_and_ps(accepted, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_NLT_UQ), _mm256_cmp_ps(u, one, _CMP_NGT_UQ)));
+    accepted = _mm256_and_ps(accepted, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_NLT_UQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_NGT_UQ)));
+    accepted = _mm256_and_ps(accepted, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(ray.t), _CMP_LT_OQ)));
+    const uint32_t mask = uint32_t(_mm256_movemask_ps(accepted)) & laneMask;
+    if (mask == 0)
+        return -1;
+
+    alignas(32) std::array<float, 8> tLanes, uLanes, vLanes;
+    _mm256_store_ps(tLanes.data(), t);
+    _mm256_store_ps(uLanes.data(), u);
+    _mm256_store_ps(vLanes.data(), v);
+    return nearestLane(mask, tLanes.data(), uLanes.data(), vLanes.data(), hit);
+}
+#else
+int intersectRayWithTrianglePacket(const TrianglePacket<8>&, const Ray&, uint32_t, TriangleHit&)
+{
+    return -1; // Never used: resolveTriangleTest never picks Precomputed8 without AVX2.
+}
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+#include "bounding_volume_hierarchy.h"
+#include "ray_tracing.h"
+#include <cstdint>
+#include <vector>
+
+// True if the CPU (and the operating system) support AVX2, which the 8-wide node test needs.
+bool cpuSupportsAvx2();
+
+// Replaces BvhLayout::WidestSupported by the widest layout that this CPU supports. Wide8 falls back to Wide4 without AVX2,
+// and Wide8Compressed to Wide4Compressed.
+BvhLayout resolveBvhLayout(BvhLayout layout);
+
+// Replaces TriangleTest::Precomputed8 by Precomputed4 if this CPU does not support AVX2.
+TriangleTest resolveTriangleTest(TriangleTest triangleTest);
+
+// Collapses a binary tree (as built by BoundingVolumeHierarchy) into a tree with up to Width children per node, by
+// repeatedly replacing the inner child with the largest surface area by its own two children. The leaves are kept as
+// they are, so they still reference the same triangle (or instance) ranges. The root is wideNodes[0].
+std::vector<BoundingVolumeHierarchy::WideNode<4>> collapseBvh4(const std::vector<BoundingVolumeHierarchy::Node>& nodes);
+std::vector<BoundingVolumeHierarchy::WideNode<8>> collapseBvh8(const std::vector<BoundingVolumeHierarchy::Node>& nodes);
+
+// Quantizes the child boxes of a collapsed tree. Node i of the result corresponds to wideNodes[i], so the child offsets stay
+// the same. Leaves with more than CompressedWideNode::MaxLeafCount triangles are split into several children with the
+// same box, in extra nodes that are added at the end.
+std::vector<BoundingVolumeHierarchy::CompressedWideNode<4>> compressBvh4(const std::vector<BoundingVolumeHierarchy::WideNode<4>>& wideNodes);
+std::vector<BoundingVolumeHierarchy::CompressedWideNode<8>> compressBvh8(const std::vector<BoundingVolumeHierarchy::WideNode<8>>& wideNodes);
+
+// Slab test of the ray against the boxes of all children of the node at once. Returns a bit mask of the children that
+// the ray overlaps somewhere in [0, tMax] and stores the distances at which it enters them in tEntry (which must be
+// aligned to the size of the node arrays). Gives the same results as intersectRayWithBox for every child.
+uint32_t intersectRayWithWideNode(const BoundingVolumeHierarchy::WideNode<4>& node, const RayInverse& ray, float tMax, float* tEntry);
+// Only call this if cpuSupportsAvx2() returns true.
+uint32_t intersectRayWithWideNode(const BoundingVolumeHierarchy::WideNode<8>& node, const RayInverse& ray, float tMax, float* tEntry);
+
+// The same for compressed nodes: the child boxes are decoded from the grid and then tested like above.
+uint32_t intersectRayWithWideNode(const BoundingVolumeHierarchy::CompressedWideNode<4>& node, const RayInverse& ray, float tMax, float* tEntry);
+// Only call this if cpuSupportsAvx2() returns true.
+uint32_t intersectRayWithWideNode(const BoundingVolumeHierarchy::CompressedWideNode<8>& node, const RayInverse& ray, float tMax, float* tEntry);
+
+// Stores the triangles of every leaf of the tree in packets of Width triangles, see TrianglePacket. triangles are the
+// triangles of the tree in BVH order. packetIndices[i] is set to the packet that holds triangle i.
+std::vector<BoundingVolumeHierarchy::TrianglePacket<4>> buildTrianglePackets4(const std::vector<BoundingVolumeHierarchy::Node>& nodes, const std::vector<glm::mat3>& triangles, std::vector<uint32_t>& packetIndices);
+std::vector<BoundingVolumeHierarchy::TrianglePacket<8>> buildTrianglePackets8(const std::vector<BoundingVolumeHierarchy::Node>& nodes, const std::vector<glm::mat3>& triangles, std::vector<uint32_t>& packetIndices);
+
+// Möller–Trumbore against the triangles of the lanes in laneMask at once. Returns the lane of the nearest hit in
+// (0, ray.t), or -1 if there is none, and stores that hit in hit. Computes exactly the same values as the scalar
+// intersectRayWithTriangle on a TriangleRecord, and picks the lowest lane if several hits are equally near.
+int intersectRayWithTrianglePacket(const BoundingVolumeHierarchy::TrianglePacket<4>& packet, const Ray& ray, uint32_t laneMask, TriangleHit& hit);
+// Only call this if cpuSupportsAvx2() returns true.
+int intersectRayWithTrianglePacket(const BoundingVolumeHierarchy::TrianglePacket<8>& packet, const Ray& ray, uint32_t laneMask, TriangleHit& hit);
+
+// Box of child slot child of a compressed node, decoded in exactly the same way as intersectRayWithWideNode does.
+template <size_t Width>
+inline AxisAlignedBox decodeChildBox(const BoundingVolumeHierarchy::CompressedWideNode<Width>& node, size_t child)
+{
+    const glm::vec3 lower { float(node.lowerX[child]), float(node.lowerY[child]), float(node.lowerZ[child]) };
+    const glm::vec3 upper { float(node.upperX[child]), float(node.upperY[child]), float(node.upperZ[child]) };
+    return AxisAlignedBox { node.origin + lower * node.scale, node.origin + upper * node.scale };
+}